@@ -0,0 +1,132 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#ifndef	_OPENWXR_ATMO_INTF_H_
+#define	_OPENWXR_ATMO_INTF_H_
+
+#include <acfutils/geom.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct atmo_s atmo_t;
+
+typedef struct {
+	geo_pos3_t	origin;		/* beam origin point */
+	bool_t		vert_scan;	/* are we scanning vert or horiz? */
+	double		ant_rhdg;	/* rel antenna hdg from aircraft */
+	vect2_t		dir;		/* X-hdg degrees, Y-pitch degrees up */
+	vect2_t		shape;		/* X-horiz degrees, Y-vert degrees */
+	double		energy;		/* beam energy (no units), log scale */
+	double		range;		/* scan line sampling range */
+	double		max_range;	/* for calibrating energy depletion */
+	int		num_samples;	/* number of samples to return */
+	double		*energy_out;	/* energy return samples, log scale */
+	double		*doppler_out;	/* freq shift, relative motion, m/s */
+	/*
+	 * Returns weaker than this (in energy_out units) don't show up on
+	 * the display at its current gain & colors. The atmosphere may
+	 * stop computing the scan line once no range bin can return this
+	 * much anymore, leaving the rest of energy_out at 0. 0 means the
+	 * whole scan line must be computed.
+	 */
+	double		min_energy;
+} scan_line_t;
+
+/*
+ * An atmosphere answers the WXR's questions about how much energy the
+ * precip along a scan line reflects back.
+ *
+ * set_range - informs the atmosphere of the range scale of the WXR.
+ * probe - fills in `energy_out' and `doppler_out' of `sl'.
+ * probe_batch - optional, same as calling probe on each of the `num'
+ *	scan lines of `sl'. Only used with OPENWXR_ATMO_CAP_BATCH.
+ */
+struct atmo_s {
+	void		(*set_range)(double rng);
+	void		(*probe)(scan_line_t *sl);
+	void		(*probe_batch)(scan_line_t *sl, unsigned num);
+};
+
+/*
+ * Capability flags of an atmosphere provider:
+ *
+ * OPENWXR_ATMO_CAP_BATCH - the provider implements probe_batch. All
+ *	scan lines of a WXR worker tick are then probed in one call,
+ *	ahead of the remaining scan line computation.
+ * OPENWXR_ATMO_CAP_MT_SAFE - probe (and probe_batch) may be called from
+ *	multiple threads at the same time. Without this flag, OpenWXR
+ *	only ever calls into the provider from one thread at a time and
+ *	computes the scan lines of each WXR instance on a single thread.
+ * OPENWXR_ATMO_CAP_NATIVE_RES - `native_res' is the resolution of the
+ *	provider's underlying weather data.
+ */
+typedef enum {
+	OPENWXR_ATMO_CAP_BATCH =	1 << 0,
+	OPENWXR_ATMO_CAP_MT_SAFE =	1 << 1,
+	OPENWXR_ATMO_CAP_NATIVE_RES =	1 << 2
+} openwxr_atmo_cap_t;
+
+#define	OPENWXR_ATMO_NAME_LEN	32
+
+/*
+ * Describes an atmosphere provider registered via OPENWXR_ATMO_REGISTER.
+ * OpenWXR copies the structure, but `atmo' must remain valid until the
+ * provider is unregistered again, which in turn is only possible after
+ * all WXR instances using it have been destroyed.
+ */
+typedef struct {
+	char		name[OPENWXR_ATMO_NAME_LEN];
+	unsigned	caps;		/* bitmask of openwxr_atmo_cap_t */
+	double		native_res;	/* meters, see CAP_NATIVE_RES */
+	const atmo_t	*atmo;
+} openwxr_atmo_provider_t;
+
+/*
+ * OpenWXR's built-in voxel atmosphere (provider "vox", must be enabled
+ * using the vox/enable config key). It holds radar reflectivity in a
+ * sparse volume, which some other plugin fills in through this
+ * interface, obtained using OPENWXR_ATMO_VOX_GET.
+ *
+ * The volume is a grid of voxels in a local east-north-up frame around
+ * a reference point. Voxel (0, 0, z) has its south-west corner at the
+ * reference point, voxel layer 0 starts at mean sea level. The voxel
+ * size is returned by get_vox_sz (X - horizontal, Y - vertical, meters).
+ *
+ * set_ref - moves the reference point. This also clears the volume.
+ * clear - marks the entire volume as free of precip.
+ * write - stores a box of nx * ny * nz reflectivity values (0 - none,
+ *	255 - heaviest precip) with its lowest corner at voxel (x, y, z).
+ *	`refl' is laid out X-fastest, then Y, then Z. Returns B_FALSE if
+ *	some voxels had to be dropped, because they were outside of the
+ *	volume, or because the volume ran out of its memory budget.
+ */
+typedef struct {
+	void		(*set_ref)(geo_pos2_t ref);
+	void		(*clear)(void);
+	bool_t		(*write)(int x, int y, int z, unsigned nx,
+	    unsigned ny, unsigned nz, const uint8_t *refl);
+	vect2_t		(*get_vox_sz)(void);
+} openwxr_atmo_vox_intf_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _OPENWXR_ATMO_INTF_H_ */
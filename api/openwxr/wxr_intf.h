@@ -21,6 +21,8 @@
 
 #include <acfutils/geom.h>
 
+#include "atmo_intf.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -88,6 +90,99 @@ typedef struct {
 	vect2_t		smear;
 } wxr_conf_t;
 
+/*
+ * Optional WXR settings, passed to init_ext next to the wxr_conf_t. The
+ * layout of wxr_conf_t is fixed, as it is read directly out of the
+ * memory of the avionics plugins which were built against it. New
+ * settings only ever get appended to this structure, and `struct_sz'
+ * tells OpenWXR how much of it the caller knows about. Any settings
+ * past that (as well as all of them when no wxr_conf_ext_t is passed)
+ * take the value 0 / empty string, which selects their default.
+ */
+typedef struct {
+	/* Must be set to sizeof (wxr_conf_ext_t) by the caller. */
+	size_t		struct_sz;
+	/*
+	 * Threads used to compute the radar scan lines. 0 uses the scan
+	 * pool shared by all WXR instances, which is sized in the
+	 * plugin's configuration (scan_pool/threads). 1 computes all scan
+	 * lines on the WXR's worker thread alone. More than 1 gives the
+	 * WXR a private pool of that many threads, on top of the shared
+	 * ones.
+	 */
+	unsigned	num_threads;
+	/*
+	 * Share of the shared scan pool this WXR gets when competing with
+	 * other WXR instances, relative to their priorities (1 to 16, 0
+	 * counts as 1). E.g. a WXR with priority 2 gets scan lines computed
+	 * twice as fast as one with priority 1 while both are busy.
+	 */
+	unsigned	priority;
+	/*
+	 * Name of the atmosphere provider (see OPENWXR_ATMO_REGISTER) to
+	 * use when no atmosphere is passed to init_ext explicitly. An empty
+	 * string selects the built-in X-Plane atmosphere.
+	 */
+	char		atmo_provider[OPENWXR_ATMO_NAME_LEN];
+	/*
+	 * CPU time the WXR may spend computing scan lines, as a fraction
+	 * of wall-clock time (e.g. 0.25 for 25% of one core). This is
+	 * summed over all the threads computing the WXR's scan lines and
+	 * doesn't include time spent waiting for a shared scan thread.
+	 * When computing all the scan lines the antenna sweeps over would
+	 * take more than that, the antenna keeps sweeping at the normal
+	 * rate, but only an evenly spread subset of the scan lines is
+	 * updated. 0 means no limit.
+	 */
+	double		cpu_budget;
+} wxr_conf_ext_t;
+
+/*
+ * Worker scheduling statistics of a WXR instance. The counters are
+ * cumulative since the instance was created.
+ */
+typedef struct {
+	uint64_t	ticks;		/* worker ticks run */
+	uint64_t	missed;		/* ticks which started late */
+	uint64_t	lines;		/* scan lines computed */
+	uint64_t	lines_shed;	/* scan lines skipped due to cpu_budget */
+	double		load;		/* recent CPU use, see cpu_budget */
+} wxr_sched_stats_t;
+
+/*
+ * Phases of the radar's work timed by get_perf_stats. The scan line
+ * phases run on the scan threads, the drawing phases on the thread
+ * calling draw.
+ */
+typedef enum {
+	WXR_PERF_POSE,		/* pose & controls snapshot, per worker tick */
+	WXR_PERF_ATMO,		/* atmosphere probe, per probe call */
+	WXR_PERF_TERR,		/* OpenGPWS terrain probe, per request */
+	WXR_PERF_GROUND,	/* ground returns & sample coding, per line */
+	WXR_PERF_COLORIZE,	/* color palette rebuild */
+	WXR_PERF_TEX_UPLOAD,	/* texture upload steps, per draw */
+	WXR_PERF_EFIS,		/* X-Plane EFIS map capture & readback */
+	WXR_NUM_PERF_PHASES
+} wxr_perf_phase_t;
+
+/*
+ * Timing of a single phase. `count' and `total' are cumulative since
+ * the instance was created, the rest covers the last 5 to 10 seconds.
+ * The drawing phases only measure the time spent issuing OpenGL calls,
+ * not the GPU's time.
+ */
+typedef struct {
+	uint64_t	count;		/* times the phase ran */
+	double		total;		/* seconds spent in the phase */
+	double		p50;		/* median duration, microseconds */
+	double		p99;		/* 99th percentile, microseconds */
+	double		busy;		/* fraction of wall-clock time */
+} wxr_perf_phase_stats_t;
+
+typedef struct {
+	wxr_perf_phase_stats_t	phases[WXR_NUM_PERF_PHASES];
+} wxr_perf_stats_t;
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,6 +19,7 @@
 #ifndef	_OPENWXR_XPLANE_API_H_
 #define	_OPENWXR_XPLANE_API_H_
 
+#include "atmo_intf.h"
 #include "wxr_intf.h"
 
 #ifdef __cplusplus
@@ -27,7 +28,6 @@ extern "C" {
 
 #define	OPENWXR_PLUGIN_SIG	"skiselkov.openwxr"
 
-typedef struct atmo_s atmo_t;
 typedef struct wxr_s wxr_t;
 
 typedef struct {
@@ -36,6 +36,13 @@ typedef struct {
 	uint32_t	rgba;		/* Big-endian RGBA */
 } wxr_color_t;
 
+/*
+ * init - creates a new WXR instance, same as init_ext with a NULL `ext'.
+ * init_ext - creates a new WXR instance with the optional settings in
+ *	`ext' (may be NULL). If `atmo' is NULL, the instance uses the
+ *	atmosphere provider named in ext->atmo_provider. `conf' must stay
+ *	valid until fini, `ext' is copied.
+ */
 typedef struct {
 	wxr_t *(*init)(const wxr_conf_t *conf, const atmo_t *atmo);
 	void (*fini)(wxr_t *wxr);
@@ -65,12 +72,21 @@ typedef struct {
 
 	/* Debugging support */
 	bool_t (*reload_gl_progs)(wxr_t *wxr);
+
+	void (*get_sched_stats)(const wxr_t *wxr, wxr_sched_stats_t *stats);
+	void (*get_perf_stats)(wxr_t *wxr, wxr_perf_stats_t *stats);
+
+	wxr_t *(*init_ext)(const wxr_conf_t *conf, const wxr_conf_ext_t *ext,
+	    const atmo_t *atmo);
 } openwxr_intf_t;
 
 typedef enum {
 	OPENWXR_ATMO_XP11_SET_EFIS = 0x20000,	/* int coords[4] arg */
 	OPENWXR_INTF_GET,			/* openwxr_intf_t ** arg */
-	OPENWXR_ATMO_GET			/* atmo_t ** arg */
+	OPENWXR_ATMO_GET,			/* atmo_t ** arg */
+	OPENWXR_ATMO_REGISTER,			/* openwxr_atmo_provider_t * */
+	OPENWXR_ATMO_UNREGISTER,		/* openwxr_atmo_provider_t * */
+	OPENWXR_ATMO_VOX_GET			/* openwxr_atmo_vox_intf_t ** */
 } openwxr_msg_t;
 
 #ifdef __cplusplus
@@ -25,11 +25,15 @@
 layout(location = 10) uniform sampler2D	tex;
 layout(location = 11) uniform float	smear_mult;
 layout(location = 12) uniform float	brt;
+layout(location = 13) uniform sampler2D	palette;
 
 layout(location = 0) in vec2		tex_coord;
 
 layout(location = 0) out vec4		color_out;
 
+const float SHADOW_BIT = 128.0;
+const float SHADOW_LEVEL = 112.0 / 255.0;
+
 vec3
 brt_adjust(vec3 c)
 {
@@ -37,13 +41,70 @@ brt_adjust(vec3 c)
 	return (c * vec3(f));
 }
 
+/*
+ * `tex' holds 7-bit energy codes, with the top bit flagging beam shadow.
+ * `palette' maps the codes to colors at the current gain. Resolves the
+ * texel at integer coordinates `texel' into its color and returns the
+ * shadow flag (0 or 1) in `shadow'.
+ */
+vec4
+texel_color(vec2 texel, vec2 tex_size, out float shadow)
+{
+	float idx = floor(texture(tex, (texel + 0.5) / tex_size).r * 255.0 +
+	    0.5);
+
+	shadow = step(SHADOW_BIT, idx);
+	idx -= shadow * SHADOW_BIT;
+	return (texture(palette, vec2((idx + 0.5) / 128.0, 0.5)));
+}
+
+/*
+ * Resolves the texel nearest to texture coordinate `tc'. This is all
+ * the unsmeared image needs, at one sample & one palette fetch.
+ */
+vec4
+nearest_color(vec2 tc, vec2 tex_size, out float shadow)
+{
+	return (texel_color(min(floor(tc * tex_size), tex_size - 1.0),
+	    tex_size, shadow));
+}
+
+/*
+ * Energy codes can't be interpolated, so the texture is sampled with
+ * GL_NEAREST and we do the bilinear filtering on the resolved colors.
+ * The shadow flags are filtered the same way into `shadow'. At 4 times
+ * the fetches of nearest_color, this is only used for smeared samples.
+ */
+vec4
+sample_color(vec2 tc, vec2 tex_size, out float shadow)
+{
+	vec2 p = tc * tex_size - 0.5;
+	vec2 f = fract(p);
+	vec2 p0 = floor(p);
+	vec2 p1 = min(p0 + 1.0, tex_size - 1.0);
+	vec4 c00, c10, c01, c11;
+	float s00, s10, s01, s11;
+
+	p0 = max(p0, vec2(0.0));
+	c00 = texel_color(p0, tex_size, s00);
+	c10 = texel_color(vec2(p1.x, p0.y), tex_size, s10);
+	c01 = texel_color(vec2(p0.x, p1.y), tex_size, s01);
+	c11 = texel_color(p1, tex_size, s11);
+
+	shadow = mix(mix(s00, s10, f.x), mix(s01, s11, f.x), f.y);
+	return (mix(mix(c00, c10, f.x), mix(c01, c11, f.x), f.y));
+}
+
 void
 main()
 {
-	vec4 pixel = texture(tex, tex_coord);
 	vec2 tex_size = textureSize(tex, 0);
+	float shadow, unused;
+	vec4 pixel = nearest_color(tex_coord, tex_size, shadow);
+	vec4 shadow_color = vec4(shadow * SHADOW_LEVEL);
+	float alpha;
 
-	if (pixel.r == pixel.g && pixel.r == pixel.b) {
+	if (smear_mult == 0.0 || (pixel.r == pixel.g && pixel.r == pixel.b)) {
 		color_out = pixel;
 	} else {
 		float s1 = sin(tex_coord.s * 16.1803);
@@ -63,9 +124,19 @@ main()
 		 * component is smeared using smear_s and vice versa.
 		 * Gives us the jaggedy-edged look we want.
 		 */
-		color_out = texture(tex, vec2(tex_coord.s,
-		    clamp(tex_coord.t + smear_s, 0.0, 1.0)));
+		color_out = sample_color(vec2(tex_coord.s,
+		    clamp(tex_coord.t + smear_s, 0.0, 1.0)), tex_size, unused);
 	}
 
-	color_out = vec4(brt_adjust(color_out.rgb), color_out.a);
+	/*
+	 * The beam shadow is never smeared. Composite it over the radar
+	 * image here, the same as blending it in a separate pass would.
+	 */
+	alpha = shadow_color.a + color_out.a * (1.0 - shadow_color.a);
+	if (alpha > 0.0) {
+		color_out.rgb = (shadow_color.rgb * shadow_color.a +
+		    color_out.rgb * color_out.a * (1.0 - shadow_color.a)) /
+		    alpha;
+	}
+	color_out = vec4(brt_adjust(color_out.rgb), alpha);
 }
@@ -21,33 +21,10 @@
 
 #include <acfutils/geom.h>
 
+/*
+ * scan_line_t and atmo_t are part of the public API, so that other
+ * plugins can provide their own atmosphere, see <openwxr/atmo_intf.h>.
+ */
 #include <openwxr/xplane_api.h>
 
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-typedef struct {
-	geo_pos3_t	origin;		/* beam origin point */
-	bool_t		vert_scan;	/* are we scanning vert or horiz? */
-	double		ant_rhdg;	/* rel antenna hdg from aircraft */
-	vect2_t		dir;		/* X-hdg degrees, Y-pitch degrees up */
-	vect2_t		shape;		/* X-horiz degrees, Y-vert degrees */
-	double		energy;		/* beam energy (no units), log scale */
-	double		range;		/* scan line sampling range */
-	double		max_range;	/* for calibrating energy depletion */
-	int		num_samples;	/* number of samples to return */
-	double		*energy_out;	/* energy return samples, log scale */
-	double		*doppler_out;	/* freq shift, relative motion, m/s */
-} scan_line_t;
-
-struct atmo_s {
-	void		(*set_range)(double rng);
-	void		(*probe)(scan_line_t *sl);
-};
-
-#ifdef __cplusplus
-}
-#endif
-
 #endif	/* _ATMO_H_ */
@@ -0,0 +1,256 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#include <string.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/thread.h>
+
+#include "atmo_reg.h"
+
+/*
+ * Registry of atmosphere providers, which WXR instances pick from in
+ * wxr_init. Registration normally happens from XPluginReceiveMessage,
+ * whereas WXR instances come & go on whichever thread the avionics
+ * run on, so the registry is protected by a lock. Providers live in a
+ * fixed table, so an atmo_prov_t pointer stays valid for as long as
+ * the provider is held.
+ */
+#define	ATMO_REG_MAX	8
+
+struct atmo_prov_s {
+	/* protected by reg.lock */
+	bool_t			registered;
+	unsigned		users;
+	/* constant while registered */
+	openwxr_atmo_provider_t	info;
+	/* serializes calls into providers without OPENWXR_ATMO_CAP_MT_SAFE */
+	mutex_t			lock;
+};
+
+static struct {
+	bool_t		inited;
+	mutex_t		lock;
+	atmo_prov_t	provs[ATMO_REG_MAX];
+} reg = { .inited = B_FALSE };
+
+void
+atmo_reg_init(void)
+{
+	ASSERT(!reg.inited);
+	reg.inited = B_TRUE;
+
+	mutex_init(&reg.lock);
+	for (int i = 0; i < ATMO_REG_MAX; i++) {
+		memset(&reg.provs[i].info, 0, sizeof (reg.provs[i].info));
+		reg.provs[i].registered = B_FALSE;
+		reg.provs[i].users = 0;
+		mutex_init(&reg.provs[i].lock);
+	}
+}
+
+void
+atmo_reg_fini(void)
+{
+	if (!reg.inited)
+		return;
+	reg.inited = B_FALSE;
+
+	for (int i = 0; i < ATMO_REG_MAX; i++) {
+		ASSERT3U(reg.provs[i].users, ==, 0);
+		mutex_destroy(&reg.provs[i].lock);
+	}
+	mutex_destroy(&reg.lock);
+}
+
+static atmo_prov_t *
+find_prov(const atmo_t *atmo, const char *name)
+{
+	for (int i = 0; i < ATMO_REG_MAX; i++) {
+		atmo_prov_t *prov = &reg.provs[i];
+
+		if (!prov->registered)
+			continue;
+		if ((atmo != NULL && prov->info.atmo == atmo) ||
+		    (name != NULL && strcmp(prov->info.name, name) == 0))
+			return (prov);
+	}
+	return (NULL);
+}
+
+/*
+ * Registers a new atmosphere provider. Fails if the description is
+ * incomplete, the name is already taken or the registry is full.
+ */
+bool_t
+atmo_reg_add(const openwxr_atmo_provider_t *info)
+{
+	atmo_prov_t *prov = NULL;
+
+	ASSERT(reg.inited);
+	ASSERT(info != NULL);
+
+	if (info->atmo == NULL || info->atmo->probe == NULL ||
+	    info->atmo->set_range == NULL ||
+	    ((info->caps & OPENWXR_ATMO_CAP_BATCH) &&
+	    info->atmo->probe_batch == NULL) ||
+	    strnlen(info->name, sizeof (info->name)) == 0 ||
+	    strnlen(info->name, sizeof (info->name)) == sizeof (info->name)) {
+		logMsg("Cannot register atmosphere provider: invalid "
+		    "provider description");
+		return (B_FALSE);
+	}
+
+	mutex_enter(&reg.lock);
+	if (find_prov(info->atmo, info->name) != NULL) {
+		mutex_exit(&reg.lock);
+		logMsg("Cannot register atmosphere provider \"%s\": "
+		    "already registered", info->name);
+		return (B_FALSE);
+	}
+	for (int i = 0; i < ATMO_REG_MAX; i++) {
+		if (!reg.provs[i].registered) {
+			prov = &reg.provs[i];
+			break;
+		}
+	}
+	if (prov == NULL) {
+		mutex_exit(&reg.lock);
+		logMsg("Cannot register atmosphere provider \"%s\": "
+		    "too many providers", info->name);
+		return (B_FALSE);
+	}
+	prov->info = *info;
+	prov->registered = B_TRUE;
+	ASSERT3U(prov->users, ==, 0);
+	mutex_exit(&reg.lock);
+
+	if (info->caps & OPENWXR_ATMO_CAP_NATIVE_RES) {
+		logMsg("Registered atmosphere provider \"%s\" (caps: %x, "
+		    "native resolution: %.0f m)", info->name, info->caps,
+		    info->native_res);
+	} else {
+		logMsg("Registered atmosphere provider \"%s\" (caps: %x)",
+		    info->name, info->caps);
+	}
+
+	return (B_TRUE);
+}
+
+/*
+ * Removes a provider registered with atmo_reg_add. A provider still
+ * used by a WXR instance cannot be removed.
+ */
+bool_t
+atmo_reg_remove(const openwxr_atmo_provider_t *info)
+{
+	atmo_prov_t *prov;
+
+	ASSERT(reg.inited);
+	ASSERT(info != NULL);
+
+	mutex_enter(&reg.lock);
+	prov = find_prov(NULL, info->name);
+	if (prov == NULL || prov->info.atmo != info->atmo) {
+		mutex_exit(&reg.lock);
+		logMsg("Cannot unregister atmosphere provider \"%s\": "
+		    "not registered", info->name);
+		return (B_FALSE);
+	}
+	if (prov->users != 0) {
+		unsigned users = prov->users;
+
+		mutex_exit(&reg.lock);
+		logMsg("Cannot unregister atmosphere provider \"%s\": "
+		    "still in use by %u WXR instance(s)", info->name, users);
+		return (B_FALSE);
+	}
+	prov->registered = B_FALSE;
+	memset(&prov->info, 0, sizeof (prov->info));
+	mutex_exit(&reg.lock);
+
+	return (B_TRUE);
+}
+
+/*
+ * Looks up a registered provider, either by its atmosphere (if `atmo'
+ * is not NULL), or by name. An empty name selects ATMO_REG_DEFAULT.
+ * Returns NULL if no such provider exists. The returned provider can't
+ * be unregistered until released with atmo_prov_rele.
+ */
+atmo_prov_t *
+atmo_prov_hold(const atmo_t *atmo, const char *name)
+{
+	atmo_prov_t *prov;
+
+	ASSERT(reg.inited);
+
+	if (atmo != NULL)
+		name = NULL;
+	else if (name == NULL || *name == '\0')
+		name = ATMO_REG_DEFAULT;
+
+	mutex_enter(&reg.lock);
+	prov = find_prov(atmo, name);
+	if (prov != NULL)
+		prov->users++;
+	mutex_exit(&reg.lock);
+
+	return (prov);
+}
+
+void
+atmo_prov_rele(atmo_prov_t *prov)
+{
+	if (prov == NULL)
+		return;
+
+	mutex_enter(&reg.lock);
+	ASSERT(prov->registered);
+	ASSERT(prov->users != 0);
+	prov->users--;
+	mutex_exit(&reg.lock);
+}
+
+const openwxr_atmo_provider_t *
+atmo_prov_get_info(const atmo_prov_t *prov)
+{
+	ASSERT(prov != NULL);
+	return (&prov->info);
+}
+
+/*
+ * Bracket every call into the provider's atmosphere. For providers
+ * which aren't OPENWXR_ATMO_CAP_MT_SAFE, this makes sure only one
+ * thread at a time calls into it, otherwise these are no-ops.
+ */
+void
+atmo_prov_enter(atmo_prov_t *prov)
+{
+	if (!(prov->info.caps & OPENWXR_ATMO_CAP_MT_SAFE))
+		mutex_enter(&prov->lock);
+}
+
+void
+atmo_prov_exit(atmo_prov_t *prov)
+{
+	if (!(prov->info.caps & OPENWXR_ATMO_CAP_MT_SAFE))
+		mutex_exit(&prov->lock);
+}
@@ -0,0 +1,50 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#ifndef	_ATMO_REG_H_
+#define	_ATMO_REG_H_
+
+#include "atmo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* name of the built-in atmosphere, selected by an empty provider name */
+#define	ATMO_REG_DEFAULT	"xp11"
+
+typedef struct atmo_prov_s atmo_prov_t;
+
+void atmo_reg_init(void);
+void atmo_reg_fini(void);
+
+bool_t atmo_reg_add(const openwxr_atmo_provider_t *info);
+bool_t atmo_reg_remove(const openwxr_atmo_provider_t *info);
+
+atmo_prov_t *atmo_prov_hold(const atmo_t *atmo, const char *name);
+void atmo_prov_rele(atmo_prov_t *prov);
+const openwxr_atmo_provider_t *atmo_prov_get_info(const atmo_prov_t *prov);
+
+void atmo_prov_enter(atmo_prov_t *prov);
+void atmo_prov_exit(atmo_prov_t *prov);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _ATMO_REG_H_ */
@@ -0,0 +1,609 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/geom.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/math.h>
+#include <acfutils/perf.h>
+#include <acfutils/safe_alloc.h>
+#include <acfutils/thread.h>
+
+#include "atmo_vox.h"
+
+/*
+ * Voxel atmosphere. Reflectivity is stored in bricks of BRICK_DIM^3
+ * voxels. The bricks are found through a two-level index: a dense
+ * directory covering the whole volume points at leaves, each of which
+ * indexes LEAF_DIM^3 bricks. Only bricks which contain any precip at
+ * all are allocated, and only leaves holding at least one such brick,
+ * so empty space merely costs its directory entry. Leaves and bricks
+ * are allocated from two arrays, which together with the directory
+ * can't grow beyond the configured memory budget.
+ *
+ * Probes march each beam through the volume one range bin at a time.
+ * When a range bin falls into an empty brick (or leaf), we jump
+ * straight to the first range bin past its far side, so the cost of a
+ * probe scales with the number of bricks with precip along the beam,
+ * rather than the number of range bins.
+ */
+#define	BRICK_SHIFT	3
+#define	BRICK_DIM	(1 << BRICK_SHIFT)	/* voxels along brick side */
+#define	BRICK_MASK	(BRICK_DIM - 1)
+#define	BRICK_VOX	(BRICK_DIM * BRICK_DIM * BRICK_DIM)
+#define	NO_BRICK	0			/* empty index entry */
+#define	MIN_BRICK_CAP	64
+#define	LEAF_SHIFT	3
+#define	LEAF_DIM	(1 << LEAF_SHIFT)	/* bricks along leaf side */
+#define	LEAF_MASK	(LEAF_DIM - 1)
+#define	LEAF_BRICKS	(LEAF_DIM * LEAF_DIM * LEAF_DIM)
+#define	NO_LEAF		0			/* empty directory entry */
+#define	MIN_LEAF_CAP	16
+#define	COST_PER_1KM	0.07		/* same as atmo_xp11 */
+#define	LAT_DEG_LEN	(DEG2RAD(1) * EARTH_MSL)	/* meters */
+
+#define	DFL_RES_XY	500			/* meters */
+#define	DFL_RES_Z	250			/* meters */
+#define	DFL_RADIUS	NM2MET(160)		/* meters */
+#define	DFL_CEILING	18000			/* meters */
+#define	DFL_MEM_BUDGET	64			/* MiB */
+
+typedef struct {
+	uint8_t		vox[BRICK_VOX];		/* X fastest, then Y, then Z */
+} vox_brick_t;
+
+typedef struct {
+	uint32_t	bricks[LEAF_BRICKS];	/* brick number + 1 */
+} vox_leaf_t;
+
+static struct {
+	bool_t			inited;
+	openwxr_atmo_provider_t	prov;
+
+	/* constant after init */
+	double			vox_xy;		/* meters */
+	double			vox_z;		/* meters */
+	int			nbx;		/* volume size in bricks */
+	int			nby;
+	int			nbz;
+	int			nlx;		/* volume size in leaves */
+	int			nly;
+	int			nlz;
+	size_t			mem_budget;	/* bytes, minus the directory */
+
+	rwmutex_t		lock;
+	/* protected by lock */
+	geo_pos2_t		ref;
+	double			lon_deg_len;	/* meters at ref.lat */
+	uint32_t		*dir;		/* leaf number + 1 */
+	vox_leaf_t		*leaves;
+	size_t			num_leaves;
+	size_t			cap_leaves;
+	vox_brick_t		*bricks;
+	size_t			num_bricks;
+	size_t			cap_bricks;
+	size_t			mem_used;	/* by leaves & bricks, bytes */
+	bool_t			over_budget;
+} vox = { .inited = B_FALSE };
+
+static void vox_set_range(double range);
+static void vox_probe(scan_line_t *sl);
+static void vox_probe_batch(scan_line_t *sl, unsigned num);
+static void vox_set_ref(geo_pos2_t ref);
+static void vox_clear(void);
+static bool_t vox_write(int x, int y, int z, unsigned nx, unsigned ny,
+    unsigned nz, const uint8_t *refl);
+static vect2_t vox_get_vox_sz(void);
+
+static const atmo_t atmo = {
+	.set_range = vox_set_range,
+	.probe = vox_probe,
+	.probe_batch = vox_probe_batch
+};
+
+static const openwxr_atmo_vox_intf_t intf = {
+	.set_ref = vox_set_ref,
+	.clear = vox_clear,
+	.write = vox_write,
+	.get_vox_sz = vox_get_vox_sz
+};
+
+static inline size_t
+leaf_idx(int bu, int bv, int bw)
+{
+	ASSERT3S(bu, <, vox.nbx);
+	ASSERT3S(bv, <, vox.nby);
+	ASSERT3S(bw, <, vox.nbz);
+	return (((size_t)(bw >> LEAF_SHIFT) * vox.nly + (bv >> LEAF_SHIFT)) *
+	    vox.nlx + (bu >> LEAF_SHIFT));
+}
+
+static inline unsigned
+brick_idx(int bu, int bv, int bw)
+{
+	return ((((bw & LEAF_MASK) << LEAF_SHIFT) + (bv & LEAF_MASK)) <<
+	    LEAF_SHIFT) + (bu & LEAF_MASK);
+}
+
+static inline unsigned
+vox_idx(int u, int v, int w)
+{
+	return ((((w & BRICK_MASK) << BRICK_SHIFT) + (v & BRICK_MASK)) <<
+	    BRICK_SHIFT) + (u & BRICK_MASK);
+}
+
+/*
+ * Computes the distances at which the ray o + t * dir enters & leaves
+ * the box [lo, hi). If the ray misses the box, *t_out < *t_in.
+ */
+static void
+ray_box(vect3_t o, vect3_t dir, vect3_t lo, vect3_t hi, double *t_in,
+    double *t_out)
+{
+	const double oo[3] = { o.x, o.y, o.z };
+	const double dd[3] = { dir.x, dir.y, dir.z };
+	const double ll[3] = { lo.x, lo.y, lo.z };
+	const double hh[3] = { hi.x, hi.y, hi.z };
+	double t0 = -INFINITY, t1 = INFINITY;
+
+	for (int a = 0; a < 3; a++) {
+		double ta, tb;
+
+		if (dd[a] == 0) {
+			if (oo[a] < ll[a] || oo[a] >= hh[a]) {
+				t0 = INFINITY;
+				t1 = -INFINITY;
+			}
+			continue;
+		}
+		ta = (ll[a] - oo[a]) / dd[a];
+		tb = (hh[a] - oo[a]) / dd[a];
+		t0 = MAX(t0, MIN(ta, tb));
+		t1 = MIN(t1, MAX(ta, tb));
+	}
+	*t_in = t0;
+	*t_out = t1;
+}
+
+/*
+ * Samples the volume along the ray o + d * dir at d = (i + 1) * step
+ * for 0 <= i < n, raising out[i] to the reflectivity (0..1) found there.
+ * `o' and `dir' are in voxel units. Called with vox.lock held.
+ */
+static void
+march(vect3_t o, vect3_t dir, double step, int n, double *out)
+{
+	int nu = vox.nbx << BRICK_SHIFT;
+	int nv = vox.nby << BRICK_SHIFT;
+	int nw = vox.nbz << BRICK_SHIFT;
+	double t_in, t_out;
+	int i, i_end;
+
+	/* clip the range bins to the volume first */
+	ray_box(o, dir, VECT3(0, 0, 0), VECT3(nu, nv, nw), &t_in, &t_out);
+	if (t_out < t_in)
+		return;
+	i = clamp(ceil(t_in / step) - 1, 0, n);
+	i_end = clamp(floor(t_out / step), 0, n);
+
+	while (i < i_end) {
+		double d = (i + 1) * step;
+		double u = o.x + d * dir.x;
+		double v = o.y + d * dir.y;
+		double w = o.z + d * dir.z;
+		int iu, iv, iw;
+		uint32_t li, bi = NO_BRICK;
+
+		/* rounding at the volume boundary */
+		if (u < 0 || v < 0 || w < 0 || u >= nu || v >= nv ||
+		    w >= nw) {
+			i++;
+			continue;
+		}
+		iu = u;
+		iv = v;
+		iw = w;
+		li = vox.dir[leaf_idx(iu >> BRICK_SHIFT, iv >> BRICK_SHIFT,
+		    iw >> BRICK_SHIFT)];
+		if (li != NO_LEAF) {
+			bi = vox.leaves[li - 1].bricks[brick_idx(
+			    iu >> BRICK_SHIFT, iv >> BRICK_SHIFT,
+			    iw >> BRICK_SHIFT)];
+		}
+		if (bi == NO_BRICK) {
+			/* an empty leaf can be skipped as a whole */
+			int dim = (li == NO_LEAF ? BRICK_DIM * LEAF_DIM :
+			    BRICK_DIM);
+			vect3_t lo = VECT3(iu & ~(dim - 1), iv & ~(dim - 1),
+			    iw & ~(dim - 1));
+			vect3_t hi = VECT3(lo.x + dim, lo.y + dim, lo.z + dim);
+
+			ray_box(o, dir, lo, hi, &t_in, &t_out);
+			/* first range bin past the far side of the box */
+			i = clamp(floor(t_out / step), i + 1, i_end);
+			continue;
+		}
+		out[i] = MAX(out[i],
+		    vox.bricks[bi - 1].vox[vox_idx(iu, iv, iw)] / 255.0);
+		i++;
+	}
+}
+
+static void
+vox_set_range(double range)
+{
+	/* the volume doesn't depend on the radar range */
+	UNUSED(range);
+}
+
+/*
+ * Same energy model as atmo_xp11_probe, except that the precip
+ * intensity comes from the volume along the beam's center line and
+ * (in horizontal scan mode) its upper & lower edges.
+ */
+static void
+vox_probe_locked(scan_line_t *sl)
+{
+	double step = sl->range / sl->num_samples;
+	double cost_per_sample = COST_PER_1KM * (step / 1000.0);
+	double energy = sl->energy;
+
+	for (int i = 0; i < sl->num_samples; i++) {
+		sl->energy_out[i] = 0;
+		sl->doppler_out[i] = 0;
+	}
+	if (vox.num_bricks == 0)
+		return;
+
+	{
+		double dlon = sl->origin.lon - vox.ref.lon;
+		double hdg = DEG2RAD(sl->dir.x);
+		vect3_t o;
+		vect2_t hdir = VECT2(sin(hdg) / vox.vox_xy,
+		    cos(hdg) / vox.vox_xy);
+
+		if (dlon < -180)
+			dlon += 360;
+		else if (dlon >= 180)
+			dlon -= 360;
+		o = VECT3(dlon * vox.lon_deg_len / vox.vox_xy +
+		    (vox.nbx << (BRICK_SHIFT - 1)),
+		    (sl->origin.lat - vox.ref.lat) * LAT_DEG_LEN / vox.vox_xy +
+		    (vox.nby << (BRICK_SHIFT - 1)),
+		    sl->origin.elev / vox.vox_z);
+
+		/* energy_out collects the precip intensity first */
+		march(o, VECT3(hdir.x, hdir.y, sin(DEG2RAD(sl->dir.y)) /
+		    vox.vox_z), step, sl->num_samples, sl->energy_out);
+		if (!sl->vert_scan) {
+			double up = DEG2RAD(sl->dir.y + sl->shape.y / 2);
+			double dn = DEG2RAD(sl->dir.y - sl->shape.y / 2);
+
+			march(o, VECT3(hdir.x, hdir.y, sin(up) / vox.vox_z),
+			    step, sl->num_samples, sl->energy_out);
+			march(o, VECT3(hdir.x, hdir.y, sin(dn) / vox.vox_z),
+			    step, sl->num_samples, sl->energy_out);
+		}
+	}
+
+	for (int i = 0; i < sl->num_samples; i++) {
+		double energy_cost = cost_per_sample * sl->energy_out[i] *
+		    (energy / sl->energy);
+
+		sl->energy_out[i] = energy_cost;
+		energy = MAX(0, energy - energy_cost);
+	}
+}
+
+static void
+vox_probe(scan_line_t *sl)
+{
+	rwmutex_enter(&vox.lock, B_FALSE);
+	vox_probe_locked(sl);
+	rwmutex_exit(&vox.lock);
+}
+
+static void
+vox_probe_batch(scan_line_t *sl, unsigned num)
+{
+	rwmutex_enter(&vox.lock, B_FALSE);
+	for (unsigned i = 0; i < num; i++)
+		vox_probe_locked(&sl[i]);
+	rwmutex_exit(&vox.lock);
+}
+
+static void
+clear_locked(void)
+{
+	memset(vox.dir, 0, (size_t)vox.nlx * vox.nly * vox.nlz *
+	    sizeof (*vox.dir));
+	free(vox.leaves);
+	vox.leaves = NULL;
+	vox.num_leaves = 0;
+	vox.cap_leaves = 0;
+	free(vox.bricks);
+	vox.bricks = NULL;
+	vox.num_bricks = 0;
+	vox.cap_bricks = 0;
+	vox.mem_used = 0;
+	vox.over_budget = B_FALSE;
+}
+
+static void
+vox_set_ref(geo_pos2_t ref)
+{
+	ASSERT(is_valid_lat(ref.lat));
+	ASSERT(is_valid_lon(ref.lon));
+
+	rwmutex_enter(&vox.lock, B_TRUE);
+	clear_locked();
+	vox.ref = ref;
+	vox.lon_deg_len = LAT_DEG_LEN * cos(DEG2RAD(ref.lat));
+	rwmutex_exit(&vox.lock);
+}
+
+static void
+vox_clear(void)
+{
+	rwmutex_enter(&vox.lock, B_TRUE);
+	clear_locked();
+	rwmutex_exit(&vox.lock);
+}
+
+/*
+ * Takes `sz' bytes out of the memory budget, returning in `room' how
+ * many more objects of that size the budget has room for afterwards.
+ * Called with vox.lock held for writing.
+ */
+static bool_t
+mem_reserve(size_t sz, size_t *room)
+{
+	if (vox.mem_used + sz > vox.mem_budget) {
+		if (!vox.over_budget) {
+			logMsg("Voxel atmosphere out of memory budget "
+			    "(%lu bytes), dropping precip",
+			    (unsigned long)vox.mem_budget);
+			vox.over_budget = B_TRUE;
+		}
+		return (B_FALSE);
+	}
+	vox.mem_used += sz;
+	*room = (vox.mem_budget - vox.mem_used) / sz;
+
+	return (B_TRUE);
+}
+
+/*
+ * Allocates an empty leaf for directory entry `li'. Called with
+ * vox.lock held for writing.
+ */
+static bool_t
+leaf_alloc(uint32_t *li)
+{
+	size_t room;
+
+	if (!mem_reserve(sizeof (*vox.leaves), &room))
+		return (B_FALSE);
+	if (vox.num_leaves == vox.cap_leaves) {
+		vox.cap_leaves = MIN(MAX(vox.cap_leaves * 2, MIN_LEAF_CAP),
+		    vox.num_leaves + 1 + room);
+		vox.leaves = safe_realloc(vox.leaves, vox.cap_leaves *
+		    sizeof (*vox.leaves));
+	}
+	memset(&vox.leaves[vox.num_leaves], 0, sizeof (*vox.leaves));
+	*li = ++vox.num_leaves;
+
+	return (B_TRUE);
+}
+
+/*
+ * Allocates a zero-filled brick for index entry `bi'. Called with
+ * vox.lock held for writing.
+ */
+static bool_t
+brick_alloc(uint32_t *bi)
+{
+	size_t room;
+
+	if (!mem_reserve(sizeof (*vox.bricks), &room))
+		return (B_FALSE);
+	if (vox.num_bricks == vox.cap_bricks) {
+		vox.cap_bricks = MIN(MAX(vox.cap_bricks * 2, MIN_BRICK_CAP),
+		    vox.num_bricks + 1 + room);
+		vox.bricks = safe_realloc(vox.bricks, vox.cap_bricks *
+		    sizeof (*vox.bricks));
+	}
+	memset(&vox.bricks[vox.num_bricks], 0, sizeof (*vox.bricks));
+	*bi = ++vox.num_bricks;
+
+	return (B_TRUE);
+}
+
+static bool_t
+vox_write(int x, int y, int z, unsigned nx, unsigned ny, unsigned nz,
+    const uint8_t *refl)
+{
+	int nu = vox.nbx << BRICK_SHIFT;
+	int nv = vox.nby << BRICK_SHIFT;
+	int nw = vox.nbz << BRICK_SHIFT;
+	bool_t ok = B_TRUE;
+
+	ASSERT(refl != NULL || nx == 0 || ny == 0 || nz == 0);
+
+	rwmutex_enter(&vox.lock, B_TRUE);
+	for (unsigned k = 0; k < nz; k++) {
+		for (unsigned j = 0; j < ny; j++) {
+			for (unsigned i = 0; i < nx; i++) {
+				uint8_t val = refl[((size_t)k * ny + j) * nx +
+				    i];
+				int u = x + (int)i + nu / 2;
+				int v = y + (int)j + nv / 2;
+				int w = z + (int)k;
+				uint32_t *li, *bi;
+
+				if (u < 0 || v < 0 || w < 0 || u >= nu ||
+				    v >= nv || w >= nw) {
+					if (val != 0)
+						ok = B_FALSE;
+					continue;
+				}
+				li = &vox.dir[leaf_idx(u >> BRICK_SHIFT,
+				    v >> BRICK_SHIFT, w >> BRICK_SHIFT)];
+				if (*li == NO_LEAF) {
+					/* keep empty leaves unallocated */
+					if (val == 0)
+						continue;
+					if (!leaf_alloc(li)) {
+						ok = B_FALSE;
+						continue;
+					}
+				}
+				bi = &vox.leaves[*li - 1].bricks[brick_idx(
+				    u >> BRICK_SHIFT, v >> BRICK_SHIFT,
+				    w >> BRICK_SHIFT)];
+				if (*bi == NO_BRICK) {
+					/* keep empty bricks unallocated */
+					if (val == 0)
+						continue;
+					if (!brick_alloc(bi)) {
+						ok = B_FALSE;
+						continue;
+					}
+				}
+				vox.bricks[*bi - 1].vox[vox_idx(u, v, w)] =
+				    val;
+			}
+		}
+	}
+	rwmutex_exit(&vox.lock);
+
+	return (ok);
+}
+
+static vect2_t
+vox_get_vox_sz(void)
+{
+	return (VECT2(vox.vox_xy, vox.vox_z));
+}
+
+/*
+ * Sets up the voxel atmosphere if enabled in the configuration (see
+ * the vox/ keys). Returns the provider description to register, or
+ * NULL if the voxel atmosphere is disabled. It also stays disabled if
+ * the index directory alone would take up more than half of the memory
+ * budget, as there would be little room left for any precip.
+ */
+const openwxr_atmo_provider_t *
+atmo_vox_init(const conf_t *conf)
+{
+	bool_t enable = B_FALSE;
+	double res_xy = DFL_RES_XY, res_z = DFL_RES_Z;
+	double radius = DFL_RADIUS, ceiling = DFL_CEILING;
+	double budget = DFL_MEM_BUDGET;
+	size_t mem_budget, dir_sz;
+	int nbx, nbz;
+
+	ASSERT(!vox.inited);
+
+	conf_get_b(conf, "vox/enable", &enable);
+	if (!enable)
+		return (NULL);
+	conf_get_d(conf, "vox/res_xy", &res_xy);
+	conf_get_d(conf, "vox/res_z", &res_z);
+	conf_get_d(conf, "vox/radius", &radius);
+	conf_get_d(conf, "vox/ceiling", &ceiling);
+	conf_get_d(conf, "vox/mem_budget", &budget);
+
+	res_xy = clamp(res_xy, 50, 10000);
+	res_z = clamp(res_z, 25, 5000);
+	nbx = ceil((2 * clamp(radius, 1000, NM2MET(640))) /
+	    (res_xy * BRICK_DIM));
+	nbz = ceil(clamp(ceiling, 1000, 30000) / (res_z * BRICK_DIM));
+	mem_budget = clamp(budget, 1, 4096) * 1024 * 1024;
+	dir_sz = (size_t)((nbx + LEAF_MASK) >> LEAF_SHIFT) *
+	    ((nbx + LEAF_MASK) >> LEAF_SHIFT) *
+	    ((nbz + LEAF_MASK) >> LEAF_SHIFT) * sizeof (*vox.dir);
+	if (dir_sz > mem_budget / 2) {
+		logMsg("Voxel atmosphere disabled: its index alone needs "
+		    "%.1f MiB, which doesn't fit in half of vox/mem_budget. "
+		    "Increase vox/mem_budget, vox/res_xy or vox/res_z, or "
+		    "decrease vox/radius or vox/ceiling.",
+		    dir_sz / (1024.0 * 1024.0));
+		return (NULL);
+	}
+
+	memset(&vox, 0, sizeof (vox));
+	vox.inited = B_TRUE;
+	vox.vox_xy = res_xy;
+	vox.vox_z = res_z;
+	vox.nbx = nbx;
+	vox.nby = nbx;
+	vox.nbz = nbz;
+	vox.nlx = (nbx + LEAF_MASK) >> LEAF_SHIFT;
+	vox.nly = vox.nlx;
+	vox.nlz = (nbz + LEAF_MASK) >> LEAF_SHIFT;
+	vox.mem_budget = mem_budget - dir_sz;
+	rwmutex_init(&vox.lock);
+	vox.dir = safe_calloc((size_t)vox.nlx * vox.nly * vox.nlz,
+	    sizeof (*vox.dir));
+	vox.lon_deg_len = LAT_DEG_LEN;
+
+	strlcpy(vox.prov.name, ATMO_VOX_NAME, sizeof (vox.prov.name));
+	/* probes only ever take the volume lock for reading */
+	vox.prov.caps = OPENWXR_ATMO_CAP_BATCH | OPENWXR_ATMO_CAP_MT_SAFE |
+	    OPENWXR_ATMO_CAP_NATIVE_RES;
+	vox.prov.native_res = vox.vox_xy;
+	vox.prov.atmo = &atmo;
+
+	logMsg("Voxel atmosphere: %dx%dx%d bricks of %.0fx%.0fx%.0f m, "
+	    "%.1f MiB left for precip after the index", vox.nbx, vox.nby,
+	    vox.nbz, vox.vox_xy * BRICK_DIM, vox.vox_xy * BRICK_DIM,
+	    vox.vox_z * BRICK_DIM, vox.mem_budget / (1024.0 * 1024.0));
+
+	return (&vox.prov);
+}
+
+void
+atmo_vox_fini(void)
+{
+	if (!vox.inited)
+		return;
+	vox.inited = B_FALSE;
+
+	free(vox.dir);
+	free(vox.leaves);
+	free(vox.bricks);
+	rwmutex_destroy(&vox.lock);
+}
+
+/*
+ * Returns the interface for filling in the volume, or NULL if the
+ * voxel atmosphere is disabled.
+ */
+const openwxr_atmo_vox_intf_t *
+atmo_vox_get_intf(void)
+{
+	if (!vox.inited)
+		return (NULL);
+	return (&intf);
+}
@@ -0,0 +1,41 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#ifndef	_ATMO_VOX_H_
+#define	_ATMO_VOX_H_
+
+#include <acfutils/conf.h>
+
+#include "atmo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define	ATMO_VOX_NAME	"vox"
+
+const openwxr_atmo_provider_t *atmo_vox_init(const conf_t *conf);
+void atmo_vox_fini(void);
+
+const openwxr_atmo_vox_intf_t *atmo_vox_get_intf(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _ATMO_VOX_H_ */
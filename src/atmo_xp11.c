@@ -16,6 +16,7 @@
  * Copyright 2018 Saso Kiselkov. All rights reserved.
  */
 
+#include <stdatomic.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -23,6 +24,7 @@
 #include <XPLMDisplay.h>
 
 #include <acfutils/assert.h>
+#include <acfutils/conf.h>
 #include <acfutils/crc64.h>
 #include <acfutils/dr.h>
 #include <acfutils/geom.h>
@@ -40,6 +42,7 @@
 #include <cglm/cglm.h>
 
 #include "atmo_xp11.h"
+#include "efis_filt.h"
 #include "glpriv.h"
 #include "xplane.h"
 
@@ -51,6 +54,36 @@
 #define	EFIS_LON_FWD	134
 #define	EFIS_HEIGHT	(EFIS_LON_FWD + EFIS_LON_AFT)
 #define	WX_SMOOTH_RNG	300		/* meters */
+#define	PRECIP_LUT_SZ	256
+#define	NUM_SNAPS	4
+
+/*
+ * The precip modulation curve (see update_precip) sampled at
+ * PRECIP_LUT_SZ evenly spaced altitudes between its first and last
+ * node. Entries 0 and PRECIP_LUT_SZ + 1 are zero and catch all altitudes
+ * off the curve, so a lookup never needs a range check.
+ */
+typedef struct {
+	double	z0;
+	double	inv_step;
+	float	val[PRECIP_LUT_SZ + 2];
+} precip_lut_t;
+
+/*
+ * An immutable capture of the EFIS precip map together with everything
+ * the probe needs to interpret it. Once published in xp11_atmo.snap, a
+ * snapshot is never modified, so probes can read it without locking.
+ * Snapshots are recycled from a fixed pool rather than freed, see
+ * snap_hold for why that matters.
+ */
+typedef struct {
+	atomic_uint	refcnt;
+	uint64_t	gen;
+	double		range;		/* EFIS map range of pixels */
+	precip_lut_t	precip_lut;
+	uint8_t		pixels[EFIS_WIDTH * EFIS_HEIGHT];	/* 0..255 */
+	uint32_t	sat[(EFIS_WIDTH + 1) * (EFIS_HEIGHT + 1)];
+} atmo_snap_t;
 
 static void atmo_xp11_set_range(double range);
 static void atmo_xp11_probe(scan_line_t *sl);
@@ -91,16 +124,40 @@ static double efis_map_ranges[EFIS_MAP_NUM_RANGES] = {
 };
 
 static struct {
+	atmo_snap_t		*snaps;		/* pool of NUM_SNAPS */
+	_Atomic(atmo_snap_t *)	snap;		/* current snapshot */
+	atomic_ullong		snap_gen;
+	atomic_uint		range_i;
+
 	mutex_t		lock;
 
 	/* protected by lock */
-	uint32_t	*pixels;
-	double		range;
-	unsigned	range_i;
 	vect2_t		precip_nodes[5];
+	precip_lut_t	precip_lut;	/* built from precip_nodes */
+
+	/*
+	 * With efis/cpu_filter set, the raw EFIS map is read back and the
+	 * cleanup & smoothing is done on efis_filt_thr, instead of in two
+	 * extra GPU passes on X-Plane's render thread.
+	 */
+	bool_t		cpu_filt;
+	thread_t	filt_thr;
+	condvar_t	filt_cv;
+	/* protected by lock */
+	bool_t		filt_shutdown;
+	bool_t		filt_pending;
+	uint32_t	*filt_in;	/* latest raw EFIS frame */
+	double		filt_range;	/* EFIS map range of filt_in */
+	/* only accessed by efis_filt_thr */
+	efis_filt_t	*filt;
+	uint32_t	*filt_wk;
+
+	/* EFIS map capture & readback, see atmo_xp11_get_efis_perf */
+	perf_hist_t	efis_perf;
 
 	/* only accessed by foreground drawing thread */
 	uint64_t	last_update;
+	double		xfer_range;
 	unsigned	efis_x;
 	unsigned	efis_y;
 	unsigned	efis_w;
@@ -224,26 +281,137 @@ debug_cmd_handler(XPLMCommandRef ref, XPLMCommandPhase phase, void *refcon)
 static void
 atmo_xp11_set_range(double range)
 {
-	mutex_enter(&xp11_atmo.lock);
 	/* Set the fallback value first */
-	xp11_atmo.range = efis_map_ranges[EFIS_MAP_NUM_RANGES - 1];
-	xp11_atmo.range_i = EFIS_MAP_NUM_RANGES - 1;
+	unsigned range_i = EFIS_MAP_NUM_RANGES - 1;
 
 	for (int i = 0; i < EFIS_MAP_NUM_RANGES; i++) {
 		if (range <= efis_map_ranges[i]) {
-			xp11_atmo.range = efis_map_ranges[i];
-			xp11_atmo.range_i = i;
+			range_i = i;
 			break;
 		}
 	}
-	mutex_exit(&xp11_atmo.lock);
+	atomic_store(&xp11_atmo.range_i, range_i);
+}
+
+static void
+snap_rele(atmo_snap_t *snap)
+{
+	ASSERT(atomic_load(&snap->refcnt) != 0);
+	atomic_fetch_sub(&snap->refcnt, 1);
+}
+
+/*
+ * Grabs a reference to the current snapshot without taking any locks.
+ * Returns NULL if there is no EFIS map to look at yet.
+ *
+ * Between loading xp11_atmo.snap and bumping the refcount, the snapshot
+ * might have been replaced and even recycled by snap_claim. Since pool
+ * memory is never freed while we're running, the stray refcount bump
+ * itself is harmless and the re-check below catches the swap. Once we
+ * hold a reference to the published snapshot, snap_claim can't recycle
+ * it until we let go of it. All operations are sequentially consistent,
+ * which is what makes the bump & re-check vs. swap & claim race safe.
+ */
+static atmo_snap_t *
+snap_hold(void)
+{
+	for (;;) {
+		atmo_snap_t *snap = atomic_load(&xp11_atmo.snap);
+
+		if (snap == NULL)
+			return (NULL);
+		atomic_fetch_add(&snap->refcnt, 1);
+		if (atomic_load(&xp11_atmo.snap) == snap)
+			return (snap);
+		snap_rele(snap);
+	}
+}
+
+/*
+ * Claims an unused snapshot from the pool for filling in. The returned
+ * snapshot carries a single reference, which snap_publish turns into
+ * the reference held by xp11_atmo.snap. Returns NULL if every snapshot
+ * is in use, in which case the caller should just drop the new frame.
+ */
+static atmo_snap_t *
+snap_claim(void)
+{
+	for (int i = 0; i < NUM_SNAPS; i++) {
+		atmo_snap_t *snap = &xp11_atmo.snaps[i];
+		unsigned unused = 0;
+
+		if (atomic_compare_exchange_strong(&snap->refcnt, &unused, 1))
+			return (snap);
+	}
+	return (NULL);
+}
+
+/*
+ * Finishes a snapshot from snap_claim with filled in pixels, range and
+ * precip_lut and swaps it in as the current snapshot. Probes still
+ * holding the previous snapshot keep using it until they're done.
+ */
+static void
+snap_publish(atmo_snap_t *snap)
+{
+	atmo_snap_t *old;
+
+	efis_filt_sat_build(snap->pixels, EFIS_WIDTH, EFIS_HEIGHT, snap->sat);
+	snap->gen = atomic_fetch_add(&xp11_atmo.snap_gen, 1) + 1;
+	old = atomic_exchange(&xp11_atmo.snap, snap);
+	if (old != NULL)
+		snap_rele(old);
+}
+
+static void
+snap_unpublish(void)
+{
+	atmo_snap_t *old = atomic_exchange(&xp11_atmo.snap, NULL);
+
+	if (old != NULL)
+		snap_rele(old);
+}
+
+static inline double
+precip_lut_get(const precip_lut_t *lut, double z)
+{
+	unsigned i = clamp((z - lut->z0) * lut->inv_step + 1, 0,
+	    PRECIP_LUT_SZ + 1);
+	return (lut->val[i]);
+}
+
+/*
+ * Samples `nodes' into `lut'. Same as fx_lin_multi without extrapolation
+ * returning NAN, altitudes off the curve have no precip.
+ */
+static void
+precip_lut_build(precip_lut_t *lut, const vect2_t *nodes)
+{
+	unsigned last = 1;
+	double step;
+
+	while (!IS_NULL_VECT(nodes[last + 1]))
+		last++;
+	ASSERT3F(nodes[last].x, >, nodes[0].x);
+	step = (nodes[last].x - nodes[0].x) / PRECIP_LUT_SZ;
+
+	lut->z0 = nodes[0].x;
+	lut->inv_step = 1 / step;
+	lut->val[0] = 0;
+	lut->val[PRECIP_LUT_SZ + 1] = 0;
+	for (unsigned i = 0; i < PRECIP_LUT_SZ; i++) {
+		double v = fx_lin_multi(nodes[0].x + (i + 0.5) * step, nodes,
+		    B_FALSE);
+		lut->val[i + 1] = (isnan(v) ? 0 : v);
+	}
 }
 
 static void
 atmo_xp11_probe(scan_line_t *sl)
 {
 #define	COST_PER_1KM	0.07
-	double range;
+	atmo_snap_t *snap;
+	const precip_lut_t *precip_lut;
 	double dir_rand1 = (sin(DEG2RAD(sl->dir.x) * 6.7768) *
 	    sin(DEG2RAD(sl->dir.x) * 18.06) *
 	    sin(DEG2RAD(sl->dir.x) * 31.415)) / 15.0;
@@ -251,50 +419,45 @@ atmo_xp11_probe(scan_line_t *sl)
 	    sin(DEG2RAD(sl->dir.x) * 14.459) *
 	    sin(DEG2RAD(sl->dir.x) * 34.252)) / 15.0;
 
-	double rhdg_left = DEG2RAD(sl->ant_rhdg - sl->shape.x);
-	double rhdg_right = DEG2RAD(sl->ant_rhdg + sl->shape.x);
-
 	double sin_rhdg = sin(DEG2RAD(sl->ant_rhdg));
-	double sin_rhdg_left = sl->vert_scan ? sin(rhdg_left) : 0;
-	double sin_rhdg_right = sl->vert_scan ? sin(rhdg_right) : 0;
-
 	double cos_rhdg = cos(DEG2RAD(sl->ant_rhdg));
-	double cos_rhdg_left = sl->vert_scan ? cos(rhdg_left) : 0;
-	double cos_rhdg_right = sl->vert_scan ? cos(rhdg_right) : 0;
+	double tan_half_beam = tan(DEG2RAD(sl->shape.x / 2));
 	double sin_pitch = sin(DEG2RAD(sl->dir.y));
 	double sin_pitch_up = !sl->vert_scan ? sin(DEG2RAD(sl->dir.y +
 	    sl->shape.y * (0.5 + dir_rand1))) : 0;
 	double sin_pitch_dn = !sl->vert_scan ? sin(DEG2RAD(sl->dir.y -
 	    sl->shape.y * (0.5 + dir_rand2))) : 0;
-	vect2_t precip_nodes[5];
 	double energy = sl->energy;
 	double sample_sz = sl->range / sl->num_samples;
 	double sample_sz_rat = sample_sz / 1000.0;
 	double cost_per_sample = COST_PER_1KM * sample_sz_rat;
+	double pix_per_m;
 
-	mutex_enter(&xp11_atmo.lock);
-	range = xp11_atmo.range;
-	memcpy(precip_nodes, xp11_atmo.precip_nodes, sizeof (precip_nodes));
-	mutex_exit(&xp11_atmo.lock);
+	snap = snap_hold();
+	if (snap == NULL) {
+		for (int i = 0; i < sl->num_samples; i++) {
+			sl->energy_out[i] = 0;
+			sl->doppler_out[i] = 0;
+		}
+		return;
+	}
+	precip_lut = &snap->precip_lut;
+	pix_per_m = EFIS_LON_FWD / snap->range;
 
 	for (int i = 0; i < sl->num_samples; i++) {
-		int x = (((double)i + 1) / sl->num_samples) *
-		    (sl->range / range) * EFIS_LON_FWD * sin_rhdg;
-		int x_left = sl->vert_scan ? (((double)i + 1) /
-		    sl->num_samples) * (sl->range / range) * EFIS_LON_FWD *
-		    sin_rhdg_left : 0;
-		int x_right = sl->vert_scan ? (((double)i + 1) /
-		    sl->num_samples) * (sl->range / range) * EFIS_LON_FWD *
-		    sin_rhdg_right : 0;
-		int y = (((double)i + 1) / sl->num_samples) *
-		    (sl->range / range) * EFIS_LON_FWD * cos_rhdg;
-		int y_left = sl->vert_scan ? (((double)i + 1) /
-		    sl->num_samples) * (sl->range / range) * EFIS_LON_FWD *
-		    cos_rhdg_left : 0;
-		int y_right = sl->vert_scan ? (((double)i + 1) /
-		    sl->num_samples) * (sl->range / range) * EFIS_LON_FWD *
-		    cos_rhdg_right : 0;
 		double d = (((double)i + 1) / sl->num_samples) * sl->range;
+		double x = d * pix_per_m * sin_rhdg + EFIS_LAT_PIX;
+		double y = d * pix_per_m * cos_rhdg + EFIS_LON_AFT;
+		/*
+		 * Half-width of the beam footprint across the beam at this
+		 * distance and half-length of the range bin along the beam,
+		 * in EFIS pixels. We average the precip intensity over the
+		 * axis-aligned box around the footprint.
+		 */
+		double hw = MAX(d * tan_half_beam * pix_per_m, 0.5);
+		double hl = MAX((sample_sz / 2) * pix_per_m, 0.5);
+		double ext_x = fabs(sin_rhdg) * hl + fabs(cos_rhdg) * hw;
+		double ext_y = fabs(cos_rhdg) * hl + fabs(sin_rhdg) * hw;
 		double z_up = sl->origin.elev + d * sin_pitch_up;
 		double z = sl->origin.elev + d * sin_pitch;
 		double z_dn = sl->origin.elev + d * sin_pitch_dn;
@@ -302,10 +465,18 @@ atmo_xp11_probe(scan_line_t *sl)
 		double precip_intens[3];
 		double energy_cost = 0;
 
-		UNUSED(z);
-
-		x += EFIS_LAT_PIX;
-		y += EFIS_LON_AFT;
+		/*
+		 * The precip intensity is at most 1, so this is the most
+		 * this or any further range bin can return. Once that can't
+		 * show up on the display, we're done.
+		 */
+		if (cost_per_sample * (energy / sl->energy) < sl->min_energy) {
+			memset(&sl->energy_out[i], 0, (sl->num_samples - i) *
+			    sizeof (*sl->energy_out));
+			memset(&sl->doppler_out[i], 0, (sl->num_samples - i) *
+			    sizeof (*sl->doppler_out));
+			break;
+		}
 
 		/*
 		 * No doppler radar support yet.
@@ -317,19 +488,9 @@ atmo_xp11_probe(scan_line_t *sl)
 			continue;
 		}
 
-		if (xp11_atmo.pixels != NULL) {
-			precip_intens_pt = (xp11_atmo.pixels[y *
-			    EFIS_WIDTH + x] & 0xff) / 255.0;
-			if (sl->vert_scan) {
-				precip_intens_pt += (xp11_atmo.pixels[y_left *
-				    EFIS_WIDTH + x_left] & 0xff) / 255.0;
-				precip_intens_pt += (xp11_atmo.pixels[y_right *
-				    EFIS_WIDTH + x_right] & 0xff) / 255.0;
-				precip_intens_pt /= 3.0;
-			}
-		} else {
-			precip_intens_pt = 0.0;
-		}
+		precip_intens_pt = efis_filt_sat_avg(snap->sat, EFIS_WIDTH,
+		    EFIS_HEIGHT, floor(x - ext_x), floor(y - ext_y),
+		    floor(x + ext_x), floor(y + ext_y)) / 255.0;
 
 		/*
 		 * Compute precip intensity while taking the precip modulation
@@ -337,23 +498,17 @@ atmo_xp11_probe(scan_line_t *sl)
 		 */
 		if (!sl->vert_scan) {
 			precip_intens[0] = precip_intens_pt *
-			    fx_lin_multi(z_up, precip_nodes, B_FALSE);
-			if (isnan(precip_intens[0]))
-				precip_intens[0] = 0;
+			    precip_lut_get(precip_lut, z_up);
 		} else {
 			precip_intens[0] = 0;
 		}
 
 		precip_intens[1] = precip_intens_pt *
-		    fx_lin_multi(z, precip_nodes, B_FALSE);
-		if (isnan(precip_intens[1]))
-			precip_intens[1] = 0;
+		    precip_lut_get(precip_lut, z);
 
 		if (!sl->vert_scan) {
 			precip_intens[2] = precip_intens_pt *
-			    fx_lin_multi(z_dn, precip_nodes, B_FALSE);
-			if (isnan(precip_intens[2]))
-				precip_intens[2] = 0;
+			    precip_lut_get(precip_lut, z_dn);
 		} else {
 			precip_intens[2] = 0;
 		}
@@ -368,6 +523,8 @@ atmo_xp11_probe(scan_line_t *sl)
 		sl->energy_out[i] = energy_cost;
 		energy = MAX(0, energy - energy_cost);
 	}
+
+	snap_rele(snap);
 }
 
 static void
@@ -391,8 +548,8 @@ update_efis(void)
 		dr_seti(&drs.EFIS.mode, EFIS_MODE_NORM);
 	if (dr_geti(&drs.EFIS.submode) != EFIS_SUBMODE_GOOD_MAP)
 		dr_seti(&drs.EFIS.submode, EFIS_SUBMODE_GOOD_MAP);
-	if (dr_geti(&drs.EFIS.range) != (int)xp11_atmo.range_i)
-		dr_seti(&drs.EFIS.range, xp11_atmo.range_i);
+	if (dr_geti(&drs.EFIS.range) != (int)atomic_load(&xp11_atmo.range_i))
+		dr_seti(&drs.EFIS.range, atomic_load(&xp11_atmo.range_i));
 	if (dr_geti(&drs.EFIS.shows_wx) != 1)
 		dr_seti(&drs.EFIS.shows_wx, 1);
 	if (dr_getf(&drs.EFIS.wx_alpha) != 1.0)
@@ -500,18 +657,23 @@ update_precip(void)
 		force_increasing_x(&xp11_atmo.precip_nodes[2],
 		    &xp11_atmo.precip_nodes[3]);
 	}
+	precip_lut_build(&xp11_atmo.precip_lut, xp11_atmo.precip_nodes);
 }
 
 static void
 setup_opengl(void)
 {
 	if (xp11_atmo.pbo == 0) {
+		/* large enough for both the raw & filtered readback */
 		glGenBuffers(1, &xp11_atmo.pbo);
 		glBindBuffer(GL_PIXEL_PACK_BUFFER, xp11_atmo.pbo);
 		glBufferData(GL_PIXEL_PACK_BUFFER, EFIS_WIDTH * EFIS_HEIGHT *
-		    sizeof (*xp11_atmo.pixels), 0, GL_STREAM_READ);
+		    sizeof (uint32_t), 0, GL_STREAM_READ);
 		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 	}
+	/* the CPU filter reads the EFIS map directly */
+	if (xp11_atmo.cpu_filt)
+		return;
 
 	if (xp11_atmo.tmp_tex[0] == 0) {
 		glGenTextures(3, xp11_atmo.tmp_tex);
@@ -560,6 +722,21 @@ transfer_new_efis_frame(void)
 	    EFIS_MAP_NUM_RANGES - 1)];
 	GLint old_read_fbo, old_draw_fbo;
 
+	xp11_atmo.xfer_range = range;
+
+	if (xp11_atmo.cpu_filt) {
+		/*
+		 * Read back the raw EFIS map in one go, efis_filt_thr does
+		 * the rest once the transfer completes.
+		 */
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, xp11_atmo.pbo);
+		glReadPixels(xp11_atmo.efis_x, xp11_atmo.efis_y, EFIS_WIDTH,
+		    EFIS_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		return;
+	}
+
 	XPLMSetGraphicsState(0, 1, 0, 1, 1, 1, 1);
 	glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &old_read_fbo);
 	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &old_draw_fbo);
@@ -617,11 +794,14 @@ transfer_new_efis_frame(void)
 
 	/*
 	 * Step 4: set up transfer of the output FBO back to the CPU.
+	 * We only use the intensity in the red channel.
 	 */
 	glBindFramebuffer(GL_READ_FRAMEBUFFER, xp11_atmo.tmp_fbo[2]);
 	glBindBuffer(GL_PIXEL_PACK_BUFFER, xp11_atmo.pbo);
-	glReadPixels(0, 0, EFIS_WIDTH, EFIS_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE,
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, EFIS_WIDTH, EFIS_HEIGHT, GL_RED, GL_UNSIGNED_BYTE,
 	    NULL);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
 	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 
 	/*
@@ -658,12 +838,8 @@ update_cb(XPLMDrawingPhase phase, int before, void *refcon)
 	update_efis();
 	update_precip();
 
-	if (xp11_atmo.pixels == NULL) {
-		if (xp11_atmo.efis_w == 0 || xp11_atmo.efis_h == 0)
-			goto out;
-		xp11_atmo.pixels = safe_calloc(EFIS_WIDTH * EFIS_HEIGHT,
-		    sizeof (*xp11_atmo.pixels));
-	}
+	if (xp11_atmo.efis_w == 0 || xp11_atmo.efis_h == 0)
+		goto out;
 
 	setup_opengl();
 
@@ -671,25 +847,45 @@ update_cb(XPLMDrawingPhase phase, int before, void *refcon)
 	if (xp11_atmo.xfer_sync != 0) {
 		if (glClientWaitSync(xp11_atmo.xfer_sync, 0, 0) !=
 		    GL_TIMEOUT_EXPIRED) {
+			uint64_t start = perf_clock();
 			void *ptr;
 
 			/* Latest WXR image transfer is complete, fetch it */
 			glBindBuffer(GL_PIXEL_PACK_BUFFER, xp11_atmo.pbo);
 			ptr = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
-			if (ptr != NULL) {
-				memcpy(xp11_atmo.pixels, ptr, EFIS_WIDTH *
-				    EFIS_HEIGHT * sizeof (*xp11_atmo.pixels));
-				glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			if (ptr != NULL && xp11_atmo.cpu_filt) {
+				memcpy(xp11_atmo.filt_in, ptr, EFIS_WIDTH *
+				    EFIS_HEIGHT * sizeof (*xp11_atmo.filt_in));
+				xp11_atmo.filt_range = xp11_atmo.xfer_range;
+				xp11_atmo.filt_pending = B_TRUE;
+				cv_signal(&xp11_atmo.filt_cv);
+			} else if (ptr != NULL) {
+				/* with all snapshots in use, drop the frame */
+				atmo_snap_t *snap = snap_claim();
+
+				if (snap != NULL) {
+					memcpy(snap->pixels, ptr,
+					    sizeof (snap->pixels));
+					snap->range = xp11_atmo.xfer_range;
+					snap->precip_lut = xp11_atmo.precip_lut;
+					snap_publish(snap);
+				}
 			}
+			if (ptr != NULL)
+				glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
 			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 			glDeleteSync(xp11_atmo.xfer_sync);
 			xp11_atmo.xfer_sync = 0;
+			perf_hist_end(&xp11_atmo.efis_perf, start);
 		}
 	} else if (xp11_atmo.last_update + UPD_INTVAL <= now) {
+		uint64_t start = perf_clock();
+
 		transfer_new_efis_frame();
 		xp11_atmo.xfer_sync =
 		    glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 		xp11_atmo.last_update = now;
+		perf_hist_end(&xp11_atmo.efis_perf, start);
 	}
 
 out:
@@ -697,14 +893,69 @@ out:
 	return (1);
 }
 
+/*
+ * Runs the CPU version of the EFIS cleanup & smoothing passes on each new
+ * raw EFIS frame and publishes the result as a new snapshot.
+ */
+static void
+efis_filt_thr(void *unused)
+{
+	UNUSED(unused);
+
+	thread_set_name("OpenWXR-efis");
+
+	mutex_enter(&xp11_atmo.lock);
+	for (;;) {
+		uint32_t *tmp;
+		atmo_snap_t *snap;
+
+		while (!xp11_atmo.filt_shutdown && !xp11_atmo.filt_pending)
+			cv_wait(&xp11_atmo.filt_cv, &xp11_atmo.lock);
+		if (xp11_atmo.filt_shutdown)
+			break;
+		/* swap buffers, so the next frame can arrive while we work */
+		tmp = xp11_atmo.filt_in;
+		xp11_atmo.filt_in = xp11_atmo.filt_wk;
+		xp11_atmo.filt_wk = tmp;
+		xp11_atmo.filt_pending = B_FALSE;
+		/* with all snapshots in use, drop the frame */
+		snap = snap_claim();
+		if (snap == NULL)
+			continue;
+		snap->range = xp11_atmo.filt_range;
+		snap->precip_lut = xp11_atmo.precip_lut;
+		mutex_exit(&xp11_atmo.lock);
+
+		/*
+		 * smooth.frag takes 5x5 taps spaced WX_SMOOTH_RNG apart,
+		 * so cover the same +-2 * WX_SMOOTH_RNG footprint.
+		 */
+		efis_filt_run(xp11_atmo.filt, xp11_atmo.filt_wk,
+		    round((2 * WX_SMOOTH_RNG / snap->range) * EFIS_WIDTH),
+		    round((2 * WX_SMOOTH_RNG / snap->range) * EFIS_HEIGHT),
+		    snap->pixels);
+		snap_publish(snap);
+
+		mutex_enter(&xp11_atmo.lock);
+	}
+	mutex_exit(&xp11_atmo.lock);
+}
+
 atmo_t *
-atmo_xp11_init(void)
+atmo_xp11_init(const conf_t *conf)
 {
 	ASSERT(!inited);
 	inited = B_TRUE;
 
 	memset(&xp11_atmo, 0, sizeof (xp11_atmo));
 	mutex_init(&xp11_atmo.lock);
+	xp11_atmo.snaps = safe_calloc(NUM_SNAPS, sizeof (*xp11_atmo.snaps));
+	for (int i = 0; i < NUM_SNAPS; i++)
+		atomic_init(&xp11_atmo.snaps[i].refcnt, 0);
+	atomic_init(&xp11_atmo.snap, NULL);
+	atomic_init(&xp11_atmo.snap_gen, 0);
+	atomic_init(&xp11_atmo.range_i, 0);
+	perf_hist_init(&xp11_atmo.efis_perf);
 
 	debug_cmd = XPLMCreateCommand("openwxr/debug_atmo_xp11",
 	    "Dump XP11 screenshot into X-Plane folder");
@@ -763,6 +1014,20 @@ atmo_xp11_init(void)
 	for (int i = 0; i < 4; i++)
 		xp11_atmo.precip_nodes[i] = VECT2(i, 0);
 	xp11_atmo.precip_nodes[4] = NULL_VECT2;
+	precip_lut_build(&xp11_atmo.precip_lut, xp11_atmo.precip_nodes);
+
+	conf_get_b(conf, "efis/cpu_filter", &xp11_atmo.cpu_filt);
+	if (xp11_atmo.cpu_filt) {
+		xp11_atmo.filt = efis_filt_init(EFIS_WIDTH, EFIS_HEIGHT);
+		xp11_atmo.filt_in = safe_calloc(EFIS_WIDTH * EFIS_HEIGHT,
+		    sizeof (*xp11_atmo.filt_in));
+		xp11_atmo.filt_wk = safe_calloc(EFIS_WIDTH * EFIS_HEIGHT,
+		    sizeof (*xp11_atmo.filt_wk));
+		cv_init(&xp11_atmo.filt_cv);
+		VERIFY(thread_create(&xp11_atmo.filt_thr, efis_filt_thr,
+		    NULL));
+		return (&atmo);
+	}
 
 	if (!reload_gl_prog(&xp11_atmo.cleanup_prog, &cleanup_prog_info) ||
 	    !reload_gl_prog(&xp11_atmo.smooth_prog, &smooth_prog_info))
@@ -800,6 +1065,18 @@ atmo_xp11_fini(void)
 	XPLMUnregisterCommandHandler(debug_cmd, debug_cmd_handler, 0, NULL);
 	XPLMUnregisterDrawCallback(update_cb, xplm_Phase_Gauges, 0, NULL);
 
+	if (xp11_atmo.cpu_filt) {
+		mutex_enter(&xp11_atmo.lock);
+		xp11_atmo.filt_shutdown = B_TRUE;
+		cv_broadcast(&xp11_atmo.filt_cv);
+		mutex_exit(&xp11_atmo.lock);
+		thread_join(&xp11_atmo.filt_thr);
+		cv_destroy(&xp11_atmo.filt_cv);
+		efis_filt_fini(xp11_atmo.filt);
+		free(xp11_atmo.filt_in);
+		free(xp11_atmo.filt_wk);
+	}
+
 	if (xp11_atmo.pbo != 0)
 		glDeleteBuffers(1, &xp11_atmo.pbo);
 	if (xp11_atmo.tmp_fbo[0] != 0)
@@ -812,9 +1089,26 @@ atmo_xp11_fini(void)
 		glDeleteProgram(xp11_atmo.smooth_prog);
 	glutils_destroy_quads(&xp11_atmo.efis_quads);
 
+	/* all probes must have stopped by now */
+	snap_unpublish();
+	free(xp11_atmo.snaps);
+
 	mutex_destroy(&xp11_atmo.lock);
 }
 
+/*
+ * Returns the timing of the EFIS map captures & readbacks, or NULL if
+ * `atmo' isn't the XP11 atmosphere. Pass NULL to skip that check. The
+ * histogram stays valid until atmo_xp11_fini.
+ */
+const perf_hist_t *
+atmo_xp11_get_efis_perf(const atmo_t *atmo_in)
+{
+	if (!inited || (atmo_in != NULL && atmo_in != &atmo))
+		return (NULL);
+	return (&xp11_atmo.efis_perf);
+}
+
 void
 atmo_xp11_set_efis_pos(unsigned x, unsigned y, unsigned w, unsigned h)
 {
@@ -825,8 +1119,8 @@ atmo_xp11_set_efis_pos(unsigned x, unsigned y, unsigned w, unsigned h)
 	xp11_atmo.efis_w = w;
 	xp11_atmo.efis_h = h;
 
-	free(xp11_atmo.pixels);
-	xp11_atmo.pixels = NULL;
+	/* the old map is of no use at the new position */
+	snap_unpublish();
 
 	mutex_exit(&xp11_atmo.lock);
 }
@@ -19,16 +19,20 @@
 #ifndef	_ATMO_XP11_H_
 #define	_ATMO_XP11_H_
 
+#include <acfutils/conf.h>
+
 #include "atmo.h"
+#include "perf_hist.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-atmo_t *atmo_xp11_init(void);
+atmo_t *atmo_xp11_init(const conf_t *conf);
 void atmo_xp11_fini(void);
 
 void atmo_xp11_set_efis_pos(unsigned x, unsigned y, unsigned w, unsigned h);
+const perf_hist_t *atmo_xp11_get_efis_perf(const atmo_t *atmo_in);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,233 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+/*
+ * Quick correctness checks of the scan library which the frame checksum
+ * can't catch, run by wxr_bench before benchmarking. Each check logs
+ * what went wrong and returns B_FALSE on failure.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+
+#include "../efis_filt.h"
+#include "checks.h"
+
+#define	EFIS_CHK_W	11
+#define	EFIS_CHK_H	7
+
+/*
+ * The palette is uploaded to OpenGL as GL_RGBA bytes, so its entries
+ * must hold the colors' bytes in R, G, B, A order in memory, whatever
+ * the host's byte order.
+ */
+bool_t
+check_palette(void)
+{
+	static const struct {
+		unsigned	code;
+		uint8_t		rgba[4];
+	} exp[] = {
+	    { 0, { 0x00, 0x00, 0x00, 0x00 } },		/* no return */
+	    { 10, { 0x00, 0x00, 0x00, 0xff } },		/* opaque black */
+	    { SCAN_PALETTE_SZ - 1, { 0xff, 0x40, 0x80, 0xc0 } }
+	};
+	wxr_color_t colors[2] = {
+	    { .min_val = 1, .rgba = BE32(0xff4080c0) },
+	    { .min_val = 0.02, .rgba = BE32(0x000000ff) }
+	};
+	uint32_t palette[SCAN_PALETTE_SZ];
+	bool_t ok = B_TRUE;
+
+	scan_palette_build(palette, colors, 2, 1);
+	for (size_t i = 0; i < ARRAY_NUM_ELEM(exp); i++) {
+		const uint8_t *p = (const uint8_t *)&palette[exp[i].code];
+
+		if (memcmp(p, exp[i].rgba, 4) != 0) {
+			logMsg("palette check failed: code %u is "
+			    "%02x%02x%02x%02x, expected %02x%02x%02x%02x",
+			    exp[i].code, p[0], p[1], p[2], p[3],
+			    exp[i].rgba[0], exp[i].rgba[1], exp[i].rgba[2],
+			    exp[i].rgba[3]);
+			ok = B_FALSE;
+		}
+	}
+
+	return (ok);
+}
+
+/*
+ * compute_intens() of cleanup.frag, transcribed as is, in the same
+ * float precision the GPU uses. Returns the 8-bit output level.
+ */
+static uint8_t
+cleanup_frag_intens(const uint8_t px[4])
+{
+	float r = px[0] / 255.0f, g = px[1] / 255.0f;
+	float b = px[2] / 255.0f, a = px[3] / 255.0f;
+	float v;
+
+	if (a < 0.95f)
+		v = 0;
+	else if (r > 0.9f && g > 0.9f)
+		v = 0.75f;
+	else if (r > 0.9f)
+		v = 1;
+	else if (b > 0.1f)
+		v = (g > 0.9f ? 0.25f : (g > 0.7f ? 0.5f : 0));
+	else
+		v = (g > 0.8f ? 0.25f : (g > 0.4f ? 0.5f : 0));
+
+	return (lrintf(v * 255));
+}
+
+static uint32_t
+px2rgba(const uint8_t px[4])
+{
+	uint32_t rgba;
+
+	memcpy(&rgba, px, sizeof (rgba));
+	return (rgba);
+}
+
+/*
+ * Runs efis_filt_classify over every green & blue value with the red
+ * and alpha values on either side of their thresholds, comparing it to
+ * the shader.
+ */
+static bool_t
+check_efis_classify(void)
+{
+	static const uint8_t rs[] = { 0, 229, 230, 255 };
+	static const uint8_t as[] = { 0, 242, 243, 255 };
+	uint32_t rgba[256];
+	uint8_t intens[256];
+
+	for (unsigned i = 0; i < ARRAY_NUM_ELEM(rs) * ARRAY_NUM_ELEM(as) *
+	    256; i++) {
+		uint8_t px[4] = { rs[i / (256 * ARRAY_NUM_ELEM(as))], 0,
+		    i % 256, as[(i / 256) % ARRAY_NUM_ELEM(as)] };
+
+		for (unsigned g = 0; g < 256; g++) {
+			px[1] = g;
+			rgba[g] = px2rgba(px);
+		}
+		efis_filt_classify(rgba, intens, 256);
+		for (unsigned g = 0; g < 256; g++) {
+			px[1] = g;
+			if (intens[g] == cleanup_frag_intens(px))
+				continue;
+			logMsg("EFIS classify check failed: rgba "
+			    "%02x%02x%02x%02x is %d, expected %d", px[0],
+			    px[1], px[2], px[3], intens[g],
+			    cleanup_frag_intens(px));
+			return (B_FALSE);
+		}
+	}
+
+	return (B_TRUE);
+}
+
+/*
+ * Runs efis_filt_run on a fixed image and compares it to a brute-force
+ * box filter which only averages the pixels within the image.
+ */
+static bool_t
+check_efis_box(efis_filt_t *filt, const uint32_t *rgba,
+    const uint8_t *intens, unsigned rad_x, unsigned rad_y)
+{
+	uint8_t out[EFIS_CHK_W * EFIS_CHK_H];
+
+	efis_filt_run(filt, rgba, rad_x, rad_y, out);
+	for (int y = 0; y < EFIS_CHK_H; y++) {
+		for (int x = 0; x < EFIS_CHK_W; x++) {
+			unsigned sum = 0, area = 0, exp;
+
+			for (int v = y - (int)rad_y; v <= y + (int)rad_y;
+			    v++) {
+				for (int u = x - (int)rad_x;
+				    u <= x + (int)rad_x; u++) {
+					if (u < 0 || v < 0 ||
+					    u >= EFIS_CHK_W ||
+					    v >= EFIS_CHK_H)
+						continue;
+					sum += intens[v * EFIS_CHK_W + u];
+					area++;
+				}
+			}
+			exp = (sum + area / 2) / area;
+			if (out[y * EFIS_CHK_W + x] != exp) {
+				logMsg("EFIS box filter check failed: "
+				    "radius %ux%u, pixel %d,%d is %d, "
+				    "expected %d", rad_x, rad_y, x, y,
+				    out[y * EFIS_CHK_W + x], exp);
+				return (B_FALSE);
+			}
+		}
+	}
+
+	return (B_TRUE);
+}
+
+/*
+ * Checks the CPU port of the EFIS cleanup & smoothing passes: the
+ * classification thresholds against a transcript of the shader, and the
+ * summed-area box filter, edges included, against brute force.
+ */
+bool_t
+check_efis_filt(void)
+{
+	/* red, yellow, green, dim green, cyan, magenta & translucent red */
+	static const uint8_t colors[][4] = {
+	    { 0xff, 0x00, 0x00, 0xff }, { 0xff, 0xff, 0x00, 0xff },
+	    { 0x00, 0xff, 0x00, 0xff }, { 0x00, 0x96, 0x00, 0xff },
+	    { 0x00, 0xff, 0xff, 0xff }, { 0xff, 0x00, 0xff, 0xff },
+	    { 0xff, 0x00, 0x00, 0x80 }
+	};
+	static const unsigned radii[][2] = {
+	    { 0, 0 }, { 1, 1 }, { 2, 1 }, { 3, 5 }, { 20, 20 }
+	};
+	uint32_t rgba[EFIS_CHK_W * EFIS_CHK_H];
+	uint8_t intens[EFIS_CHK_W * EFIS_CHK_H];
+	efis_filt_t *filt;
+	bool_t ok;
+
+	if (!check_efis_classify())
+		return (B_FALSE);
+
+	for (unsigned i = 0; i < EFIS_CHK_W * EFIS_CHK_H; i++) {
+		const uint8_t *px = colors[(i * 5 + i / 3) %
+		    ARRAY_NUM_ELEM(colors)];
+
+		rgba[i] = px2rgba(px);
+		intens[i] = cleanup_frag_intens(px);
+	}
+	filt = efis_filt_init(EFIS_CHK_W, EFIS_CHK_H);
+	ok = B_TRUE;
+	for (size_t i = 0; ok && i < ARRAY_NUM_ELEM(radii); i++) {
+		ok = check_efis_box(filt, rgba, intens, radii[i][0],
+		    radii[i][1]);
+	}
+	efis_filt_fini(filt);
+
+	return (ok);
+}
@@ -0,0 +1,149 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#include <acfutils/assert.h>
+#include <acfutils/geom.h>
+#include <acfutils/helpers.h>
+#include <acfutils/math.h>
+#include <acfutils/perf.h>
+
+#include "synth.h"
+
+#define	COST_PER_1KM	0.07		/* same as atmo_xp11 */
+#define	LAT_DEG_SZ	111120.0	/* meters per degree of latitude */
+#define	TERR_WAVE_X	9000.0		/* meters */
+#define	TERR_WAVE_Y	7000.0		/* meters */
+
+typedef struct {
+	double	x, y;		/* meters east & north of the beam origin */
+	double	radius;		/* meters */
+	double	intens;		/* 0..1 */
+	double	top;		/* meters MSL */
+} synth_cell_t;
+
+/*
+ * A fixed squall line ahead of the aircraft with a couple of isolated
+ * cells off to the sides, so that every part of the scan sees some
+ * weather regardless of range.
+ */
+static const synth_cell_t cells[] = {
+    { -20000, 40000, 8000, 1.0, 10000 },
+    { 15000, 60000, 12000, 0.7, 8000 },
+    { 0, 110000, 20000, 0.5, 6000 },
+    { -50000, 90000, 15000, 0.8, 12000 },
+    { 40000, 20000, 5000, 0.9, 9000 },
+    { 90000, 200000, 30000, 0.6, 11000 }
+};
+
+static struct {
+	double	base_elev;
+	double	amplitude;
+} terr = { .base_elev = 0, .amplitude = 1000 };
+
+static void synth_atmo_set_range(double range);
+static void synth_atmo_probe(scan_line_t *sl);
+
+static const atmo_t atmo = {
+	.set_range = synth_atmo_set_range,
+	.probe = synth_atmo_probe
+};
+
+static void
+synth_atmo_set_range(double range)
+{
+	UNUSED(range);
+}
+
+static void
+synth_atmo_probe(scan_line_t *sl)
+{
+	double sin_hdg = sin(DEG2RAD(sl->dir.x));
+	double cos_hdg = cos(DEG2RAD(sl->dir.x));
+	double sin_pitch = sin(DEG2RAD(sl->dir.y));
+	double energy = sl->energy;
+	double sample_sz_rat = (sl->range / sl->num_samples) / 1000.0;
+	double cost_per_sample = COST_PER_1KM * sample_sz_rat;
+
+	for (int i = 0; i < sl->num_samples; i++) {
+		double d = (((double)i + 1) / sl->num_samples) * sl->range;
+		double x = d * sin_hdg;
+		double y = d * cos_hdg;
+		double z = sl->origin.elev + d * sin_pitch;
+		double intens = 0, energy_cost;
+
+		for (size_t j = 0; j < ARRAY_NUM_ELEM(cells); j++) {
+			const synth_cell_t *c = &cells[j];
+			double r2 = POW2(x - c->x) + POW2(y - c->y);
+
+			if (r2 >= POW2(c->radius) || z > c->top)
+				continue;
+			intens = MAX(intens,
+			    c->intens * (1 - r2 / POW2(c->radius)));
+		}
+		energy_cost = cost_per_sample * intens * (energy / sl->energy);
+		sl->energy_out[i] = energy_cost;
+		sl->doppler_out[i] = 0;
+		energy = MAX(0, energy - energy_cost);
+	}
+}
+
+const atmo_t *
+synth_atmo_init(void)
+{
+	return (&atmo);
+}
+
+void
+synth_terr_set_elev(double base_elev, double amplitude)
+{
+	terr.base_elev = base_elev;
+	terr.amplitude = amplitude;
+}
+
+/*
+ * Rolling hills on a regular grid. Anything that ends up below sea
+ * level is flattened out and reported as water.
+ */
+void
+synth_terr_probe(egpws_terr_probe_t *probe)
+{
+	for (size_t i = 0; i < probe->num_pts; i++) {
+		geo_pos2_t p = probe->in_pts[i];
+		double lat_m = p.lat * LAT_DEG_SZ;
+		double lon_m = p.lon * LAT_DEG_SZ * cos(DEG2RAD(p.lat));
+		double a = lon_m / TERR_WAVE_X, b = lat_m / TERR_WAVE_Y;
+		double elev = terr.base_elev + terr.amplitude *
+		    (0.5 + 0.5 * sin(a) * cos(b));
+
+		if (elev <= 0) {
+			probe->out_elev[i] = 0;
+			probe->out_norm[i] = VECT3(0, 0, 1);
+			probe->out_water[i] = 1;
+		} else {
+			double dx = (0.5 * terr.amplitude * cos(a) * cos(b)) /
+			    TERR_WAVE_X;
+			double dy = (-0.5 * terr.amplitude * sin(a) * sin(b)) /
+			    TERR_WAVE_Y;
+
+			probe->out_elev[i] = elev;
+			probe->out_norm[i] = vect3_unit(VECT3(-dx, -dy, 1),
+			    NULL);
+			probe->out_water[i] = 0;
+		}
+	}
+}
@@ -0,0 +1,44 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#ifndef	_SYNTH_H_
+#define	_SYNTH_H_
+
+#include <opengpws/xplane_api.h>
+
+#include "../atmo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Stand-in atmosphere & terrain providers for driving the scan engine
+ * outside of X-Plane. Both are deterministic functions of position, so
+ * two runs with the same parameters do the same amount of work.
+ */
+const atmo_t *synth_atmo_init(void);
+
+void synth_terr_set_elev(double base_elev, double amplitude);
+void synth_terr_probe(egpws_terr_probe_t *probe);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _SYNTH_H_ */
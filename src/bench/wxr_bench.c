@@ -0,0 +1,301 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+/*
+ * Headless scan-engine benchmark. Runs full antenna sweeps through the
+ * scan engine against the synthetic atmosphere & terrain providers and
+ * reports the per-scanline and per-sample cost of the worker math.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <acfutils/crc64.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/math.h>
+#include <acfutils/perf.h>
+#include <acfutils/safe_alloc.h>
+#include <acfutils/time.h>
+
+#include "../scan_pool.h"
+#include "checks.h"
+#include "synth.h"
+
+#define	DFL_RES_X	320
+#define	DFL_RES_Y	240
+#define	DFL_BEAM	3.5		/* degrees */
+#define	DFL_RANGE	40		/* NM */
+#define	DFL_ALT		10000		/* feet */
+#define	DFL_SWEEPS	10
+
+static void
+log_func(const char *str)
+{
+	fputs(str, stderr);
+}
+
+static void
+print_usage(const char *progname, FILE *fp)
+{
+	fprintf(fp, "Usage: %s [-x res_x] [-y res_y] [-b beam_x] "
+	    "[-B beam_y] [-r range_nm]\n"
+	    "    [-t tilt_deg] [-a alt_ft] [-g gnd_elev_m] [-n sweeps] "
+	    "[-k kern] [-j threads] [-s seed] [-C] [-T lines]\n"
+	    "    [-P] [-v] [-h]\n"
+	    "  -x res_x     : antenna columns per sweep (default: %d)\n"
+	    "  -y res_y     : samples per scan line (default: %d)\n"
+	    "  -b beam_x    : horizontal beam width in degrees "
+	    "(default: %.1f)\n"
+	    "  -B beam_y    : vertical beam width in degrees "
+	    "(default: %.1f)\n"
+	    "  -r range_nm  : display range in NM (default: %d)\n"
+	    "  -t tilt_deg  : antenna tilt in degrees (default: 0)\n"
+	    "  -a alt_ft    : aircraft altitude in feet (default: %d)\n"
+	    "  -g gnd_elev_m: base terrain elevation in meters "
+	    "(default: 0)\n"
+	    "  -n sweeps    : number of full sweeps to time (default: %d)\n"
+	    "  -k kern      : ground kernel: auto, scalar, sse2 or avx2 "
+	    "(default: auto)\n"
+	    "  -j threads   : number of scan line threads (default: 1)\n"
+	    "  -s seed      : ground noise seed (default: 0)\n"
+	    "  -C           : disable the terrain cache, probe terrain "
+	    "on every line\n"
+	    "  -T lines     : scan lines per terrain probe batch, 0 to "
+	    "disable\n"
+	    "                 batching (default: all lines of a sweep)\n"
+	    "  -P           : time the scan line phases and print their "
+	    "statistics\n"
+	    "  -v           : vertical scan mode\n",
+	    progname, DFL_RES_X, DFL_RES_Y, DFL_BEAM, DFL_BEAM, DFL_RANGE,
+	    DFL_ALT, DFL_SWEEPS);
+}
+
+static void
+print_perf(const perf_hist_t *hists, double secs)
+{
+	static const struct {
+		wxr_perf_phase_t	phase;
+		const char		*name;
+	} phases[] = {
+	    { WXR_PERF_ATMO, "atmosphere" },
+	    { WXR_PERF_TERR, "terrain" },
+	    { WXR_PERF_GROUND, "ground" }
+	};
+
+	printf("phase           count     p50 us     p99 us    busy %%\n");
+	for (size_t i = 0; i < ARRAY_NUM_ELEM(phases); i++) {
+		perf_hist_snap_t snap;
+
+		perf_hist_snap(&hists[phases[i].phase], &snap);
+		printf("%-12s %8llu %10.1f %10.1f %9.1f\n", phases[i].name,
+		    (unsigned long long)snap.count,
+		    perf_hist_snap_pct(&snap, 50) / 1000.0,
+		    perf_hist_snap_pct(&snap, 99) / 1000.0,
+		    (100 * snap.total / 1e9) / secs);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	wxr_conf_t conf = {
+	    .num_ranges = 1,
+	    .ranges = { NM2MET(DFL_RANGE) },
+	    .res_x = DFL_RES_X,
+	    .res_y = DFL_RES_Y,
+	    .beam_shape = VECT2(DFL_BEAM, DFL_BEAM),
+	    .disp_type = WXR_DISP_ARC,
+	    .scan_time = 6,
+	    .scan_angle = 90,
+	    .scan_angle_vert = 60,
+	    .smear = VECT2(1, 0)
+	};
+	double tilt = 0, alt = DFL_ALT, gnd_elev = 0;
+	unsigned sweeps = DFL_SWEEPS, num_threads = 1;
+	unsigned terr_batch = UINT32_MAX;
+	uint64_t seed = 0;
+	bool_t vert = B_FALSE, terr_cache = B_TRUE, perf = B_FALSE;
+	perf_hist_t perf_hists[WXR_NUM_PERF_PHASES];
+	scan_kern_type_t kern = SCAN_KERN_AUTO;
+	scan_t *scan;
+	scan_pool_t *pool;
+	scan_pool_client_t *pool_cl;
+	scan_job_t *jobs;
+	scan_tick_t tick = {
+	    .ant_pitch_req = 0,
+	    .range_idx = 0,
+	    .beam_shadow = B_TRUE
+	};
+	uint8_t *samples;
+	uint64_t start, end;
+	double secs;
+	unsigned long num_lines;
+	int opt;
+
+	while ((opt = getopt(argc, argv,
+	    "x:y:b:B:r:t:a:g:n:k:j:s:CT:Pvh")) != -1) {
+		switch (opt) {
+		case 'x':
+			conf.res_x = MAX(atoi(optarg), WXR_MIN_RES);
+			break;
+		case 'y':
+			conf.res_y = MAX(atoi(optarg), WXR_MIN_RES);
+			break;
+		case 'b':
+			conf.beam_shape.x = atof(optarg);
+			break;
+		case 'B':
+			conf.beam_shape.y = atof(optarg);
+			break;
+		case 'r':
+			conf.ranges[0] = NM2MET(atof(optarg));
+			break;
+		case 't':
+			tilt = atof(optarg);
+			break;
+		case 'a':
+			alt = atof(optarg);
+			break;
+		case 'g':
+			gnd_elev = atof(optarg);
+			break;
+		case 'n':
+			sweeps = MAX(atoi(optarg), 1);
+			break;
+		case 'k':
+			kern = scan_kern_str2type(optarg);
+			break;
+		case 'j':
+			num_threads = clampi(atoi(optarg), 1,
+			    SCAN_POOL_MAX_THREADS);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'C':
+			terr_cache = B_FALSE;
+			break;
+		case 'T':
+			terr_batch = atoi(optarg);
+			break;
+		case 'P':
+			perf = B_TRUE;
+			break;
+		case 'v':
+			vert = B_TRUE;
+			break;
+		case 'h':
+			print_usage(argv[0], stdout);
+			return (0);
+		default:
+			print_usage(argv[0], stderr);
+			return (1);
+		}
+	}
+	if (conf.beam_shape.x <= 0 || conf.beam_shape.y <= 0 ||
+	    conf.ranges[0] <= 0) {
+		print_usage(argv[0], stderr);
+		return (1);
+	}
+
+	log_init(log_func, "wxr_bench");
+	crc64_init();
+	crc64_srand(0);
+
+	if (!check_palette() || !check_efis_filt()) {
+		fprintf(stderr, "Self checks failed, not benchmarking.\n");
+		return (1);
+	}
+
+	synth_terr_set_elev(gnd_elev, 1000);
+	scan = scan_init(&conf, synth_atmo_init(), synth_terr_probe);
+	scan_set_kern(scan, kern);
+	scan_set_seed(scan, seed);
+	scan_set_terr_cache(scan, terr_cache);
+	for (int i = 0; i < WXR_NUM_PERF_PHASES; i++)
+		perf_hist_init(&perf_hists[i]);
+	/* a single thread means computing everything on this one */
+	pool = scan_pool_init(num_threads > 1 ? num_threads : 0, 0);
+	pool_cl = scan_pool_client_init(pool, scan, 1);
+	scan_pool_set_terr_batch(pool_cl, terr_batch);
+	samples = safe_calloc(conf.res_x * conf.res_y, sizeof (*samples));
+	jobs = safe_calloc(conf.res_x, sizeof (*jobs));
+	for (unsigned x = 0; x < conf.res_x; x++) {
+		jobs[x].ant_pos = x;
+		jobs[x].ant_pos_vert = x;
+		jobs[x].samples = &samples[x * conf.res_y];
+	}
+
+	tick.acf_pos = GEO_POS3(47.5, 12.5, FEET2MET(alt));
+	tick.acf_orient = VECT3(0, 0, 0);
+	tick.ant_pitch_req = tilt;
+	tick.vert_mode = vert;
+	scan_tick_prep(scan, &tick);
+
+	/* warm up caches & the branch predictor with one sweep */
+	scan_pool_run(pool_cl, &tick, jobs, conf.res_x);
+
+	/* only time the measured sweeps */
+	if (perf)
+		scan_set_perf(scan, perf_hists);
+	start = microclock();
+	for (unsigned i = 0; i < sweeps; i++) {
+		for (unsigned x = 0; x < conf.res_x; x++)
+			jobs[x].sweep = i + 1;
+		/* like the real worker, every sweep is a new tick */
+		scan_tick_prep(scan, &tick);
+		scan_pool_run(pool_cl, &tick, jobs, conf.res_x);
+	}
+	end = microclock();
+
+	num_lines = (unsigned long)sweeps * conf.res_x;
+	secs = MAX(USEC2SEC(end - start), 1e-6);
+
+	printf("res:            %u x %u\n", conf.res_x, conf.res_y);
+	printf("beam shape:     %.1f x %.1f deg\n", conf.beam_shape.x,
+	    conf.beam_shape.y);
+	printf("range:          %.0f NM\n", MET2NM(conf.ranges[0]));
+	printf("scan mode:      %s\n", vert ? "vertical" : "horizontal");
+	printf("ground kernel:  %s\n",
+	    scan_kern_type2str(scan_get_kern(scan)));
+	printf("threads:        %u\n",
+	    MAX(scan_pool_get_num_threads(pool), 1));
+	printf("scan lines:     %lu in %.3f s\n", num_lines, secs);
+	printf("scanlines/sec:  %.1f\n", num_lines / secs);
+	printf("ns/sample:      %.1f\n",
+	    (secs * 1e9) / (num_lines * conf.res_y));
+	/*
+	 * Checksum of the last sweep. With the same settings & seed, this
+	 * must come out the same for every thread count.
+	 */
+	printf("frame crc64:    %016llx\n", (unsigned long long)
+	    crc64(samples, conf.res_x * conf.res_y * sizeof (*samples)));
+	if (perf)
+		print_perf(perf_hists, secs);
+
+	free(jobs);
+	free(samples);
+	scan_pool_client_fini(pool_cl);
+	scan_pool_fini(pool);
+	scan_fini(scan);
+
+	return (0);
+}
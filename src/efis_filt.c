@@ -0,0 +1,169 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/safe_alloc.h>
+
+#include "efis_filt.h"
+
+/*
+ * The thresholds of compute_intens() in cleanup.frag, converted from
+ * normalized floats to the equivalent 8-bit comparisons (x > 0.9 is the
+ * same as x_byte >= 230, etc.).
+ */
+#define	BLUE_MIN	26	/* b > 0.1 */
+#define	ALPHA_MIN	243	/* a >= 0.95 */
+#define	RED_MIN		230	/* r > 0.9 */
+#define	GREEN_MIN	230	/* g > 0.9 */
+/* green thresholds for 0.25 & 0.5 with & without a blue component */
+#define	GREEN_25_BLUE	230	/* g > 0.9 */
+#define	GREEN_50_BLUE	179	/* g > 0.7 */
+#define	GREEN_25	205	/* g > 0.8 */
+#define	GREEN_50	103	/* g > 0.4 */
+
+/* output levels, same as the shader's 0.25 - 1.0 stored in a UNORM8 */
+#define	INTENS_25	64
+#define	INTENS_50	128
+#define	INTENS_75	191
+#define	INTENS_100	255
+
+struct efis_filt_s {
+	unsigned	w;
+	unsigned	h;
+	uint8_t		*intens;
+	/* (w + 1) x (h + 1) summed-area table, row & column 0 are zero */
+	uint32_t	*sat;
+};
+
+efis_filt_t *
+efis_filt_init(unsigned w, unsigned h)
+{
+	efis_filt_t *filt = safe_calloc(1, sizeof (*filt));
+
+	ASSERT(w != 0);
+	ASSERT(h != 0);
+	/* the table must not be able to overflow */
+	ASSERT3U((uint64_t)w * h * UINT8_MAX, <=, UINT32_MAX);
+
+	filt->w = w;
+	filt->h = h;
+	filt->intens = safe_calloc(w * h, sizeof (*filt->intens));
+	filt->sat = safe_calloc((w + 1) * (h + 1), sizeof (*filt->sat));
+
+	return (filt);
+}
+
+void
+efis_filt_fini(efis_filt_t *filt)
+{
+	if (filt == NULL)
+		return;
+	free(filt->intens);
+	free(filt->sat);
+	free(filt);
+}
+
+/*
+ * Port of compute_intens() from cleanup.frag. Classifies the EFIS map
+ * colors into precip intensities, dropping all other symbology. The
+ * if-else chain of the shader is evaluated back to front as a series of
+ * selects, so the loop has no branches and the compiler can vectorize
+ * it. Assumes a little-endian host, same as the rest of the EFIS code.
+ */
+void
+efis_filt_classify(const uint32_t *rgba, uint8_t *intens, unsigned n)
+{
+	for (unsigned i = 0; i < n; i++) {
+		uint32_t p = rgba[i];
+		unsigned r = p & 0xff;
+		unsigned g = (p >> 8) & 0xff;
+		unsigned b = (p >> 16) & 0xff;
+		unsigned a = p >> 24;
+		unsigned g_25 = (b >= BLUE_MIN ? GREEN_25_BLUE : GREEN_25);
+		unsigned g_50 = (b >= BLUE_MIN ? GREEN_50_BLUE : GREEN_50);
+		uint8_t v;
+
+		v = (g >= g_50 ? INTENS_50 : 0);
+		v = (g >= g_25 ? INTENS_25 : v);
+		v = (r >= RED_MIN ? INTENS_100 : v);
+		v = (r >= RED_MIN && g >= GREEN_MIN ? INTENS_75 : v);
+		v = (a >= ALPHA_MIN ? v : 0);
+		intens[i] = v;
+	}
+}
+
+void
+efis_filt_sat_build(const uint8_t *in, unsigned w, unsigned h,
+    uint32_t *sat)
+{
+	unsigned stride = w + 1;
+
+	ASSERT3U((uint64_t)w * h * UINT8_MAX, <=, UINT32_MAX);
+
+	memset(sat, 0, stride * sizeof (*sat));
+	for (unsigned y = 0; y < h; y++) {
+		const uint8_t *row = &in[y * w];
+		const uint32_t *sat_prev = &sat[y * stride];
+		uint32_t *sat_row = &sat[(y + 1) * stride];
+		uint32_t row_sum = 0;
+
+		sat_row[0] = 0;
+		for (unsigned x = 0; x < w; x++) {
+			row_sum += row[x];
+			sat_row[x + 1] = sat_prev[x + 1] + row_sum;
+		}
+	}
+}
+
+/*
+ * Classifies `rgba' and runs a box filter with a radius of `rad_x' x
+ * `rad_y' pixels over the result, writing the averaged intensities to
+ * `out'. Using a summed-area table, each output pixel costs the same
+ * regardless of the radius. Pixels outside of the image don't count
+ * towards the average, so the edges aren't darkened.
+ */
+void
+efis_filt_run(efis_filt_t *filt, const uint32_t *rgba,
+    unsigned rad_x, unsigned rad_y, uint8_t *out)
+{
+	unsigned w = filt->w, h = filt->h, stride = w + 1;
+	uint32_t *sat = filt->sat;
+
+	efis_filt_classify(rgba, filt->intens, w * h);
+	efis_filt_sat_build(filt->intens, w, h, sat);
+
+	for (unsigned y = 0; y < h; y++) {
+		unsigned y0 = (y > rad_y ? y - rad_y : 0);
+		unsigned y1 = MIN(y + rad_y + 1, h);
+
+		for (unsigned x = 0; x < w; x++) {
+			unsigned x0 = (x > rad_x ? x - rad_x : 0);
+			unsigned x1 = MIN(x + rad_x + 1, w);
+			unsigned area = (x1 - x0) * (y1 - y0);
+			uint32_t sum = sat[y1 * stride + x1] -
+			    sat[y0 * stride + x1] - sat[y1 * stride + x0] +
+			    sat[y0 * stride + x0];
+
+			out[y * w + x] = (sum + area / 2) / area;
+		}
+	}
+}
@@ -0,0 +1,86 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#ifndef	_EFIS_FILT_H_
+#define	_EFIS_FILT_H_
+
+#include <stdint.h>
+
+#include <acfutils/helpers.h>
+#include <acfutils/math.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * CPU implementation of the EFIS weather map cleanup & smoothing passes
+ * (data/cleanup.frag & data/smooth.frag). Takes the raw RGBA pixels of
+ * the EFIS map (bytes in R, G, B, A order) and produces one 8-bit precip
+ * intensity per pixel. Has no X-Plane or OpenGL dependencies.
+ */
+typedef struct efis_filt_s efis_filt_t;
+
+efis_filt_t *efis_filt_init(unsigned w, unsigned h);
+void efis_filt_fini(efis_filt_t *filt);
+
+void efis_filt_classify(const uint32_t *rgba, uint8_t *intens, unsigned n);
+void efis_filt_run(efis_filt_t *filt, const uint32_t *rgba,
+    unsigned rad_x, unsigned rad_y, uint8_t *out);
+
+/*
+ * Summed-area table of a w x h raster of 8-bit values. The table has
+ * (w + 1) x (h + 1) entries, with row & column 0 being all zeros, so
+ * that sat[y * (w + 1) + x] is the sum of all values above & left of
+ * (x, y), exclusive.
+ */
+void efis_filt_sat_build(const uint8_t *in, unsigned w, unsigned h,
+    uint32_t *sat);
+
+/*
+ * Returns the average of the raster values in the inclusive box
+ * [x0, x1] x [y0, y1], clipped to the raster. Returns 0 if nothing of
+ * the box lies within the raster. The result is clamped to 0..255, so
+ * that a table being rebuilt concurrently can't produce garbage.
+ */
+static inline double
+efis_filt_sat_avg(const uint32_t *sat, unsigned w, unsigned h,
+    int x0, int y0, int x1, int y1)
+{
+	unsigned stride = w + 1;
+	int64_t sum;
+	unsigned area;
+
+	x0 = MAX(x0, 0);
+	y0 = MAX(y0, 0);
+	x1 = MIN(x1 + 1, (int)w);
+	y1 = MIN(y1 + 1, (int)h);
+	if (x0 >= x1 || y0 >= y1)
+		return (0);
+	area = (x1 - x0) * (y1 - y0);
+	sum = (int64_t)sat[y1 * stride + x1] - sat[y0 * stride + x1] -
+	    sat[y1 * stride + x0] + sat[y0 * stride + x0];
+
+	return (clamp(sum / (double)area, 0, UINT8_MAX));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _EFIS_FILT_H_ */
@@ -0,0 +1,220 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if	IBM
+#include <windows.h>
+#else	/* !IBM */
+#include <time.h>
+#endif	/* !IBM */
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/safe_alloc.h>
+
+#include "perf_hist.h"
+
+/*
+ * Monotonic clock in nanoseconds. microclock is too coarse for the
+ * shorter phases, such as a single scan line's atmosphere probe.
+ */
+uint64_t
+perf_clock(void)
+{
+#if	IBM
+	static LARGE_INTEGER freq = { .QuadPart = 0 };
+	LARGE_INTEGER cnt;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&cnt);
+	return ((cnt.QuadPart / freq.QuadPart) * 1000000000ull +
+	    ((cnt.QuadPart % freq.QuadPart) * 1000000000ull) / freq.QuadPart);
+#else	/* !IBM */
+	struct timespec ts;
+
+	VERIFY3S(clock_gettime(CLOCK_MONOTONIC, &ts), ==, 0);
+	return ((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+#endif	/* !IBM */
+}
+
+void
+perf_hist_init(perf_hist_t *hist)
+{
+	atomic_init(&hist->total, 0);
+	for (unsigned i = 0; i < PERF_HIST_NUM_BUCKETS; i++)
+		atomic_init(&hist->buckets[i], 0);
+}
+
+static inline unsigned
+bucket_idx(uint64_t ns)
+{
+	unsigned msb;
+
+	if (ns < (1ull << PERF_HIST_MIN_SHIFT))
+		return (0);
+	msb = 63 - __builtin_clzll(ns);
+	if (msb >= PERF_HIST_MAX_SHIFT)
+		return (PERF_HIST_NUM_BUCKETS - 1);
+	return (1 + ((msb - PERF_HIST_MIN_SHIFT) << PERF_HIST_SUB_SHIFT) +
+	    ((ns >> (msb - PERF_HIST_SUB_SHIFT)) & (PERF_HIST_SUB - 1)));
+}
+
+/*
+ * Returns the middle of the range of durations falling into a bucket.
+ */
+static uint64_t
+bucket_value(unsigned idx)
+{
+	unsigned oct, sub;
+	uint64_t lo;
+
+	if (idx == 0)
+		return (1ull << (PERF_HIST_MIN_SHIFT - 1));
+	if (idx == PERF_HIST_NUM_BUCKETS - 1)
+		return (1ull << PERF_HIST_MAX_SHIFT);
+	oct = (idx - 1) >> PERF_HIST_SUB_SHIFT;
+	sub = (idx - 1) & (PERF_HIST_SUB - 1);
+	lo = (uint64_t)(PERF_HIST_SUB + sub) <<
+	    (PERF_HIST_MIN_SHIFT + oct - PERF_HIST_SUB_SHIFT);
+	return (lo + (1ull << (PERF_HIST_MIN_SHIFT + oct -
+	    PERF_HIST_SUB_SHIFT)) / 2);
+}
+
+void
+perf_hist_add(perf_hist_t *hist, uint64_t ns)
+{
+	atomic_fetch_add_explicit(&hist->buckets[bucket_idx(ns)], 1,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->total, ns, memory_order_relaxed);
+}
+
+/*
+ * Copies out the histogram. With other threads adding to it at the same
+ * time, the copy may be a few samples off.
+ */
+void
+perf_hist_snap(const perf_hist_t *hist, perf_hist_snap_t *snap)
+{
+	snap->count = 0;
+	for (unsigned i = 0; i < PERF_HIST_NUM_BUCKETS; i++) {
+		snap->buckets[i] = atomic_load_explicit(&hist->buckets[i],
+		    memory_order_relaxed);
+		snap->count += snap->buckets[i];
+	}
+	snap->total = atomic_load_explicit(&hist->total, memory_order_relaxed);
+}
+
+void
+perf_hist_snap_add(perf_hist_snap_t *sum, const perf_hist_snap_t *snap)
+{
+	sum->count += snap->count;
+	sum->total += snap->total;
+	for (unsigned i = 0; i < PERF_HIST_NUM_BUCKETS; i++)
+		sum->buckets[i] += snap->buckets[i];
+}
+
+/*
+ * Returns the `pct' percentile (0 - 100) of the durations in `snap' in
+ * nanoseconds, or 0 if it is empty.
+ */
+uint64_t
+perf_hist_snap_pct(const perf_hist_snap_t *snap, double pct)
+{
+	uint64_t target, sum = 0;
+
+	ASSERT3F(pct, >=, 0);
+	ASSERT3F(pct, <=, 100);
+
+	if (snap->count == 0)
+		return (0);
+	target = MAX(ceil(snap->count * (pct / 100)), 1);
+	for (unsigned i = 0; i < PERF_HIST_NUM_BUCKETS; i++) {
+		sum += snap->buckets[i];
+		if (sum >= target)
+			return (bucket_value(i));
+	}
+	return (bucket_value(PERF_HIST_NUM_BUCKETS - 1));
+}
+
+/*
+ * Histograms are cumulative, so to see what they looked like recently,
+ * a window keeps two earlier snapshots of them, taken `len' apart.
+ * `cur' holds the current snapshots of all `num_hists' histograms.
+ */
+void
+perf_win_init(perf_win_t *win, unsigned num_hists,
+    const perf_hist_snap_t *cur, uint64_t now)
+{
+	ASSERT(num_hists != 0);
+
+	win->num_hists = num_hists;
+	for (int i = 0; i < 2; i++) {
+		win->start[i] = now;
+		win->base[i] = safe_calloc(num_hists, sizeof (*win->base[i]));
+		memcpy(win->base[i], cur, num_hists * sizeof (*cur));
+	}
+}
+
+void
+perf_win_fini(perf_win_t *win)
+{
+	free(win->base[0]);
+	free(win->base[1]);
+	memset(win, 0, sizeof (*win));
+}
+
+/*
+ * Fills in `recent' with what has been added to the histograms since
+ * the older of the window's snapshots, and returns how long ago that
+ * was, in ns. Once the newer snapshot is `len' old, it becomes the older
+ * one and `cur' is kept as the newer one, so `recent' normally covers
+ * between `len' and twice that. After a long gap between updates, it
+ * covers the whole gap.
+ */
+uint64_t
+perf_win_update(perf_win_t *win, const perf_hist_snap_t *cur,
+    uint64_t now, uint64_t len, perf_hist_snap_t *recent)
+{
+	const perf_hist_snap_t *base;
+
+	if (now - win->start[1] >= len) {
+		perf_hist_snap_t *tmp = win->base[0];
+
+		win->base[0] = win->base[1];
+		win->base[1] = tmp;
+		memcpy(win->base[1], cur, win->num_hists * sizeof (*cur));
+		win->start[0] = win->start[1];
+		win->start[1] = now;
+	}
+
+	base = win->base[0];
+	for (unsigned i = 0; i < win->num_hists; i++) {
+		recent[i].count = cur[i].count - base[i].count;
+		recent[i].total = cur[i].total - base[i].total;
+		for (unsigned j = 0; j < PERF_HIST_NUM_BUCKETS; j++) {
+			recent[i].buckets[j] = cur[i].buckets[j] -
+			    base[i].buckets[j];
+		}
+	}
+
+	return (now - win->start[0]);
+}
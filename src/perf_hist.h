@@ -0,0 +1,105 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#ifndef	_PERF_HIST_H_
+#define	_PERF_HIST_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Latency histograms, cheap enough to be always on in the hot paths.
+ * Durations are in nanoseconds and are binned on a log scale, with
+ * PERF_HIST_SUB buckets per doubling, so percentiles come out within
+ * about 10% of the real value. Bucket 0 holds everything shorter than
+ * 2^PERF_HIST_MIN_SHIFT ns, the last bucket everything from
+ * 2^PERF_HIST_MAX_SHIFT ns up.
+ */
+#define	PERF_HIST_MIN_SHIFT	6		/* 64 ns */
+#define	PERF_HIST_MAX_SHIFT	36		/* ~69 s */
+#define	PERF_HIST_SUB_SHIFT	2
+#define	PERF_HIST_SUB		(1 << PERF_HIST_SUB_SHIFT)
+#define	PERF_HIST_NUM_BUCKETS	\
+	(((PERF_HIST_MAX_SHIFT - PERF_HIST_MIN_SHIFT) << PERF_HIST_SUB_SHIFT) \
+	+ 2)
+
+/*
+ * Any number of threads may add to a histogram concurrently.
+ */
+typedef struct {
+	atomic_ullong	total;		/* ns */
+	atomic_ullong	buckets[PERF_HIST_NUM_BUCKETS];
+} perf_hist_t;
+
+/*
+ * A plain copy of a histogram, see perf_hist_snap.
+ */
+typedef struct {
+	uint64_t	count;
+	uint64_t	total;		/* ns */
+	uint64_t	buckets[PERF_HIST_NUM_BUCKETS];
+} perf_hist_snap_t;
+
+/*
+ * Keeps the recent contents of `num_hists' histograms, see perf_win_update.
+ */
+typedef struct {
+	unsigned		num_hists;
+	uint64_t		start[2];	/* perf_clock time */
+	perf_hist_snap_t	*base[2];
+} perf_win_t;
+
+uint64_t perf_clock(void);
+
+void perf_hist_init(perf_hist_t *hist);
+void perf_hist_add(perf_hist_t *hist, uint64_t ns);
+void perf_hist_snap(const perf_hist_t *hist, perf_hist_snap_t *snap);
+void perf_hist_snap_add(perf_hist_snap_t *sum, const perf_hist_snap_t *snap);
+uint64_t perf_hist_snap_pct(const perf_hist_snap_t *snap, double pct);
+
+void perf_win_init(perf_win_t *win, unsigned num_hists,
+    const perf_hist_snap_t *cur, uint64_t now);
+void perf_win_fini(perf_win_t *win);
+uint64_t perf_win_update(perf_win_t *win, const perf_hist_snap_t *cur,
+    uint64_t now, uint64_t len, perf_hist_snap_t *recent);
+
+/*
+ * Adds the time since `start' (from perf_clock) to `hist', if it isn't
+ * NULL. Returns the current time, so consecutive phases can be chained.
+ */
+static inline uint64_t
+perf_hist_end(perf_hist_t *hist, uint64_t start)
+{
+	uint64_t now;
+
+	if (hist == NULL)
+		return (0);
+	now = perf_clock();
+	perf_hist_add(hist, now - start);
+	return (now);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _PERF_HIST_H_ */
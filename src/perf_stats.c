@@ -0,0 +1,235 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <XPLMProcessing.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/dr.h>
+#include <acfutils/helpers.h>
+#include <acfutils/safe_alloc.h>
+#include <acfutils/thread.h>
+
+#include "atmo_xp11.h"
+#include "perf_stats.h"
+
+#define	UPD_INTVAL	1.0		/* seconds */
+
+/*
+ * Publishes the phase timing of all WXR instances combined, so it can be
+ * watched with any dataref tool. For each phase, there is:
+ *	openwxr/perf/<phase>/count	times the phase ran
+ *	openwxr/perf/<phase>/total	seconds spent in the phase
+ *	openwxr/perf/<phase>/p50_us	recent median duration
+ *	openwxr/perf/<phase>/p99_us	recent 99th percentile duration
+ *	openwxr/perf/<phase>/busy	recent fraction of wall-clock time
+ * See wxr_perf_phase_stats_t for the details. The datarefs are updated
+ * once a second.
+ */
+static const char *phase_names[WXR_NUM_PERF_PHASES] = {
+	[WXR_PERF_POSE] = "pose",
+	[WXR_PERF_ATMO] = "atmo",
+	[WXR_PERF_TERR] = "terr",
+	[WXR_PERF_GROUND] = "ground",
+	[WXR_PERF_COLORIZE] = "colorize",
+	[WXR_PERF_TEX_UPLOAD] = "tex_upload",
+	[WXR_PERF_EFIS] = "efis"
+};
+
+static struct {
+	bool_t			inited;
+	mutex_t			lock;
+
+	/* protected by lock */
+	wxr_t			**wxrs;
+	size_t			num_wxrs;
+	/* final timing of destroyed instances, so the sums never shrink */
+	perf_hist_snap_t	retired[WXR_NUM_PERF_PHASES];
+
+	/* only accessed from the flight loop */
+	perf_hist_snap_t	cur[WXR_NUM_PERF_PHASES];
+	perf_hist_snap_t	recent[WXR_NUM_PERF_PHASES];
+	perf_win_t		win;
+	wxr_perf_stats_t	stats;
+	double			count[WXR_NUM_PERF_PHASES];
+	struct {
+		dr_t		count;
+		dr_t		total;
+		dr_t		p50;
+		dr_t		p99;
+		dr_t		busy;
+	} drs[WXR_NUM_PERF_PHASES];
+} perf = { .inited = B_FALSE };
+
+/*
+ * Must be called with perf.lock held.
+ */
+static void
+snap_all(perf_hist_snap_t snaps[WXR_NUM_PERF_PHASES])
+{
+	const perf_hist_t *efis = atmo_xp11_get_efis_perf(NULL);
+	perf_hist_snap_t snap[WXR_NUM_PERF_PHASES];
+
+	memcpy(snaps, perf.retired, sizeof (perf.retired));
+	for (size_t i = 0; i < perf.num_wxrs; i++) {
+		wxr_perf_snap(perf.wxrs[i], snap);
+		for (int j = 0; j < WXR_NUM_PERF_PHASES; j++)
+			perf_hist_snap_add(&snaps[j], &snap[j]);
+	}
+	/* shared by all instances, so it is only counted once */
+	if (efis != NULL)
+		perf_hist_snap(efis, &snaps[WXR_PERF_EFIS]);
+}
+
+static float
+floop_cb(float elapsed1, float elapsed2, int counter, void *refcon)
+{
+	uint64_t win;
+
+	UNUSED(elapsed1);
+	UNUSED(elapsed2);
+	UNUSED(counter);
+	UNUSED(refcon);
+
+	mutex_enter(&perf.lock);
+	snap_all(perf.cur);
+	mutex_exit(&perf.lock);
+
+	win = perf_win_update(&perf.win, perf.cur, perf_clock(),
+	    PERF_STATS_WIN, perf.recent);
+	perf_stats_fill(perf.cur, perf.recent, win, &perf.stats);
+	for (int i = 0; i < WXR_NUM_PERF_PHASES; i++)
+		perf.count[i] = perf.stats.phases[i].count;
+
+	return (UPD_INTVAL);
+}
+
+void
+perf_stats_init(void)
+{
+	ASSERT(!perf.inited);
+	perf.inited = B_TRUE;
+
+	mutex_init(&perf.lock);
+	memset(perf.retired, 0, sizeof (perf.retired));
+	memset(perf.cur, 0, sizeof (perf.cur));
+	memset(&perf.stats, 0, sizeof (perf.stats));
+	memset(perf.count, 0, sizeof (perf.count));
+	perf_win_init(&perf.win, WXR_NUM_PERF_PHASES, perf.cur, perf_clock());
+
+	for (int i = 0; i < WXR_NUM_PERF_PHASES; i++) {
+		wxr_perf_phase_stats_t *ps = &perf.stats.phases[i];
+
+		dr_create_f64(&perf.drs[i].count, &perf.count[i], B_FALSE,
+		    "openwxr/perf/%s/count", phase_names[i]);
+		dr_create_f64(&perf.drs[i].total, &ps->total, B_FALSE,
+		    "openwxr/perf/%s/total", phase_names[i]);
+		dr_create_f64(&perf.drs[i].p50, &ps->p50, B_FALSE,
+		    "openwxr/perf/%s/p50_us", phase_names[i]);
+		dr_create_f64(&perf.drs[i].p99, &ps->p99, B_FALSE,
+		    "openwxr/perf/%s/p99_us", phase_names[i]);
+		dr_create_f64(&perf.drs[i].busy, &ps->busy, B_FALSE,
+		    "openwxr/perf/%s/busy", phase_names[i]);
+	}
+
+	XPLMRegisterFlightLoopCallback(floop_cb, UPD_INTVAL, NULL);
+}
+
+void
+perf_stats_fini(void)
+{
+	if (!perf.inited)
+		return;
+	perf.inited = B_FALSE;
+
+	XPLMUnregisterFlightLoopCallback(floop_cb, NULL);
+	for (int i = 0; i < WXR_NUM_PERF_PHASES; i++) {
+		dr_delete(&perf.drs[i].count);
+		dr_delete(&perf.drs[i].total);
+		dr_delete(&perf.drs[i].p50);
+		dr_delete(&perf.drs[i].p99);
+		dr_delete(&perf.drs[i].busy);
+	}
+	perf_win_fini(&perf.win);
+
+	ASSERT3U(perf.num_wxrs, ==, 0);
+	free(perf.wxrs);
+	perf.wxrs = NULL;
+	mutex_destroy(&perf.lock);
+}
+
+/*
+ * Includes a WXR instance in the datarefs. Instances come & go on
+ * whichever thread the avionics run on.
+ */
+void
+perf_stats_add(wxr_t *wxr)
+{
+	ASSERT(perf.inited);
+
+	mutex_enter(&perf.lock);
+	perf.wxrs = safe_realloc(perf.wxrs,
+	    (perf.num_wxrs + 1) * sizeof (*perf.wxrs));
+	perf.wxrs[perf.num_wxrs++] = wxr;
+	mutex_exit(&perf.lock);
+}
+
+/*
+ * Must be called before the instance's histograms go away.
+ */
+void
+perf_stats_remove(wxr_t *wxr)
+{
+	perf_hist_snap_t snap[WXR_NUM_PERF_PHASES];
+
+	ASSERT(perf.inited);
+
+	mutex_enter(&perf.lock);
+	for (size_t i = 0; i < perf.num_wxrs; i++) {
+		if (perf.wxrs[i] != wxr)
+			continue;
+		wxr_perf_snap(wxr, snap);
+		for (int j = 0; j < WXR_NUM_PERF_PHASES; j++)
+			perf_hist_snap_add(&perf.retired[j], &snap[j]);
+		perf.wxrs[i] = perf.wxrs[--perf.num_wxrs];
+		break;
+	}
+	mutex_exit(&perf.lock);
+}
+
+/*
+ * Converts the cumulative histograms `cur' and their contents over the
+ * last `win' ns, `recent', into the API's statistics.
+ */
+void
+perf_stats_fill(const perf_hist_snap_t cur[WXR_NUM_PERF_PHASES],
+    const perf_hist_snap_t recent[WXR_NUM_PERF_PHASES], uint64_t win,
+    wxr_perf_stats_t *stats)
+{
+	for (int i = 0; i < WXR_NUM_PERF_PHASES; i++) {
+		wxr_perf_phase_stats_t *ps = &stats->phases[i];
+
+		ps->count = cur[i].count;
+		ps->total = cur[i].total / 1e9;
+		ps->p50 = perf_hist_snap_pct(&recent[i], 50) / 1e3;
+		ps->p99 = perf_hist_snap_pct(&recent[i], 99) / 1e3;
+		ps->busy = (win != 0 ? (double)recent[i].total / win : 0);
+	}
+}
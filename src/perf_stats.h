@@ -0,0 +1,46 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#ifndef	_PERF_STATS_H_
+#define	_PERF_STATS_H_
+
+#include "perf_hist.h"
+#include "wxr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* length of the recent window of wxr_perf_stats_t, ns */
+#define	PERF_STATS_WIN	5000000000ull
+
+void perf_stats_init(void);
+void perf_stats_fini(void);
+
+void perf_stats_add(wxr_t *wxr);
+void perf_stats_remove(wxr_t *wxr);
+
+void perf_stats_fill(const perf_hist_snap_t cur[WXR_NUM_PERF_PHASES],
+    const perf_hist_snap_t recent[WXR_NUM_PERF_PHASES], uint64_t win,
+    wxr_perf_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _PERF_STATS_H_ */
@@ -0,0 +1,1023 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/crc64.h>
+#include <acfutils/helpers.h>
+#include <acfutils/math.h>
+#include <acfutils/perf.h>
+#include <acfutils/safe_alloc.h>
+#include <acfutils/thread.h>
+
+#include "scan.h"
+
+#define	MAX_BEAM_ENERGY	1			/* dBmW */
+#define	EARTH_CIRC	(2 * EARTH_MSL * M_PI)	/* meters */
+#define	MAX_TERR_LAT	79
+#define	GROUND_RETURN_MULT	0.2		/* energy multiplier */
+#define	SHADOW_ENERGY_THRESH	0.57
+#define	ENERGY_SCALE_FACT	0.04
+#define	ENERGY_CODE_MIN		(1.0 / 64)	/* lowest non-zero code */
+#define	ENERGY_CODE_PER_OCT	16		/* codes per doubling */
+#define	ELEV_RAND_DIST		100000		/* meters */
+#define	TERMINAL_CHECK_INTVAL	16		/* range bins */
+#define	TERR_CACHE_TOL		0.5		/* fraction of a range bin */
+#define	TERR_CACHE_MAX_AGE	8		/* sweeps */
+
+/*
+ * Antenna pitch-dependent geometry of a scan line. In horizontal scan
+ * mode, all scan lines share row 0. In vertical mode, there is one row
+ * per vertical antenna position.
+ */
+typedef struct {
+	double		pitch;		/* degrees, including extra_pitch */
+	double		cos_pitch;
+	/* sines of the sector boundary angles, bottom to top */
+	double		sin_sect[SCAN_NUM_SECT + 1];
+} scan_pitch_row_t;
+
+/*
+ * Terrain under a single antenna column, see terr_col_get.
+ */
+typedef struct {
+	mutex_t		lock;
+	condvar_t	cv;		/* signalled when `pending' clears */
+	/* protected by lock */
+	bool_t		valid;
+	bool_t		pending;	/* queued in a scan_terr_batch_t */
+	uint64_t	tick_seq;	/* scan_tick_t seq when probed */
+	geo_pos2_t	pos;		/* aircraft position when probed */
+	double		hdg;		/* true azimuth of the column */
+	double		range;
+	uint64_t	sweep;
+	double		*elev;
+	vect3_t		*norm;
+	double		*water;
+} scan_terr_col_t;
+
+struct scan_s {
+	const wxr_conf_t	*conf;
+	const atmo_t		*atmo;
+	scan_terr_probe_t	terr_probe;
+	scan_kern_type_t	kern_type;
+	scan_gnd_kern_t		gnd_kern;
+	uint64_t		rng_key;
+	bool_t			terr_cache;
+	uint64_t		tick_seq;
+	/* WXR_NUM_PERF_PHASES histograms, see scan_set_perf */
+	perf_hist_t		*perf;
+	/* one per antenna column, filled in while computing scan lines */
+	scan_terr_col_t		*terr_cols;
+
+	/*
+	 * Geometry tables, maintained by scan_tick_prep. Each table is
+	 * only rebuilt when the inputs it was built from change, which
+	 * is normally only on a range, tilt or stabilization change.
+	 * Read-only while scan lines are being computed.
+	 */
+	struct {
+		/* distance of each range bin along the beam, meters */
+		double			range;
+		double			*bin_r;
+		/* cos & sin of the bin's arc angle along the earth */
+		double			*bin_cos;
+		double			*bin_sin;
+
+		/* antenna azimuth (relative to acf hdg) per column */
+		double			extra_roll;
+		double			*rhdg;
+		vect2_t			*rhdg_dir;
+
+		bool_t			vert_mode;
+		double			pitch_req;
+		double			extra_pitch;
+		scan_pitch_row_t	*pitch;
+	} geom;
+};
+
+scan_t *
+scan_init(const wxr_conf_t *conf, const atmo_t *atmo,
+    scan_terr_probe_t terr_probe)
+{
+	scan_t *scan = safe_calloc(1, sizeof (*scan));
+
+	ASSERT(conf != NULL);
+	ASSERT(atmo != NULL);
+	ASSERT(atmo->probe != NULL);
+	ASSERT(terr_probe != NULL);
+	ASSERT3U(conf->res_x, <=, SCAN_RNG_MAX_COLS);
+	ASSERT3U(conf->res_y, <=, SCAN_RNG_MAX_BINS);
+
+	scan->conf = conf;
+	scan->atmo = atmo;
+	scan->terr_probe = terr_probe;
+	scan_set_kern(scan, SCAN_KERN_AUTO);
+	scan_set_seed(scan, crc64_rand());
+
+	scan->geom.bin_r = safe_calloc(conf->res_y,
+	    sizeof (*scan->geom.bin_r));
+	scan->geom.bin_cos = safe_calloc(conf->res_y,
+	    sizeof (*scan->geom.bin_cos));
+	scan->geom.bin_sin = safe_calloc(conf->res_y,
+	    sizeof (*scan->geom.bin_sin));
+	scan->geom.rhdg = safe_calloc(conf->res_x, sizeof (*scan->geom.rhdg));
+	scan->geom.rhdg_dir = safe_calloc(conf->res_x,
+	    sizeof (*scan->geom.rhdg_dir));
+	scan->geom.pitch = safe_calloc(conf->res_x,
+	    sizeof (*scan->geom.pitch));
+	scan->terr_cache = B_TRUE;
+	scan->terr_cols = safe_calloc(conf->res_x, sizeof (*scan->terr_cols));
+	for (unsigned i = 0; i < conf->res_x; i++) {
+		scan_terr_col_t *col = &scan->terr_cols[i];
+
+		mutex_init(&col->lock);
+		cv_init(&col->cv);
+		col->elev = safe_calloc(conf->res_y, sizeof (*col->elev));
+		col->norm = safe_calloc(conf->res_y, sizeof (*col->norm));
+		col->water = safe_calloc(conf->res_y, sizeof (*col->water));
+	}
+	/* force a rebuild of all tables on the first tick */
+	scan->geom.range = NAN;
+	scan->geom.extra_roll = NAN;
+	scan->geom.pitch_req = NAN;
+
+	return (scan);
+}
+
+void
+scan_fini(scan_t *scan)
+{
+	free(scan->geom.bin_r);
+	free(scan->geom.bin_cos);
+	free(scan->geom.bin_sin);
+	free(scan->geom.rhdg);
+	free(scan->geom.rhdg_dir);
+	free(scan->geom.pitch);
+	for (unsigned i = 0; i < scan->conf->res_x; i++) {
+		scan_terr_col_t *col = &scan->terr_cols[i];
+
+		mutex_destroy(&col->lock);
+		cv_destroy(&col->cv);
+		free(col->elev);
+		free(col->norm);
+		free(col->water);
+	}
+	free(scan->terr_cols);
+	free(scan);
+}
+
+/*
+ * Selects the implementation of the ground interaction kernel. Must not
+ * be called while a scan line is being computed.
+ */
+void
+scan_set_kern(scan_t *scan, scan_kern_type_t type)
+{
+	scan->kern_type = type;
+	scan->gnd_kern = scan_kern_select(&scan->kern_type);
+}
+
+scan_kern_type_t
+scan_get_kern(const scan_t *scan)
+{
+	return (scan->kern_type);
+}
+
+/*
+ * Sets the seed of the noise applied to ground returns. The noise of a
+ * given (sweep, column, range bin) is fully determined by the seed, so
+ * setting a fixed seed makes the output of the scan engine reproducible
+ * run-to-run, regardless of how scan lines are spread over threads.
+ * scan_init picks a random seed. Must not be called while a scan line
+ * is being computed.
+ */
+void
+scan_set_seed(scan_t *scan, uint64_t seed)
+{
+	scan->rng_key = scan_rng_key(seed);
+}
+
+/*
+ * Enables or disables reuse of terrain probe results across sweeps (see
+ * terr_col_get). Enabled by default. Must not be called while a scan
+ * line is being computed.
+ */
+void
+scan_set_terr_cache(scan_t *scan, bool_t flag)
+{
+	scan->terr_cache = flag;
+	for (unsigned i = 0; i < scan->conf->res_x; i++)
+		scan->terr_cols[i].valid = B_FALSE;
+}
+
+/*
+ * Has the scan line phases (atmosphere & terrain probes and ground
+ * model) timed into `hists', indexed by wxr_perf_phase_t. NULL turns
+ * timing off, which is the default. Must not be called while a scan
+ * line is being computed.
+ */
+void
+scan_set_perf(scan_t *scan, perf_hist_t *hists)
+{
+	scan->perf = hists;
+}
+
+static inline uint64_t
+perf_start(const scan_t *scan)
+{
+	return (scan->perf != NULL ? perf_clock() : 0);
+}
+
+static inline perf_hist_t *
+perf_hist(const scan_t *scan, wxr_perf_phase_t phase)
+{
+	return (scan->perf != NULL ? &scan->perf[phase] : NULL);
+}
+
+/*
+ * Converts the scaled return energy of a range bin into its sample code.
+ * Codes 1 - 127 cover energies from ENERGY_CODE_MIN up in steps of
+ * 1/ENERGY_CODE_PER_OCT of an octave (about 4.4%), which is finer than
+ * anybody can tell apart on the display. Anything weaker maps to 0.
+ */
+static inline uint8_t
+energy_encode(double e)
+{
+	double code;
+
+	/* also catches NaN */
+	if (!(e >= ENERGY_CODE_MIN))
+		return (0);
+	code = log2(e * (1 / ENERGY_CODE_MIN)) * ENERGY_CODE_PER_OCT + 1;
+	return (MIN(code, SCAN_PALETTE_SZ - 1));
+}
+
+/*
+ * Returns the energy in the (geometric) middle of the bucket of `code'.
+ */
+static double
+energy_decode(unsigned code)
+{
+	if (code == 0)
+		return (0);
+	return (ENERGY_CODE_MIN * exp2((code - 0.5) / ENERGY_CODE_PER_OCT));
+}
+
+/*
+ * Builds the palette mapping sample codes to display colors at `gain'.
+ * Same as the radar used to do per sample, the first color whose min_val
+ * is <= the gain-adjusted energy wins, so colors should be passed in
+ * order of decreasing min_val. Codes matching no color map to 0. The
+ * palette only has SCAN_PALETTE_SZ entries, so this is cheap enough to
+ * call whenever the gain or colors change.
+ */
+void
+scan_palette_build(uint32_t palette[SCAN_PALETTE_SZ],
+    const wxr_color_t *colors, size_t num_colors, double gain)
+{
+	ASSERT(colors != NULL || num_colors == 0);
+	ASSERT3U(num_colors, <=, SCAN_MAX_COLORS);
+
+	for (unsigned code = 0; code < SCAN_PALETTE_SZ; code++) {
+		double e = energy_decode(code) * gain;
+
+		palette[code] = 0;
+		for (size_t k = 0; k < num_colors; k++) {
+			if (e >= colors[k].min_val) {
+				palette[code] = colors[k].rgba;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Returns the weakest return energy (as passed to energy_encode) which
+ * shows up in a color with non-zero alpha in the palette built by
+ * scan_palette_build from the same arguments, or INFINITY if none does.
+ * Samples are stored before the gain is applied, so a scan line cut
+ * short based on this at a low gain only shows the weaker returns at a
+ * higher gain once the antenna sweeps over it again.
+ */
+double
+scan_min_visible(const wxr_color_t *colors, size_t num_colors, double gain)
+{
+	uint32_t palette[SCAN_PALETTE_SZ];
+
+	scan_palette_build(palette, colors, num_colors, gain);
+	for (unsigned code = 1; code < SCAN_PALETTE_SZ; code++) {
+		/* alpha is the last byte in memory, see scan.h */
+		if (((const uint8_t *)&palette[code])[3] != 0) {
+			/* bottom of the bucket of `code' */
+			return (ENERGY_CODE_MIN *
+			    exp2((code - 1.0) / ENERGY_CODE_PER_OCT));
+		}
+	}
+
+	return (INFINITY);
+}
+
+static void
+geom_build_bins(scan_t *scan, double range)
+{
+	unsigned res_y = scan->conf->res_y;
+
+	for (unsigned j = 0; j < res_y; j++) {
+		double d = ((double)j / res_y) * range;
+
+		scan->geom.bin_r[j] = d;
+		scan->geom.bin_cos[j] = cos(d / EARTH_MSL);
+		scan->geom.bin_sin[j] = sin(d / EARTH_MSL);
+	}
+	scan->geom.range = range;
+}
+
+static void
+geom_build_azi(scan_t *scan, double extra_roll)
+{
+	const wxr_conf_t *conf = scan->conf;
+	double cos_roll = cos(DEG2RAD(extra_roll));
+
+	for (unsigned i = 0; i < conf->res_x; i++) {
+		double rhdg = (conf->scan_angle *
+		    ((i / (double)conf->res_x) - 0.5)) * cos_roll;
+
+		scan->geom.rhdg[i] = rhdg;
+		scan->geom.rhdg_dir[i] = hdg2dir(rhdg);
+	}
+	scan->geom.extra_roll = extra_roll;
+}
+
+static void
+geom_build_pitch_row(scan_pitch_row_t *row, double pitch, double beam_y)
+{
+	row->pitch = pitch;
+	row->cos_pitch = cos(DEG2RAD(pitch));
+	for (int j = 0; j < SCAN_NUM_SECT + 1; j++) {
+		double angle = pitch - beam_y / 2 + (beam_y / SCAN_NUM_SECT) * j;
+		row->sin_sect[j] = sin(DEG2RAD(angle));
+	}
+}
+
+static void
+geom_build_pitch(scan_t *scan, bool_t vert_mode, double pitch_req,
+    double extra_pitch)
+{
+	const wxr_conf_t *conf = scan->conf;
+
+	if (!vert_mode) {
+		geom_build_pitch_row(&scan->geom.pitch[0],
+		    pitch_req + extra_pitch, conf->beam_shape.y);
+	} else {
+		for (unsigned i = 0; i < conf->res_x; i++) {
+			double pitch = -(conf->scan_angle_vert *
+			    ((i / (double)conf->res_x) - 0.5));
+
+			pitch = clamp(pitch, -90, 90);
+			geom_build_pitch_row(&scan->geom.pitch[i],
+			    pitch + extra_pitch, conf->beam_shape.y);
+		}
+	}
+	scan->geom.vert_mode = vert_mode;
+	scan->geom.pitch_req = pitch_req;
+	scan->geom.extra_pitch = extra_pitch;
+}
+
+/*
+ * Computes the parts of the tick snapshot which only depend on the
+ * aircraft pose & stabilization limits, so they don't need to be
+ * recomputed for every scan line. Also brings the geometry tables up
+ * to date, so this must not be called while scan lines are being
+ * computed.
+ */
+void
+scan_tick_prep(scan_t *scan, scan_tick_t *tick)
+{
+	const wxr_conf_t *conf = scan->conf;
+	double acf_pitch = tick->acf_orient.x;
+	double acf_roll = tick->acf_orient.z;
+	double sin_lat = sin(DEG2RAD(tick->acf_pos.lat));
+	double cos_lat = cos(DEG2RAD(tick->acf_pos.lat));
+	double sin_lon = sin(DEG2RAD(tick->acf_pos.lon));
+	double cos_lon = cos(DEG2RAD(tick->acf_pos.lon));
+
+	ASSERT3U(tick->range_idx, <, conf->num_ranges);
+	tick->range = conf->ranges[tick->range_idx];
+	tick->seq = ++scan->tick_seq;
+
+	tick->extra_pitch = 0;
+	tick->extra_roll = 0;
+	if (acf_pitch > tick->pitch_stab)
+		tick->extra_pitch = acf_pitch - tick->pitch_stab;
+	else if (acf_pitch < -tick->pitch_stab)
+		tick->extra_pitch = tick->pitch_stab + acf_pitch;
+	if (acf_roll > tick->roll_stab)
+		tick->extra_roll = acf_roll - tick->roll_stab;
+	else if (acf_roll < -tick->roll_stab)
+		tick->extra_roll = acf_roll + tick->roll_stab;
+
+	tick->degree_sz = VECT2(
+	    (EARTH_CIRC / 360.0) * cos_lat,
+	    (EARTH_CIRC / 360.0));
+	tick->hdg_dir = hdg2dir(tick->acf_orient.y);
+	/* local frame for prep_terr_probe_coords */
+	tick->ecef_pos = VECT3(cos_lat * cos_lon, cos_lat * sin_lon, sin_lat);
+	tick->ecef_east = VECT3(-sin_lon, cos_lon, 0);
+	tick->ecef_north = VECT3(-sin_lat * cos_lon, -sin_lat * sin_lon,
+	    cos_lat);
+	tick->sample_sz_rat = (tick->range / conf->res_y) / 1000.0;
+
+	if (tick->range != scan->geom.range)
+		geom_build_bins(scan, tick->range);
+	if (tick->extra_roll != scan->geom.extra_roll)
+		geom_build_azi(scan, tick->extra_roll);
+	/* in vertical mode, the requested antenna pitch is ignored */
+	if (tick->vert_mode != scan->geom.vert_mode ||
+	    tick->extra_pitch != scan->geom.extra_pitch ||
+	    (!tick->vert_mode && tick->ant_pitch_req != scan->geom.pitch_req)) {
+		geom_build_pitch(scan, tick->vert_mode, tick->ant_pitch_req,
+		    tick->extra_pitch);
+	}
+}
+
+void
+scan_scratch_init(const scan_t *scan, scan_scratch_t *scr)
+{
+	unsigned res_y = scan->conf->res_y;
+
+	memset(scr, 0, sizeof (*scr));
+
+	scr->sl.energy_out = safe_calloc(res_y, sizeof (double));
+	scr->sl.doppler_out = safe_calloc(res_y, sizeof (double));
+	scr->rnd = safe_calloc(res_y * SCAN_RNG_PER_BIN, sizeof (*scr->rnd));
+
+	/* the outputs go straight into the terrain cache */
+	scr->tp.num_pts = res_y;
+	scr->tp_in_pts = safe_calloc(res_y, sizeof (*scr->tp_in_pts));
+	scr->tp.in_pts = scr->tp_in_pts;
+}
+
+void
+scan_scratch_fini(scan_scratch_t *scr)
+{
+	free(scr->sl.energy_out);
+	free(scr->sl.doppler_out);
+	free(scr->rnd);
+	free(scr->tp_in_pts);
+	memset(scr, 0, sizeof (*scr));
+}
+
+static vect3_t
+randomize_normal(vect3_t norm, const uint64_t rnd[3])
+{
+	/* UINT64_MAX rounds to 2^64, so the division is an exact scaling */
+	double rx = 0.9 + ((double)rnd[0] / UINT64_MAX) * 0.2;
+	double ry = 0.9 + ((double)rnd[1] / UINT64_MAX) * 0.2;
+	double rz = 0.9 + ((double)rnd[2] / UINT64_MAX) * 0.2;
+	return (VECT3(norm.x * rx, norm.y * ry, norm.z * rz));
+}
+
+/*
+ * A word on terrain drawing.
+ *
+ * We need to pass LATxLON points to OpenGPWS to give us terrain
+ * elevations. The points of a scan line lie on the great circle
+ * leaving the aircraft position along the antenna azimuth. Expressed
+ * in earth-centered coordinates on the unit sphere, the point at arc
+ * angle `a' along it is:
+ *
+ *	P(a) = cos(a) * P0 + sin(a) * U
+ *
+ * where P0 is the aircraft position and U is the unit vector pointing
+ * along the antenna azimuth in the local east-north plane at P0. P0 and
+ * the east & north vectors are set up once per tick by scan_tick_prep,
+ * the cos(a) & sin(a) of every range bin only change with range (see
+ * geom_build_bins), so the only per-point work is a multiply-add per
+ * axis, plus the conversion back to LATxLON. The conversion is done
+ * in a separate pass over a block of points, to keep the multiply-add
+ * loop free of calls, so the compiler can vectorize it.
+ */
+#define	TERR_PROJ_BLOCK	64
+
+static void
+prep_terr_probe_coords(const scan_t *scan, const scan_tick_t *tick,
+    vect2_t ant_dir, geo_pos2_t *pts)
+{
+	const double *bin_cos = scan->geom.bin_cos;
+	const double *bin_sin = scan->geom.bin_sin;
+	vect3_t p0 = tick->ecef_pos;
+	vect3_t u = vect3_add(vect3_scmul(tick->ecef_east, ant_dir.x),
+	    vect3_scmul(tick->ecef_north, ant_dir.y));
+
+	for (unsigned i = 0; i < scan->conf->res_y; i += TERR_PROJ_BLOCK) {
+		unsigned n = MIN(scan->conf->res_y - i, TERR_PROJ_BLOCK);
+		double x[TERR_PROJ_BLOCK], y[TERR_PROJ_BLOCK];
+		double z[TERR_PROJ_BLOCK];
+
+		for (unsigned j = 0; j < n; j++) {
+			x[j] = p0.x * bin_cos[i + j] + u.x * bin_sin[i + j];
+			y[j] = p0.y * bin_cos[i + j] + u.y * bin_sin[i + j];
+			z[j] = p0.z * bin_cos[i + j] + u.z * bin_sin[i + j];
+		}
+		for (unsigned j = 0; j < n; j++) {
+			geo_pos2_t p = GEO_POS2(
+			    RAD2DEG(atan2(z[j], sqrt(POW2(x[j]) + POW2(y[j])))),
+			    RAD2DEG(atan2(y[j], x[j])));
+
+			/* OpenGPWS doesn't do polar regions */
+			p.lat = clamp(p.lat, -MAX_TERR_LAT, MAX_TERR_LAT);
+			if (p.lon >= 180.0)
+				p.lon -= 360.0;
+			ASSERT(is_valid_lat(p.lat));
+			ASSERT(is_valid_lon(p.lon));
+			pts[i + j] = p;
+		}
+	}
+}
+
+/*
+ * hdg2dir(acf_hdg + ant_rhdg), done as a rotation of the precomputed
+ * relative antenna direction by the aircraft heading.
+ */
+static inline vect2_t
+ant_dir_get(const scan_t *scan, const scan_tick_t *tick, unsigned ant_pos)
+{
+	vect2_t rdir = scan->geom.rhdg_dir[ant_pos];
+
+	return (VECT2(tick->hdg_dir.x * rdir.y + tick->hdg_dir.y * rdir.x,
+	    tick->hdg_dir.y * rdir.y - tick->hdg_dir.x * rdir.x));
+}
+
+/*
+ * The terrain under a column doesn't depend on antenna pitch, so it is
+ * shared by all antenna tilts and all vertical scan mode steps. It also
+ * hardly changes from one sweep to the next, so we only probe OpenGPWS
+ * again once the aircraft has moved or turned far enough to shift the
+ * far end of the column by more than TERR_CACHE_TOL of a range bin. To
+ * pick up terrain loaded in the meantime, results expire after
+ * TERR_CACHE_MAX_AGE sweeps regardless. Within a worker tick, the
+ * aircraft pose & range don't change, so an entry probed in this tick
+ * is always usable, even with the cache disabled.
+ * Must be called with col->lock held.
+ */
+static bool_t
+terr_col_usable(const scan_t *scan, const scan_tick_t *tick,
+    const scan_terr_col_t *col, double hdg, uint64_t sweep)
+{
+	double tol, dlon;
+	vect2_t disp;
+
+	if (!col->valid || col->range != tick->range)
+		return (B_FALSE);
+	if (col->tick_seq == tick->seq)
+		return (B_TRUE);
+	if (!scan->terr_cache || sweep - col->sweep >= TERR_CACHE_MAX_AGE)
+		return (B_FALSE);
+
+	tol = TERR_CACHE_TOL * (tick->range / scan->conf->res_y);
+	dlon = tick->acf_pos.lon - col->pos.lon;
+	if (dlon < -180)
+		dlon += 360;
+	else if (dlon >= 180)
+		dlon -= 360;
+	disp = VECT2(dlon * tick->degree_sz.x,
+	    (tick->acf_pos.lat - col->pos.lat) * tick->degree_sz.y);
+
+	return (vect2_abs(disp) + tick->range *
+	    ABS(DEG2RAD(rel_hdg(col->hdg, hdg))) <= tol);
+}
+
+static inline double
+terr_col_hdg(const scan_t *scan, const scan_tick_t *tick, unsigned ant_pos)
+{
+	return (normalize_hdg(tick->acf_orient.y + scan->geom.rhdg[ant_pos]));
+}
+
+/*
+ * Records what the column's terrain was just probed for.
+ */
+static void
+terr_col_set_key(scan_terr_col_t *col, const scan_tick_t *tick,
+    double hdg, uint64_t sweep)
+{
+	col->valid = B_TRUE;
+	col->tick_seq = tick->seq;
+	col->pos = GEO_POS2(tick->acf_pos.lat, tick->acf_pos.lon);
+	col->hdg = hdg;
+	col->range = tick->range;
+	col->sweep = sweep;
+}
+
+/*
+ * Returns the terrain under antenna column `ant_pos', probing OpenGPWS
+ * if the cached terrain is no longer usable (see terr_col_usable).
+ *
+ * Scan lines sharing a column may be computed concurrently, so the check
+ * & refill happen under the column's lock. If the column is queued in a
+ * terrain batch, we wait for the batch to deliver it instead. Once
+ * usable, the entry stays that way for the rest of the tick, so callers
+ * can read it after unlocking.
+ */
+static const scan_terr_col_t *
+terr_col_get(const scan_t *scan, const scan_tick_t *tick, unsigned ant_pos,
+    uint64_t sweep, scan_scratch_t *scr)
+{
+	scan_terr_col_t *col = &scan->terr_cols[ant_pos];
+	double hdg = terr_col_hdg(scan, tick, ant_pos);
+	egpws_terr_probe_t tp;
+	uint64_t start;
+
+	mutex_enter(&col->lock);
+	while (col->pending)
+		cv_wait(&col->cv, &col->lock);
+	if (terr_col_usable(scan, tick, col, hdg, sweep)) {
+		mutex_exit(&col->lock);
+		return (col);
+	}
+
+	tp = scr->tp;
+	tp.out_elev = col->elev;
+	tp.out_norm = col->norm;
+	tp.out_water = col->water;
+	prep_terr_probe_coords(scan, tick, ant_dir_get(scan, tick, ant_pos),
+	    scr->tp_in_pts);
+	start = perf_start(scan);
+	scan->terr_probe(&tp);
+	perf_hist_end(perf_hist(scan, WXR_PERF_TERR), start);
+	terr_col_set_key(col, tick, hdg, sweep);
+	mutex_exit(&col->lock);
+
+	return (col);
+}
+
+/*
+ * Terrain batches gather the probe points of many antenna columns into
+ * a single OpenGPWS request, amortizing its per-request tile lookups &
+ * locking. Columns are queued using scan_terr_batch_add, which marks
+ * them pending, so that scan lines on other threads can already go
+ * ahead and probe the atmosphere, but wait for the batch in
+ * terr_col_get. scan_terr_batch_run then probes all of them in one go
+ * and scatters the results back into the terrain cache.
+ */
+struct scan_terr_batch_s {
+	unsigned		max_cols;
+	unsigned		num_cols;
+	unsigned		*cols;
+	double			*hdgs;
+	uint64_t		*sweeps;
+	geo_pos2_t		*in_pts;
+	double			*out_elev;
+	vect3_t			*out_norm;
+	double			*out_water;
+};
+
+/*
+ * Allocates a batch of up to `max_lines' antenna columns (but never more
+ * than a full sweep's worth, as a column is only ever queued once).
+ */
+scan_terr_batch_t *
+scan_terr_batch_alloc(const scan_t *scan, unsigned max_lines)
+{
+	scan_terr_batch_t *batch = safe_calloc(1, sizeof (*batch));
+	unsigned res_y = scan->conf->res_y;
+	size_t num_pts;
+
+	ASSERT(max_lines != 0);
+	batch->max_cols = MIN(max_lines, scan->conf->res_x);
+	num_pts = (size_t)batch->max_cols * res_y;
+
+	batch->cols = safe_calloc(batch->max_cols, sizeof (*batch->cols));
+	batch->hdgs = safe_calloc(batch->max_cols, sizeof (*batch->hdgs));
+	batch->sweeps = safe_calloc(batch->max_cols,
+	    sizeof (*batch->sweeps));
+	batch->in_pts = safe_calloc(num_pts, sizeof (*batch->in_pts));
+	batch->out_elev = safe_calloc(num_pts, sizeof (*batch->out_elev));
+	batch->out_norm = safe_calloc(num_pts, sizeof (*batch->out_norm));
+	batch->out_water = safe_calloc(num_pts, sizeof (*batch->out_water));
+
+	return (batch);
+}
+
+void
+scan_terr_batch_free(scan_terr_batch_t *batch)
+{
+	if (batch == NULL)
+		return;
+	ASSERT3U(batch->num_cols, ==, 0);
+	free(batch->cols);
+	free(batch->hdgs);
+	free(batch->sweeps);
+	free(batch->in_pts);
+	free(batch->out_elev);
+	free(batch->out_norm);
+	free(batch->out_water);
+	free(batch);
+}
+
+/*
+ * Queues the terrain of the scan line at `ant_pos' in the batch, unless
+ * the column's cached terrain is still usable or it is already queued.
+ * Returns B_FALSE if the batch is full, in which case it must be run
+ * before trying again. Once a column is queued, the batch MUST be run,
+ * otherwise scan lines using it will wait forever.
+ */
+bool_t
+scan_terr_batch_add(const scan_t *scan, const scan_tick_t *tick,
+    unsigned ant_pos, uint64_t sweep, scan_terr_batch_t *batch)
+{
+	scan_terr_col_t *col;
+	double hdg;
+	unsigned i;
+
+	ASSERT3U(ant_pos, <, scan->conf->res_x);
+
+	col = &scan->terr_cols[ant_pos];
+	hdg = terr_col_hdg(scan, tick, ant_pos);
+
+	mutex_enter(&col->lock);
+	if (col->pending || terr_col_usable(scan, tick, col, hdg, sweep)) {
+		mutex_exit(&col->lock);
+		return (B_TRUE);
+	}
+	if (batch->num_cols == batch->max_cols) {
+		mutex_exit(&col->lock);
+		return (B_FALSE);
+	}
+	col->pending = B_TRUE;
+	mutex_exit(&col->lock);
+
+	i = batch->num_cols++;
+	batch->cols[i] = ant_pos;
+	batch->hdgs[i] = hdg;
+	batch->sweeps[i] = sweep;
+	prep_terr_probe_coords(scan, tick, ant_dir_get(scan, tick, ant_pos),
+	    &batch->in_pts[(size_t)i * scan->conf->res_y]);
+
+	return (B_TRUE);
+}
+
+/*
+ * Probes all columns queued in the batch with a single OpenGPWS request,
+ * stores the results in the terrain cache and wakes up any scan lines
+ * waiting for them. Leaves the batch empty.
+ */
+void
+scan_terr_batch_run(const scan_t *scan, const scan_tick_t *tick,
+    scan_terr_batch_t *batch)
+{
+	unsigned res_y = scan->conf->res_y;
+	egpws_terr_probe_t tp = {
+	    .num_pts = batch->num_cols * res_y,
+	    .in_pts = batch->in_pts,
+	    .out_elev = batch->out_elev,
+	    .out_norm = batch->out_norm,
+	    .out_water = batch->out_water
+	};
+	uint64_t start;
+
+	if (batch->num_cols == 0)
+		return;
+
+	start = perf_start(scan);
+	scan->terr_probe(&tp);
+	perf_hist_end(perf_hist(scan, WXR_PERF_TERR), start);
+
+	for (unsigned i = 0; i < batch->num_cols; i++) {
+		scan_terr_col_t *col = &scan->terr_cols[batch->cols[i]];
+		size_t off = (size_t)i * res_y;
+
+		mutex_enter(&col->lock);
+		ASSERT(col->pending);
+		memcpy(col->elev, &batch->out_elev[off],
+		    res_y * sizeof (*col->elev));
+		memcpy(col->norm, &batch->out_norm[off],
+		    res_y * sizeof (*col->norm));
+		memcpy(col->water, &batch->out_water[off],
+		    res_y * sizeof (*col->water));
+		terr_col_set_key(col, tick, batch->hdgs[i], batch->sweeps[i]);
+		col->pending = B_FALSE;
+		cv_broadcast(&col->cv);
+		mutex_exit(&col->lock);
+	}
+	batch->num_cols = 0;
+}
+
+/*
+ * Checks whether the ground interaction of the rest of a scan line has
+ * reached a terminal state, i.e. the beam has been either fully spent,
+ * or fully occluded by terrain. Returns the sample value which all the
+ * remaining range bins will end up with, or -1 if we can't be sure of
+ * that yet. Only valid if the remaining bins have no atmospheric return.
+ *
+ * Each gnd_kern call raises a sector's `spent' by the bin's energy
+ * share plus the remaining energy times absorb_mult times the fraction
+ * hit. As long as absorb_mult <= 1, `spent' can thus never drop below
+ * MIN(spent, 1) and the sector's remaining energy MAX(1 - spent, 0)
+ * never grows. The latter bounds the ground return of any bin to come,
+ * the former tells us whether the beam shadow flag is here to stay.
+ */
+static int
+scan_line_terminal(const scan_sect_t *sect, double absorb_mult,
+    bool_t beam_shadow)
+{
+	/* largest return_mult scan_compute_line can come up with */
+	const double max_return_mult = 1.8 *
+	    (GROUND_RETURN_MULT / SCAN_NUM_SECT);
+	double rem = 0, spent_min = 0;
+
+	if (absorb_mult > 1)
+		return (-1);
+	for (int k = 0; k < SCAN_NUM_SECT; k++) {
+		rem += MAX(1 - sect->spent[k], 0);
+		spent_min += MIN(sect->spent[k], 1);
+	}
+	/*
+	 * Leave a margin for the kernels' differing summation order, see
+	 * scan_gnd_kern_t.
+	 */
+	if (rem * max_return_mult * (1 / ENERGY_SCALE_FACT) >=
+	    ENERGY_CODE_MIN / 2)
+		return (-1);
+	if (!beam_shadow)
+		return (0);
+	if (spent_min > SHADOW_ENERGY_THRESH * SCAN_NUM_SECT + 1e-9)
+		return (SCAN_SAMPLE_SHADOW);
+
+	return (-1);
+}
+
+/*
+ * Fills in the beam geometry of the scan line at the given antenna
+ * position, ready to be handed to the atmosphere for probing. The
+ * sample output arrays of `sl' are left alone.
+ */
+void
+scan_line_setup(const scan_t *scan, const scan_tick_t *tick,
+    unsigned ant_pos, unsigned ant_pos_vert, scan_line_t *sl)
+{
+	const wxr_conf_t *conf = scan->conf;
+	const scan_pitch_row_t *pr;
+
+	ASSERT3U(ant_pos, <, conf->res_x);
+	ASSERT3U(ant_pos_vert, <, conf->res_x);
+
+	pr = &scan->geom.pitch[tick->vert_mode ? ant_pos_vert : 0];
+
+	sl->origin = tick->acf_pos;
+	sl->shape = conf->beam_shape;
+	sl->range = tick->range;
+	sl->energy = MAX_BEAM_ENERGY;
+	sl->max_range = conf->ranges[conf->num_ranges - 1];
+	sl->num_samples = conf->res_y;
+	sl->ant_rhdg = scan->geom.rhdg[ant_pos];
+	sl->dir = VECT2(tick->acf_orient.y + sl->ant_rhdg, pr->pitch);
+	sl->vert_scan = tick->vert_mode;
+	/*
+	 * Nothing below ENERGY_CODE_MIN gets stored at all. Leave a margin,
+	 * as the atmosphere's returns still get added to the ground returns
+	 * (same as scan_line_terminal does).
+	 */
+	sl->min_energy = (MAX(tick->min_visible, ENERGY_CODE_MIN) / 2) *
+	    ENERGY_SCALE_FACT * tick->sample_sz_rat;
+}
+
+/*
+ * Computes a single radar scan line at the given antenna position and
+ * writes its samples (see SCAN_SAMPLE_SHADOW) into
+ * `samples', which must point to the start of the antenna column
+ * (res_y samples).
+ * `sweep' is the sequence number of the antenna sweep, used to select
+ * the noise applied to the ground returns of this scan line.
+ * `probed' is the scan line, already set up using scan_line_setup and
+ * probed by the caller. If NULL, we probe the atmosphere ourselves.
+ */
+void
+scan_compute_line(const scan_t *scan, const scan_tick_t *tick,
+    unsigned ant_pos, unsigned ant_pos_vert, uint64_t sweep,
+    const scan_line_t *probed, scan_scratch_t *scr, uint8_t *samples)
+{
+	const wxr_conf_t *conf = scan->conf;
+	const scan_line_t *sl = probed;
+	const scan_pitch_row_t *pr;
+	const scan_terr_col_t *terr;
+	double sample_sz_rat = tick->sample_sz_rat;
+	double energy_mult = 1 / sample_sz_rat;
+	double absorb_mult = sample_sz_rat * 0.1;
+	vect2_t ant_dir, ant_dir_neg;
+	scan_sect_t sect;
+	unsigned atmo_end;
+	uint64_t start;
+
+	ASSERT3U(ant_pos, <, conf->res_x);
+	ASSERT3U(ant_pos_vert, <, conf->res_x);
+	ASSERT3F(tick->range, ==, scan->geom.range);
+	ASSERT3U(tick->vert_mode, ==, scan->geom.vert_mode);
+
+	pr = &scan->geom.pitch[tick->vert_mode ? ant_pos_vert : 0];
+
+	if (sl == NULL) {
+		scan_line_setup(scan, tick, ant_pos, ant_pos_vert, &scr->sl);
+		start = perf_start(scan);
+		scan->atmo->probe(&scr->sl);
+		perf_hist_end(perf_hist(scan, WXR_PERF_ATMO), start);
+		sl = &scr->sl;
+	}
+
+	/* past atmo_end, the atmosphere has nothing more to return */
+	for (atmo_end = conf->res_y; atmo_end > 0 &&
+	    sl->energy_out[atmo_end - 1] == 0; atmo_end--)
+		;
+
+	ant_dir = ant_dir_get(scan, tick, ant_pos);
+	ant_dir_neg = vect2_neg(ant_dir);
+	scan_sect_init(&sect, pr->sin_sect);
+	terr = terr_col_get(scan, tick, ant_pos, sweep, scr);
+	start = perf_start(scan);
+	scan_rng_fill(scan->rng_key, scan_rng_ctr(sweep, tick->vert_mode ?
+	    ant_pos_vert : ant_pos), scr->rnd, conf->res_y * SCAN_RNG_PER_BIN);
+
+	/*
+	 * No need to lock the samples, worst case is we will
+	 * draw a partially updated scan line - no big deal.
+	 */
+	for (unsigned j = 0; j < conf->res_y; j++) {
+		double abs_energy;
+		double energy_spent_total;
+		double ground_return_total;
+		uint8_t sample;
+		/* Distance of point along scan line from antenna. */
+		double d = scan->geom.bin_r[j] * pr->cos_pitch;
+		int64_t elev_rand_lim = clamp(d * (1.0 / ELEV_RAND_DIST), 0, 1) *
+		    3000 + 10;
+		const uint64_t *rnd = &scr->rnd[j * SCAN_RNG_PER_BIN];
+		int64_t elev_rand = (int64_t)(((double)rnd[0] / UINT64_MAX) *
+		    elev_rand_lim) - (elev_rand_lim / 2);
+		double terr_elev = terr->elev[j] + elev_rand;
+		vect2_t ant_dir_neg_m = vect2_scmul(ant_dir_neg, d);
+		/* Reverse vector from ground point to the antenna. */
+		vect3_t back_v = vect3_unit(VECT3(ant_dir_neg_m.x,
+		    ant_dir_neg_m.y, sl->origin.elev - terr_elev), NULL);
+		/* How perpendicular is the ground to us */
+		vect3_t norm;
+		double fract_dir;
+		scan_bin_t bin;
+
+		/*
+		 * Once the beam is spent or fully behind terrain, the rest
+		 * of the scan line is either blank or all shadow, so don't
+		 * bother computing it bin by bin.
+		 */
+		if (j >= atmo_end && j % TERMINAL_CHECK_INTVAL == 0) {
+			int fill = scan_line_terminal(&sect, absorb_mult,
+			    tick->beam_shadow);
+
+			if (fill >= 0) {
+				memset(&samples[j], fill, conf->res_y - j);
+				break;
+			}
+		}
+
+		norm = randomize_normal(terr->norm[j], &rnd[1]);
+		fract_dir = vect3_dotprod(back_v, norm);
+		fract_dir = clamp(fract_dir, 0, 1);
+
+		bin.d = d;
+		bin.origin_elev = sl->origin.elev;
+		bin.terr_elev = terr_elev;
+		bin.energy = sl->energy_out[j];
+		bin.absorb_mult = absorb_mult;
+		bin.return_mult = (fract_dir + 0.8) *
+		    (GROUND_RETURN_MULT / SCAN_NUM_SECT) *
+		    (1 - terr->water[j] * 0.95);
+		scan->gnd_kern(&sect, &bin, &ground_return_total,
+		    &energy_spent_total);
+
+		abs_energy = ((sl->energy_out[j] * energy_mult) +
+		    ground_return_total) * (1 / ENERGY_SCALE_FACT);
+
+		sample = energy_encode(abs_energy);
+		if (energy_spent_total > SHADOW_ENERGY_THRESH * SCAN_NUM_SECT &&
+		    tick->beam_shadow)
+			sample |= SCAN_SAMPLE_SHADOW;
+		samples[j] = sample;
+	}
+	perf_hist_end(perf_hist(scan, WXR_PERF_GROUND), start);
+}
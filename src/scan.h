@@ -0,0 +1,145 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#ifndef	_SCAN_H_
+#define	_SCAN_H_
+
+#include <stdint.h>
+
+#include <acfutils/geom.h>
+
+#include <opengpws/xplane_api.h>
+
+#include "atmo.h"
+#include "perf_hist.h"
+#include "scan_kern.h"
+#include "scan_rng.h"
+#include <openwxr/wxr_intf.h>
+#include <openwxr/xplane_api.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The scan engine holds the beam, ground return and colorization math
+ * of the radar. It has no dependency on X-Plane or OpenGL, so that it
+ * can be driven both from the plugin's worker thread and from a
+ * headless harness (see bench/wxr_bench.c).
+ */
+typedef struct scan_s scan_t;
+typedef struct scan_terr_batch_s scan_terr_batch_t;
+
+typedef void (*scan_terr_probe_t)(egpws_terr_probe_t *probe);
+
+#define	SCAN_MAX_COLORS		16
+
+/*
+ * Samples hold the returned energy of their range bin, before gain is
+ * applied, quantized on a log scale into the low 7 bits. Code 0 means
+ * "no return". The top bit of the sample flags the bin as being in the
+ * beam's shadow. Gain & colors are only applied at display time, through
+ * a palette built by scan_palette_build, so changing them doesn't
+ * require a rescan. Palette entries are copies of wxr_color_t.rgba,
+ * so their bytes are in R, G, B, A order in memory on any host and can
+ * be uploaded as GL_RGBA/GL_UNSIGNED_BYTE as they are.
+ */
+#define	SCAN_SAMPLE_SHADOW	0x80u
+#define	SCAN_SAMPLE_CODE_MASK	0x7fu
+#define	SCAN_PALETTE_SZ		128
+
+/*
+ * Snapshot of the aircraft pose & radar controls, taken once per worker
+ * tick. The caller fills in the input fields and then calls
+ * scan_tick_prep to compute the derived fields.
+ */
+typedef struct {
+	/* inputs */
+	geo_pos3_t		acf_pos;
+	vect3_t			acf_orient;	/* pitch, hdg, roll */
+	double			ant_pitch_req;
+	double			pitch_stab;
+	double			roll_stab;
+	unsigned		range_idx;
+	bool_t			vert_mode;
+	bool_t			beam_shadow;
+	double			min_visible;	/* see scan_min_visible */
+
+	/* derived by scan_tick_prep */
+	double			range;
+	double			extra_pitch;
+	double			extra_roll;
+	vect2_t			degree_sz;
+	uint64_t		seq;		/* unique per scan_tick_prep */
+	vect2_t			hdg_dir;	/* hdg2dir(acf hdg) */
+	/* unit sphere position & local east/north axes at acf_pos */
+	vect3_t			ecef_pos;
+	vect3_t			ecef_east;
+	vect3_t			ecef_north;
+	double			sample_sz_rat;	/* range bin size in km */
+} scan_tick_t;
+
+/*
+ * Per-thread working buffers for computing a single scan line.
+ */
+typedef struct {
+	scan_line_t		sl;
+	uint64_t		*rnd;		/* SCAN_RNG_PER_BIN per bin */
+	geo_pos2_t		*tp_in_pts;
+	egpws_terr_probe_t	tp;
+} scan_scratch_t;
+
+scan_t *scan_init(const wxr_conf_t *conf, const atmo_t *atmo,
+    scan_terr_probe_t terr_probe);
+void scan_fini(scan_t *scan);
+
+void scan_set_kern(scan_t *scan, scan_kern_type_t type);
+scan_kern_type_t scan_get_kern(const scan_t *scan);
+void scan_set_seed(scan_t *scan, uint64_t seed);
+void scan_set_terr_cache(scan_t *scan, bool_t flag);
+void scan_set_perf(scan_t *scan, perf_hist_t *hists);
+
+void scan_tick_prep(scan_t *scan, scan_tick_t *tick);
+
+void scan_palette_build(uint32_t palette[SCAN_PALETTE_SZ],
+    const wxr_color_t *colors, size_t num_colors, double gain);
+double scan_min_visible(const wxr_color_t *colors, size_t num_colors,
+    double gain);
+
+void scan_scratch_init(const scan_t *scan, scan_scratch_t *scr);
+void scan_scratch_fini(scan_scratch_t *scr);
+
+void scan_line_setup(const scan_t *scan, const scan_tick_t *tick,
+    unsigned ant_pos, unsigned ant_pos_vert, scan_line_t *sl);
+scan_terr_batch_t *scan_terr_batch_alloc(const scan_t *scan,
+    unsigned max_lines);
+void scan_terr_batch_free(scan_terr_batch_t *batch);
+bool_t scan_terr_batch_add(const scan_t *scan, const scan_tick_t *tick,
+    unsigned ant_pos, uint64_t sweep, scan_terr_batch_t *batch);
+void scan_terr_batch_run(const scan_t *scan, const scan_tick_t *tick,
+    scan_terr_batch_t *batch);
+
+void scan_compute_line(const scan_t *scan, const scan_tick_t *tick,
+    unsigned ant_pos, unsigned ant_pos_vert, uint64_t sweep,
+    const scan_line_t *probed, scan_scratch_t *scr, uint8_t *samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _SCAN_H_ */
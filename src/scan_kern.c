@@ -0,0 +1,262 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#include <string.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/math.h>
+
+#include "scan_kern.h"
+
+#if	defined(__x86_64__) || defined(__i386__)
+#define	SCAN_KERN_X86	1
+#include <immintrin.h>
+#else
+#define	SCAN_KERN_X86	0
+#endif
+
+CTASSERT(SCAN_SECT_PAD >= SCAN_NUM_SECT);
+CTASSERT(SCAN_SECT_PAD % 4 == 0);
+
+static const char *kern_names[SCAN_NUM_KERNS] = {
+	"auto", "scalar", "sse2", "avx2"
+};
+
+/*
+ * Sets up the sector edge sines from the SCAN_NUM_SECT + 1 sines of the
+ * sector boundary angles, bottom to top, and resets the spent energy.
+ */
+void
+scan_sect_init(scan_sect_t *sect, const double *sin_pitch)
+{
+	memset(sect, 0, sizeof (*sect));
+	for (int k = 0; k < SCAN_NUM_SECT; k++) {
+		sect->sin_lo[k] = sin_pitch[k];
+		sect->sin_hi[k] = sin_pitch[k + 1];
+		sect->valid[k] = 1;
+	}
+}
+
+static void
+gnd_kern_scalar(scan_sect_t *sect, const scan_bin_t *bin, double *ret_total,
+    double *spent_total)
+{
+	double e = bin->energy / SCAN_NUM_SECT;
+	double ret = 0, spent = 0;
+
+	for (int k = 0; k < SCAN_NUM_SECT; k++) {
+		double elev_min = bin->origin_elev + sect->sin_lo[k] * bin->d;
+		double elev_max = bin->origin_elev + sect->sin_hi[k] * bin->d;
+		double fract_hit, rem;
+
+		/*
+		 * At extreme antenna angles, the top/bottom distinction can
+		 * break, so to avoid that, we manually flip the coordinates
+		 * in this case and add 0.1m to elev_max to guarantee that
+		 * it cannot be <= elev_min.
+		 */
+		if (elev_min > elev_max) {
+			double tmp = elev_max;
+			elev_max = elev_min;
+			elev_min = tmp;
+		}
+		elev_max += 0.1;
+		fract_hit = ((bin->terr_elev - elev_min) /
+		    (elev_max - elev_min)) / 5;
+		fract_hit = clamp(fract_hit, 0, 1);
+		rem = 1 - sect->spent[k];
+
+		ret += rem * fract_hit * bin->return_mult;
+		sect->spent[k] += e + rem * fract_hit * bin->absorb_mult;
+		spent += sect->spent[k];
+	}
+
+	*ret_total = ret;
+	*spent_total = spent;
+}
+
+#if	SCAN_KERN_X86
+
+__attribute__((target("sse2"))) static void
+gnd_kern_sse2(scan_sect_t *sect, const scan_bin_t *bin, double *ret_total,
+    double *spent_total)
+{
+	const __m128d d = _mm_set1_pd(bin->d);
+	const __m128d oe = _mm_set1_pd(bin->origin_elev);
+	const __m128d te = _mm_set1_pd(bin->terr_elev);
+	const __m128d e = _mm_set1_pd(bin->energy / SCAN_NUM_SECT);
+	const __m128d amult = _mm_set1_pd(bin->absorb_mult);
+	const __m128d rmult = _mm_set1_pd(bin->return_mult);
+	const __m128d margin = _mm_set1_pd(0.1);
+	const __m128d fifth = _mm_set1_pd(5);
+	const __m128d zero = _mm_setzero_pd();
+	const __m128d one = _mm_set1_pd(1);
+	__m128d ret = zero, spent = zero;
+	double ret_v[2], spent_v[2];
+
+	for (int k = 0; k < SCAN_NUM_SECT; k += 2) {
+		__m128d a = _mm_add_pd(oe,
+		    _mm_mul_pd(_mm_loadu_pd(&sect->sin_lo[k]), d));
+		__m128d b = _mm_add_pd(oe,
+		    _mm_mul_pd(_mm_loadu_pd(&sect->sin_hi[k]), d));
+		__m128d lo = _mm_min_pd(a, b);
+		__m128d hi = _mm_add_pd(_mm_max_pd(a, b), margin);
+		__m128d valid = _mm_loadu_pd(&sect->valid[k]);
+		__m128d sp = _mm_loadu_pd(&sect->spent[k]);
+		__m128d rem = _mm_sub_pd(one, sp);
+		__m128d hit = _mm_div_pd(_mm_div_pd(_mm_sub_pd(te, lo),
+		    _mm_sub_pd(hi, lo)), fifth);
+
+		hit = _mm_min_pd(_mm_max_pd(hit, zero), one);
+		hit = _mm_mul_pd(_mm_mul_pd(rem, hit), valid);
+		ret = _mm_add_pd(ret, _mm_mul_pd(hit, rmult));
+		sp = _mm_add_pd(sp, _mm_add_pd(_mm_mul_pd(e, valid),
+		    _mm_mul_pd(hit, amult)));
+		_mm_storeu_pd(&sect->spent[k], sp);
+		spent = _mm_add_pd(spent, sp);
+	}
+
+	_mm_storeu_pd(ret_v, ret);
+	_mm_storeu_pd(spent_v, spent);
+	*ret_total = ret_v[0] + ret_v[1];
+	*spent_total = spent_v[0] + spent_v[1];
+}
+
+__attribute__((target("avx2"))) static void
+gnd_kern_avx2(scan_sect_t *sect, const scan_bin_t *bin, double *ret_total,
+    double *spent_total)
+{
+	const __m256d d = _mm256_set1_pd(bin->d);
+	const __m256d oe = _mm256_set1_pd(bin->origin_elev);
+	const __m256d te = _mm256_set1_pd(bin->terr_elev);
+	const __m256d e = _mm256_set1_pd(bin->energy / SCAN_NUM_SECT);
+	const __m256d amult = _mm256_set1_pd(bin->absorb_mult);
+	const __m256d rmult = _mm256_set1_pd(bin->return_mult);
+	const __m256d margin = _mm256_set1_pd(0.1);
+	const __m256d fifth = _mm256_set1_pd(5);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d one = _mm256_set1_pd(1);
+	__m256d ret = zero, spent = zero;
+	double ret_v[4], spent_v[4];
+
+	for (int k = 0; k < SCAN_SECT_PAD; k += 4) {
+		__m256d a = _mm256_add_pd(oe,
+		    _mm256_mul_pd(_mm256_loadu_pd(&sect->sin_lo[k]), d));
+		__m256d b = _mm256_add_pd(oe,
+		    _mm256_mul_pd(_mm256_loadu_pd(&sect->sin_hi[k]), d));
+		__m256d lo = _mm256_min_pd(a, b);
+		__m256d hi = _mm256_add_pd(_mm256_max_pd(a, b), margin);
+		__m256d valid = _mm256_loadu_pd(&sect->valid[k]);
+		__m256d sp = _mm256_loadu_pd(&sect->spent[k]);
+		__m256d rem = _mm256_sub_pd(one, sp);
+		__m256d hit = _mm256_div_pd(_mm256_div_pd(
+		    _mm256_sub_pd(te, lo), _mm256_sub_pd(hi, lo)), fifth);
+
+		hit = _mm256_min_pd(_mm256_max_pd(hit, zero), one);
+		hit = _mm256_mul_pd(_mm256_mul_pd(rem, hit), valid);
+		ret = _mm256_add_pd(ret, _mm256_mul_pd(hit, rmult));
+		sp = _mm256_add_pd(sp, _mm256_add_pd(_mm256_mul_pd(e, valid),
+		    _mm256_mul_pd(hit, amult)));
+		_mm256_storeu_pd(&sect->spent[k], sp);
+		spent = _mm256_add_pd(spent, sp);
+	}
+
+	_mm256_storeu_pd(ret_v, ret);
+	_mm256_storeu_pd(spent_v, spent);
+	*ret_total = (ret_v[0] + ret_v[1]) + (ret_v[2] + ret_v[3]);
+	*spent_total = (spent_v[0] + spent_v[1]) + (spent_v[2] + spent_v[3]);
+}
+
+#endif	/* SCAN_KERN_X86 */
+
+static bool_t
+kern_supported(scan_kern_type_t type)
+{
+	switch (type) {
+	case SCAN_KERN_SCALAR:
+		return (B_TRUE);
+#if	SCAN_KERN_X86
+	case SCAN_KERN_SSE2:
+		return (__builtin_cpu_supports("sse2"));
+	case SCAN_KERN_AVX2:
+		return (__builtin_cpu_supports("avx2"));
+#endif
+	default:
+		return (B_FALSE);
+	}
+}
+
+/*
+ * Returns the ground interaction kernel of the requested type. If `type'
+ * is SCAN_KERN_AUTO, or the requested kernel isn't supported by the CPU
+ * we are running on, we fall back to the fastest supported kernel and
+ * update `type' to reflect the kernel actually returned.
+ */
+scan_gnd_kern_t
+scan_kern_select(scan_kern_type_t *type)
+{
+	ASSERT(type != NULL);
+	ASSERT3U(*type, <, SCAN_NUM_KERNS);
+
+#if	SCAN_KERN_X86
+	__builtin_cpu_init();
+#endif
+	if (*type != SCAN_KERN_AUTO && !kern_supported(*type)) {
+		logMsg("Scan kernel \"%s\" not supported on this CPU, "
+		    "falling back to autodetection", kern_names[*type]);
+		*type = SCAN_KERN_AUTO;
+	}
+	if (*type == SCAN_KERN_AUTO) {
+		if (kern_supported(SCAN_KERN_AVX2))
+			*type = SCAN_KERN_AVX2;
+		else if (kern_supported(SCAN_KERN_SSE2))
+			*type = SCAN_KERN_SSE2;
+		else
+			*type = SCAN_KERN_SCALAR;
+	}
+
+	switch (*type) {
+#if	SCAN_KERN_X86
+	case SCAN_KERN_SSE2:
+		return (gnd_kern_sse2);
+	case SCAN_KERN_AVX2:
+		return (gnd_kern_avx2);
+#endif
+	default:
+		return (gnd_kern_scalar);
+	}
+}
+
+const char *
+scan_kern_type2str(scan_kern_type_t type)
+{
+	ASSERT3U(type, <, SCAN_NUM_KERNS);
+	return (kern_names[type]);
+}
+
+scan_kern_type_t
+scan_kern_str2type(const char *str)
+{
+	for (int i = 0; i < SCAN_NUM_KERNS; i++) {
+		if (strcmp(str, kern_names[i]) == 0)
+			return (i);
+	}
+	return (SCAN_KERN_AUTO);
+}
@@ -0,0 +1,90 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#ifndef	_SCAN_KERN_H_
+#define	_SCAN_KERN_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The beam is split into SCAN_NUM_SECT vertical sectors for the purposes
+ * of computing ground interaction. The per-sector arrays are padded out
+ * to SCAN_SECT_PAD entries, so that the vector kernels can process them
+ * in whole 4-wide chunks. Padding lanes carry a `valid' value of 0, which
+ * zeroes out all of their contributions.
+ */
+#define	SCAN_NUM_SECT	10
+#define	SCAN_SECT_PAD	12
+
+typedef struct {
+	double	sin_lo[SCAN_SECT_PAD];	/* sine of sector bottom angle */
+	double	sin_hi[SCAN_SECT_PAD];	/* sine of sector top angle */
+	double	valid[SCAN_SECT_PAD];	/* 1 for real sectors, 0 for pad */
+	double	spent[SCAN_SECT_PAD];	/* energy spent so far per sector */
+} scan_sect_t;
+
+/*
+ * Per range-bin inputs to the ground interaction kernel.
+ */
+typedef struct {
+	double	d;		/* horizontal distance from antenna, meters */
+	double	origin_elev;	/* antenna elevation, meters */
+	double	terr_elev;	/* terrain elevation, meters */
+	double	energy;		/* atmospheric return energy of the bin */
+	double	absorb_mult;	/* ground absorption per unit of hit */
+	double	return_mult;	/* ground return per unit of hit */
+} scan_bin_t;
+
+/*
+ * Computes the ground absorption & return for all sectors of a single
+ * range bin, updates `sect->spent' and returns the total ground return
+ * in `ret_total' and the sum of `sect->spent' in `spent_total'.
+ *
+ * All kernels operate in double precision and perform the same IEEE
+ * operations per sector, so the updated `sect->spent' values are
+ * bit-identical between kernels. The vector kernels only differ from
+ * the scalar one in the order in which the per-sector values are summed
+ * into `ret_total' and `spent_total', so these agree with the scalar
+ * kernel to within 1e-12 of the sum of magnitudes of the per-sector
+ * terms. A sample's color can thus only differ between kernels if its
+ * energy lies within ~1e-12 of a color threshold.
+ */
+typedef void (*scan_gnd_kern_t)(scan_sect_t *sect, const scan_bin_t *bin,
+    double *ret_total, double *spent_total);
+
+typedef enum {
+	SCAN_KERN_AUTO,		/* pick the best one supported by the CPU */
+	SCAN_KERN_SCALAR,
+	SCAN_KERN_SSE2,
+	SCAN_KERN_AVX2,
+	SCAN_NUM_KERNS
+} scan_kern_type_t;
+
+scan_gnd_kern_t scan_kern_select(scan_kern_type_t *type);
+const char *scan_kern_type2str(scan_kern_type_t type);
+scan_kern_type_t scan_kern_str2type(const char *str);
+
+void scan_sect_init(scan_sect_t *sect, const double *sin_pitch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _SCAN_KERN_H_ */
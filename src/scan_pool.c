@@ -0,0 +1,462 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#include <stdlib.h>
+
+#if	IBM
+#include <windows.h>
+#else	/* !IBM */
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif	/* !IBM */
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/math.h>
+#include <acfutils/safe_alloc.h>
+#include <acfutils/thread.h>
+
+#include "scan_pool.h"
+
+/*
+ * The scan pool computes scan lines on a fixed set of threads, which can
+ * be shared by any number of clients (normally one per WXR instance).
+ * A client submits the scan lines of one worker tick at a time using
+ * scan_pool_run and waits for them to complete. The pool threads don't
+ * belong to any client, so the number of threads computing scan lines
+ * stays the same no matter how many WXRs there are. A pool with no
+ * threads computes every client's scan lines on the thread calling
+ * scan_pool_run.
+ *
+ * Jobs are handed out one scan line at a time under `lock'. When more
+ * than one client has work queued, the next job is picked by stride
+ * scheduling: every client has a virtual time `pass', which advances by
+ * SCAN_POOL_STRIDE / prio with every job handed out, and the client
+ * with the lowest pass goes next. Over time, each client thus gets a
+ * share of the pool proportional to its priority. A client which was
+ * idle for a while restarts from the pool's current virtual time, so it
+ * can't make up for the time it spent idle by starving the others.
+ *
+ * Every pool thread has its own scan_scratch_t in every client (they
+ * depend on the client's scan resolution), so the only shared state is
+ * the job lists. A scan line takes on the order of 100us to compute, so
+ * the lock is nowhere near contended.
+ *
+ * Before publishing its jobs, the calling thread queues the terrain of
+ * all of them in a terrain batch (see scan_terr_batch_add). The pool
+ * threads are woken right away and get to probe the atmosphere while
+ * the caller runs the batch; they only wait for it once they need the
+ * terrain of their scan line.
+ *
+ * With a shared pool, a client's jobs may sit queued behind other
+ * clients' jobs for a while, so scan_pool_run returns the time actually
+ * spent computing them, which is what a client's CPU budget is about.
+ */
+#define	SCAN_POOL_STRIDE	(1 << 20)
+
+typedef struct {
+	scan_pool_t	*pool;
+	unsigned	idx;
+	thread_t	thread;
+} scan_pool_thr_t;
+
+struct scan_pool_client_s {
+	scan_pool_t		*pool;
+	const scan_t		*scan;
+	uint64_t		stride;
+	/* one per pool thread, or a single one for pools without threads */
+	scan_scratch_t		*scr;
+	/* only used by the thread calling scan_pool_run, NULL if disabled */
+	scan_terr_batch_t	*terr_batch;
+
+	condvar_t		done_cv;
+	/* protected by pool->lock */
+	scan_pool_client_t	*next;
+	uint64_t		pass;
+	const scan_tick_t	*tick;
+	const scan_job_t	*jobs;
+	unsigned		num_jobs;
+	unsigned		next_job;
+	unsigned		busy;
+	uint64_t		compute_ns;	/* of the current run */
+};
+
+struct scan_pool_s {
+	unsigned		num_threads;
+	uint64_t		cpu_mask;
+	scan_pool_thr_t		*thr;
+
+	mutex_t			lock;
+	condvar_t		work_cv;
+	/* protected by lock */
+	bool_t			shutdown;
+	uint64_t		pass;
+	scan_pool_client_t	*clients;
+};
+
+/*
+ * Returns the number of CPUs available to the process, for sizing pools.
+ */
+unsigned
+scan_pool_num_cpus(void)
+{
+#if	IBM
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return (MAX(si.dwNumberOfProcessors, 1));
+#else	/* !IBM */
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (MAX(n, 1));
+#endif	/* !IBM */
+}
+
+/*
+ * Restricts the calling thread to the CPUs in `mask' (bit N is CPU N).
+ */
+static void
+set_affinity(uint64_t mask)
+{
+#if	IBM
+	if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)mask) == 0)
+		logMsg("Cannot set scan thread CPU affinity: error %d",
+		    (int)GetLastError());
+#elif	LIN
+	cpu_set_t set;
+	int err;
+
+	CPU_ZERO(&set);
+	for (int i = 0; i < 64; i++) {
+		if (mask & (1ull << i))
+			CPU_SET(i, &set);
+	}
+	err = pthread_setaffinity_np(pthread_self(), sizeof (set), &set);
+	if (err != 0)
+		logMsg("Cannot set scan thread CPU affinity: error %d", err);
+#else	/* APL */
+	/* macOS only supports affinity hints, which aren't worth it */
+	UNUSED(mask);
+#endif	/* APL */
+}
+
+/*
+ * Returns the client whose job should be computed next, or NULL if
+ * there are no jobs waiting. Must be called with pool->lock held.
+ */
+static scan_pool_client_t *
+pick_client(const scan_pool_t *pool)
+{
+	scan_pool_client_t *best = NULL;
+
+	for (scan_pool_client_t *cl = pool->clients; cl != NULL;
+	    cl = cl->next) {
+		if (cl->next_job < cl->num_jobs &&
+		    (best == NULL || cl->pass < best->pass))
+			best = cl;
+	}
+
+	return (best);
+}
+
+static void
+pool_thr_func(void *arg)
+{
+	scan_pool_thr_t *thr = arg;
+	scan_pool_t *pool = thr->pool;
+
+	thread_set_name("OpenWXR-scan");
+	if (pool->cpu_mask != 0)
+		set_affinity(pool->cpu_mask);
+
+	mutex_enter(&pool->lock);
+	for (;;) {
+		scan_pool_client_t *cl;
+		const scan_job_t *job;
+		uint64_t start, end;
+
+		while (!pool->shutdown && (cl = pick_client(pool)) == NULL)
+			cv_wait(&pool->work_cv, &pool->lock);
+		if (pool->shutdown)
+			break;
+
+		job = &cl->jobs[cl->next_job++];
+		pool->pass = cl->pass;
+		cl->pass += cl->stride;
+		cl->busy++;
+		mutex_exit(&pool->lock);
+
+		start = perf_clock();
+		scan_compute_line(cl->scan, cl->tick, job->ant_pos,
+		    job->ant_pos_vert, job->sweep, job->sl, &cl->scr[thr->idx],
+		    job->samples);
+		end = perf_clock();
+
+		mutex_enter(&pool->lock);
+		cl->compute_ns += end - start;
+		cl->busy--;
+		if (cl->busy == 0 && cl->next_job == cl->num_jobs)
+			cv_broadcast(&cl->done_cv);
+	}
+	mutex_exit(&pool->lock);
+}
+
+/*
+ * Creates a pool computing scan lines on `num_threads' threads. With 0
+ * threads, all scan lines are computed on the thread calling
+ * scan_pool_run. If `cpu_mask' isn't 0, the threads are restricted to
+ * the CPUs set in it (bit N is CPU N).
+ */
+scan_pool_t *
+scan_pool_init(unsigned num_threads, uint64_t cpu_mask)
+{
+	scan_pool_t *pool = safe_calloc(1, sizeof (*pool));
+
+	pool->num_threads = MIN(num_threads, SCAN_POOL_MAX_THREADS);
+	pool->cpu_mask = cpu_mask;
+	pool->thr = safe_calloc(MAX(pool->num_threads, 1),
+	    sizeof (*pool->thr));
+	mutex_init(&pool->lock);
+	cv_init(&pool->work_cv);
+
+	for (unsigned i = 0; i < pool->num_threads; i++) {
+		pool->thr[i].pool = pool;
+		pool->thr[i].idx = i;
+		VERIFY(thread_create(&pool->thr[i].thread, pool_thr_func,
+		    &pool->thr[i]));
+	}
+
+	return (pool);
+}
+
+/*
+ * All clients must have been destroyed before the pool.
+ */
+void
+scan_pool_fini(scan_pool_t *pool)
+{
+	if (pool == NULL)
+		return;
+
+	mutex_enter(&pool->lock);
+	ASSERT3P(pool->clients, ==, NULL);
+	pool->shutdown = B_TRUE;
+	cv_broadcast(&pool->work_cv);
+	mutex_exit(&pool->lock);
+
+	for (unsigned i = 0; i < pool->num_threads; i++)
+		thread_join(&pool->thr[i].thread);
+	free(pool->thr);
+
+	mutex_destroy(&pool->lock);
+	cv_destroy(&pool->work_cv);
+
+	free(pool);
+}
+
+unsigned
+scan_pool_get_num_threads(const scan_pool_t *pool)
+{
+	return (pool->num_threads);
+}
+
+/*
+ * Attaches `scan' to the pool. `prio' is the client's share of the pool
+ * relative to the other clients, between 1 and SCAN_POOL_MAX_PRIO.
+ */
+scan_pool_client_t *
+scan_pool_client_init(scan_pool_t *pool, const scan_t *scan, unsigned prio)
+{
+	scan_pool_client_t *cl = safe_calloc(1, sizeof (*cl));
+
+	ASSERT(pool != NULL);
+	ASSERT(scan != NULL);
+
+	cl->pool = pool;
+	cl->scan = scan;
+	cl->stride = SCAN_POOL_STRIDE / clampi(prio, 1, SCAN_POOL_MAX_PRIO);
+	cl->scr = safe_calloc(MAX(pool->num_threads, 1), sizeof (*cl->scr));
+	for (unsigned i = 0; i < MAX(pool->num_threads, 1); i++)
+		scan_scratch_init(scan, &cl->scr[i]);
+	/* batch up the terrain of entire ticks */
+	cl->terr_batch = scan_terr_batch_alloc(scan, UINT32_MAX);
+	cv_init(&cl->done_cv);
+
+	mutex_enter(&pool->lock);
+	cl->next = pool->clients;
+	pool->clients = cl;
+	mutex_exit(&pool->lock);
+
+	return (cl);
+}
+
+void
+scan_pool_client_fini(scan_pool_client_t *cl)
+{
+	scan_pool_t *pool;
+
+	if (cl == NULL)
+		return;
+	pool = cl->pool;
+
+	mutex_enter(&pool->lock);
+	ASSERT3U(cl->busy, ==, 0);
+	for (scan_pool_client_t **clp = &pool->clients; *clp != NULL;
+	    clp = &(*clp)->next) {
+		if (*clp == cl) {
+			*clp = cl->next;
+			break;
+		}
+	}
+	mutex_exit(&pool->lock);
+
+	for (unsigned i = 0; i < MAX(pool->num_threads, 1); i++)
+		scan_scratch_fini(&cl->scr[i]);
+	free(cl->scr);
+	scan_terr_batch_free(cl->terr_batch);
+	cv_destroy(&cl->done_cv);
+	free(cl);
+}
+
+/*
+ * Sets the maximum number of scan lines whose terrain is probed in a
+ * single OpenGPWS request. 0 disables batching, so every scan line
+ * probes its own terrain as needed. Must not be called concurrently
+ * with scan_pool_run.
+ */
+void
+scan_pool_set_terr_batch(scan_pool_client_t *cl, unsigned max_lines)
+{
+	scan_terr_batch_free(cl->terr_batch);
+	cl->terr_batch = NULL;
+	if (max_lines != 0)
+		cl->terr_batch = scan_terr_batch_alloc(cl->scan, max_lines);
+}
+
+/*
+ * Hands the client's jobs over to the pool threads.
+ */
+static void
+client_publish(scan_pool_client_t *cl, unsigned num_jobs)
+{
+	scan_pool_t *pool = cl->pool;
+
+	mutex_enter(&pool->lock);
+	cl->num_jobs = num_jobs;
+	/* don't let the client make up for the time it spent idle */
+	cl->pass = MAX(cl->pass, pool->pass);
+	cv_broadcast(&pool->work_cv);
+	mutex_exit(&pool->lock);
+}
+
+/*
+ * Probes the terrain of `jobs' using the terrain batch, one batch-full
+ * at a time. If `publish' is set, the jobs are handed to the pool
+ * threads once the first batch is queued. Returns the time spent, in ns.
+ */
+static uint64_t
+client_terr_batch(scan_pool_client_t *cl, const scan_tick_t *tick,
+    const scan_job_t *jobs, unsigned num_jobs, bool_t publish)
+{
+	uint64_t start = perf_clock();
+	unsigned i = 0;
+
+	while (i < num_jobs) {
+		while (i < num_jobs && scan_terr_batch_add(cl->scan, tick,
+		    jobs[i].ant_pos, jobs[i].sweep, cl->terr_batch))
+			i++;
+		if (publish) {
+			client_publish(cl, num_jobs);
+			publish = B_FALSE;
+		}
+		scan_terr_batch_run(cl->scan, tick, cl->terr_batch);
+	}
+
+	return (perf_clock() - start);
+}
+
+/*
+ * Computes all `jobs' and returns once every one of them is complete.
+ * Jobs are picked up in order, but may complete out of order, so two
+ * jobs writing the same antenna column leave it in an undefined (but
+ * fully computed) state. Must not be called concurrently on one client.
+ * Returns the time spent computing the jobs, in ns, summed over all the
+ * threads involved and not counting any time the jobs spent queued.
+ */
+uint64_t
+scan_pool_run(scan_pool_client_t *cl, const scan_tick_t *tick,
+    const scan_job_t *jobs, unsigned num_jobs)
+{
+	scan_pool_t *pool = cl->pool;
+	uint64_t compute_ns = 0;
+
+	ASSERT(tick != NULL);
+	ASSERT(jobs != NULL || num_jobs == 0);
+
+	if (num_jobs == 0)
+		return (0);
+
+	if (pool->num_threads == 0) {
+		uint64_t start;
+
+		if (cl->terr_batch != NULL) {
+			compute_ns += client_terr_batch(cl, tick, jobs,
+			    num_jobs, B_FALSE);
+		}
+		start = perf_clock();
+		for (unsigned i = 0; i < num_jobs; i++) {
+			scan_compute_line(cl->scan, tick, jobs[i].ant_pos,
+			    jobs[i].ant_pos_vert, jobs[i].sweep, jobs[i].sl,
+			    &cl->scr[0], jobs[i].samples);
+		}
+		return (compute_ns + perf_clock() - start);
+	}
+
+	mutex_enter(&pool->lock);
+	ASSERT3U(cl->busy, ==, 0);
+	ASSERT3U(cl->next_job, ==, cl->num_jobs);
+	cl->tick = tick;
+	cl->jobs = jobs;
+	/* not up for grabs until published */
+	cl->num_jobs = 0;
+	cl->next_job = 0;
+	cl->compute_ns = 0;
+	mutex_exit(&pool->lock);
+
+	if (cl->terr_batch != NULL) {
+		compute_ns += client_terr_batch(cl, tick, jobs, num_jobs,
+		    B_TRUE);
+	} else {
+		client_publish(cl, num_jobs);
+	}
+
+	mutex_enter(&pool->lock);
+	while (cl->next_job < cl->num_jobs || cl->busy != 0)
+		cv_wait(&cl->done_cv, &pool->lock);
+	compute_ns += cl->compute_ns;
+	/* don't leave dangling pointers to the caller's stack around */
+	cl->tick = NULL;
+	cl->jobs = NULL;
+	cl->num_jobs = 0;
+	cl->next_job = 0;
+	mutex_exit(&pool->lock);
+
+	return (compute_ns);
+}
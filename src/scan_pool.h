@@ -0,0 +1,66 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#ifndef	_SCAN_POOL_H_
+#define	_SCAN_POOL_H_
+
+#include "scan.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define	SCAN_POOL_MAX_THREADS	16
+#define	SCAN_POOL_MAX_PRIO	16
+
+/*
+ * A single scan line to be computed by scan_pool_run. `samples' points
+ * to the start of the antenna column. `sl' is the scan line already
+ * probed by the caller, or NULL to have the pool probe the atmosphere
+ * (see scan_compute_line).
+ */
+typedef struct {
+	unsigned		ant_pos;
+	unsigned		ant_pos_vert;
+	uint64_t		sweep;
+	const scan_line_t	*sl;
+	uint8_t			*samples;
+} scan_job_t;
+
+typedef struct scan_pool_s scan_pool_t;
+typedef struct scan_pool_client_s scan_pool_client_t;
+
+unsigned scan_pool_num_cpus(void);
+
+scan_pool_t *scan_pool_init(unsigned num_threads, uint64_t cpu_mask);
+void scan_pool_fini(scan_pool_t *pool);
+unsigned scan_pool_get_num_threads(const scan_pool_t *pool);
+
+scan_pool_client_t *scan_pool_client_init(scan_pool_t *pool,
+    const scan_t *scan, unsigned prio);
+void scan_pool_client_fini(scan_pool_client_t *cl);
+void scan_pool_set_terr_batch(scan_pool_client_t *cl, unsigned max_lines);
+
+uint64_t scan_pool_run(scan_pool_client_t *cl, const scan_tick_t *tick,
+    const scan_job_t *jobs, unsigned num_jobs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _SCAN_POOL_H_ */
@@ -0,0 +1,111 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+*/
+/*
+ * Copyright 2024 Saso Kiselkov. All rights reserved.
+ */
+
+#ifndef	_SCAN_RNG_H_
+#define	_SCAN_RNG_H_
+
+#include <stdint.h>
+
+#include <acfutils/assert.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Counter-based random number generator for the scan engine. Rather
+ * than stepping a shared generator state, every random value is a pure
+ * function of a key (derived from the seed) and a counter composed of
+ * the (sweep, antenna column, range bin, value index) tuple. This means
+ * scan lines can be computed in any order on any number of threads and,
+ * given the same seed, always produce bit-identical noise.
+ *
+ * The generator is Widynski's "Squares" (arXiv:2004.06278), 5-round
+ * 64-bit output variant. It needs the key to have a reasonably irregular
+ * bit pattern, so we derive it from the seed using splitmix64.
+ */
+
+#define	SCAN_RNG_PER_BIN	4	/* random values consumed per bin */
+#define	SCAN_RNG_BIN_BITS	18
+#define	SCAN_RNG_COL_BITS	12
+#define	SCAN_RNG_MAX_BINS	(1u << (SCAN_RNG_BIN_BITS - 2))
+#define	SCAN_RNG_MAX_COLS	(1u << SCAN_RNG_COL_BITS)
+
+static inline uint64_t
+scan_rng_key(uint64_t seed)
+{
+	uint64_t z = seed + 0x9e3779b97f4a7c15ull;
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	z = z ^ (z >> 31);
+
+	return (z | 1);
+}
+
+static inline uint64_t
+scan_rng_squares64(uint64_t ctr, uint64_t key)
+{
+	uint64_t t, x, y, z;
+
+	y = x = ctr * key;
+	z = y + key;
+	x = x * x + y;
+	x = (x >> 32) | (x << 32);
+	x = x * x + z;
+	x = (x >> 32) | (x << 32);
+	x = x * x + y;
+	x = (x >> 32) | (x << 32);
+	t = x = x * x + z;
+	x = (x >> 32) | (x << 32);
+
+	return (t ^ ((x * x + y) >> 32));
+}
+
+/*
+ * Returns the counter of the first random value of range bin 0 in
+ * antenna column `col' of sweep `sweep'. Subsequent values of the scan
+ * line are at consecutive counter values. Bits 0-17 of the counter
+ * hold the bin & value index, bits 18-29 the column and bits 30-63
+ * the sweep number.
+ */
+static inline uint64_t
+scan_rng_ctr(uint64_t sweep, unsigned col)
+{
+	ASSERT3U(col, <, SCAN_RNG_MAX_COLS);
+	return ((sweep << (SCAN_RNG_COL_BITS + SCAN_RNG_BIN_BITS)) |
+	    ((uint64_t)col << SCAN_RNG_BIN_BITS));
+}
+
+/*
+ * Fills `out' with `n' consecutive random values starting at counter
+ * `ctr'. Each value is independent of the others, so the compiler is
+ * free to interleave & vectorize the rounds of adjacent lanes.
+ */
+static inline void
+scan_rng_fill(uint64_t key, uint64_t ctr, uint64_t *out, unsigned n)
+{
+	for (unsigned i = 0; i < n; i++)
+		out[i] = scan_rng_squares64(ctr + i, key);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _SCAN_RNG_H_ */
@@ -107,6 +107,7 @@ typedef struct {
 	unsigned		num_colors;
 	wxr_color_t		colors[MAX_COLORS];
 	wxr_color_t		base_colors[MAX_COLORS];
+	wxr_conf_ext_t		ext;
 } mode_aux_info_t;
 
 struct wxr_sys_s {
@@ -361,7 +362,9 @@ floop_cb(float d_t, float elapsed, int counter, void *refcon)
 		wxr = NULL;
 	}
 	if (wxr == NULL && mode->num_ranges != 0) {
-		wxr = wxr_intf->init(mode, atmo);
+		/* a named provider overrides the built-in atmosphere */
+		wxr = wxr_intf->init_ext(mode, &aux->ext,
+		    aux->ext.atmo_provider[0] != '\0' ? NULL : atmo);
 		ASSERT(wxr != NULL);
 	}
 	if (wxr != NULL)
@@ -589,6 +592,17 @@ parse_conf_file(const conf_t *conf)
 		mode->res_x = clampi(mode->res_x, 64, 512);
 		mode->res_y = clampi(mode->res_y, 64, 512);
 
+		aux->ext.struct_sz = sizeof (aux->ext);
+		conf_get_i(conf, "scan_threads", (int *)&aux->ext.num_threads);
+		aux->ext.num_threads = clampi(aux->ext.num_threads, 0, 16);
+		conf_get_i(conf, "scan_priority", (int *)&aux->ext.priority);
+		conf_get_d(conf, "cpu_budget", &aux->ext.cpu_budget);
+		aux->ext.cpu_budget = clamp(aux->ext.cpu_budget, 0, 1);
+		if (conf_get_str(conf, "atmo_provider", &str)) {
+			strlcpy(aux->ext.atmo_provider, str,
+			    sizeof (aux->ext.atmo_provider));
+		}
+
 		conf_get_d_v(conf, "mode/%d/beam_shape/x",
 		    &mode->beam_shape.x, i);
 		conf_get_d_v(conf, "mode/%d/beam_shape/y",
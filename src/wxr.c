@@ -16,6 +16,7 @@
  * Copyright 2018 Saso Kiselkov. All rights reserved.
  */
 
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -25,10 +26,10 @@
 #include <opengpws/xplane_api.h>
 
 #include <acfutils/assert.h>
-#include <acfutils/crc64.h>
 #include <acfutils/glew.h>
 #include <acfutils/glutils.h>
 #include <acfutils/helpers.h>
+#include <acfutils/log.h>
 #include <acfutils/math.h>
 #include <acfutils/perf.h>
 #include <acfutils/safe_alloc.h>
@@ -39,36 +40,72 @@
 
 #include <cglm/cglm.h>
 
+#include "atmo_reg.h"
+#include "atmo_xp11.h"
 #include "glpriv.h"
+#include "perf_stats.h"
+#include "scan_pool.h"
 #include "wxr.h"
 #include "xplane.h"
 
 #define	TEX_UPD_INTVAL	40000			/* us, 25 fps */
 #define	WORKER_INTVAL	33333			/* us, 30 fps */
-#define	MAX_BEAM_ENERGY	1			/* dBmW */
-#define	EARTH_CIRC	(2 * EARTH_MSL * M_PI)	/* meters */
-#define	MAX_TERR_LAT	79
-#define	GROUND_RETURN_MULT	0.2		/* energy multiplier */
-#define	SHADOW_ENERGY_THRESH	0.57
-#define	ENERGY_SCALE_FACT	0.04
 #define	PANEL_TEX_SZ		2048		/* pixels */
 #define	SCR_CLEAR_DELAY		200000		/* microseconds */
+#define	CTL_READ_TRIES		64
+#define	SCHED_MIN_WAIT		1000		/* us, see wxr_worker */
+#define	SCHED_EWMA_RATE		0.1
+/* packed empty dirty column range, see dirty_add */
+#define	DIRTY_NONE		((uint64_t)UINT32_MAX << 32)
+
+/*
+ * Radar controls set by the wxr_set_* functions and consumed by the worker.
+ * These are published through a seqlock (see ctl_write_begin & ctl_read),
+ * so neither side ever blocks the other. The setters are the only writers
+ * and must all be called from the same thread (normally X-Plane's main
+ * thread), so that thread can also read the fields directly.
+ */
+typedef struct {
+	geo_pos3_t		acf_pos;
+	vect3_t			acf_orient;
+	unsigned		cur_range;
+	double			ant_pitch_req;
+	unsigned		azi_lim_left;
+	unsigned		azi_lim_right;
+	double			pitch_stab;
+	double			roll_stab;
+} wxr_ctl_t;
 
 typedef struct {
 } wxr_prog_loc_t;
 
 struct wxr_s {
 	const wxr_conf_t	*conf;
+	wxr_conf_ext_t		ext;		/* see wxr_init_ext */
 	const atmo_t		*atmo;
+	/* NULL if `atmo' was passed to wxr_init without being registered */
+	atmo_prov_t		*atmo_prov;
+	unsigned		atmo_caps;
 
 	/* only accessed by foreground thread */
 	unsigned		cur_tex;
 	GLuint			tex[2];
 	GLuint			pbo;
-	GLuint			shadow_tex[2];
-	GLuint			shadow_pbo;
 	GLsync			upload_sync;
 	uint64_t		last_upload;
+	/* texture rows [lo, hi) being transferred in the PBOs */
+	unsigned		upload_row_lo;
+	unsigned		upload_row_hi;
+	/* columns each of tex[] is missing, in dirty_add format */
+	uint64_t		tex_dirty[2];
+	/* maps the sample codes in tex[] to colors, see scan.h */
+	GLuint			palette_tex;
+	bool_t			palette_dirty;
+	double			gain;
+	wxr_color_t		colors[SCAN_MAX_COLORS];
+	size_t			num_colors;
+	/* set along with gain & colors, read by the worker */
+	_Atomic double		min_visible;
 	GLint			wxr_prog;
 	struct {
 		GLint		pvm;
@@ -76,41 +113,62 @@ struct wxr_s {
 		GLint		tex_size;
 		GLint		smear_mult;
 		GLint		brt;
+		GLint		palette;
 	} wxr_prog_loc;
-	glutils_quads_t		wxr_scr_quads;
-	vect2_t			draw_pos;
-	vect2_t			draw_size;
-	bool_t			draw_vert;
+	/* unit display geometry for horizontal & vertical scan mode */
+	glutils_quads_t		wxr_scr_quads[2];
 	double			brt;
 
-	mutex_t			lock;
-	/* protected by lock above */
 	bool_t			standby;
+
+	/* seqlock-protected, written by setters, read by ctl_read */
+	atomic_uint		ctl_seq;
+	wxr_ctl_t		ctl;
+
+	/* only modified with the worker stopped or wk.lock held */
 	bool_t			vert_mode;
-	geo_pos3_t		acf_pos;
-	vect3_t			acf_orient;
-	unsigned		cur_range;
-	double			gain;
-	double			ant_pitch_req;
-	unsigned		azi_lim_left;
-	unsigned		azi_lim_right;
-	double			pitch_stab;
-	double			roll_stab;
-	wxr_color_t *		colors;
-	size_t			num_colors;
 	uint64_t		scr_clear_time;
+	bool_t			sched_stop;	/* see worker_stop */
+	condvar_t		sched_cv;
 
 	/* only accessed from worker thread */
 	unsigned		ant_pos;
 	unsigned		ant_pos_vert;
 	bool_t			scan_right;
-	scan_line_t		sl;
-	geo_pos2_t		*tp_in_pts;
-	egpws_terr_probe_t	tp;
+	uint64_t		sweep;
+	scan_job_t		*jobs;
+	scan_line_t		*job_sls;	/* with OPENWXR_ATMO_CAP_BATCH */
+	wxr_ctl_t		ctl_wk;		/* last consistent ctl snapshot */
+	struct {
+		uint64_t	last;		/* start of the previous tick */
+		uint64_t	elapsed;	/* since the previous tick */
+		uint64_t	deadline;	/* when the next tick is due */
+		double		owed;		/* fraction of an antenna step */
+		double		us_per_line;	/* average compute time */
+		uint64_t	compute_ns;	/* of the current tick */
+	} sched;
+
+	/* updated by the worker, read by wxr_get_sched_stats */
+	struct {
+		atomic_ullong	ticks;
+		atomic_ullong	missed;
+		atomic_ullong	lines;
+		atomic_ullong	lines_shed;
+		_Atomic double	load;
+	} stats;
+
+	/* phase timing, updated by any thread, see wxr_get_perf_stats */
+	perf_hist_t		perf[WXR_NUM_PERF_PHASES];
+	mutex_t			perf_lock;
+	perf_win_t		perf_win;	/* protected by perf_lock */
 
 	/* unstructured, always safe to read & write */
-	uint32_t		*samples;
-	uint32_t		*shadow_samples;
+	uint8_t			*samples;
+	/*
+	 * Antenna columns of `samples' modified since the last texture
+	 * upload. Set by the worker, collected by wxr_get_cur_tex.
+	 */
+	_Atomic uint64_t	dirty;
 	bool_t			beam_shadow;
 
 	/* set only at wxr_t creation time */
@@ -118,6 +176,9 @@ struct wxr_s {
 
 	XPLMPluginID		opengpws;
 	const egpws_intf_t	*terr;
+	scan_t			*scan;
+	scan_pool_t		*own_pool;	/* NULL with the shared pool */
+	scan_pool_client_t	*pool;
 
 	worker_t		wk;
 };
@@ -130,6 +191,164 @@ static const shader_prog_info_t smear_prog_info = {
     .frag = &smear_frag_info
 };
 
+/*
+ * A setter brackets its modifications of wxr->ctl with
+ * ctl_write_begin and ctl_write_end. While a write is in progress, the
+ * sequence number is odd.
+ */
+static void
+ctl_write_begin(wxr_t *wxr)
+{
+	unsigned seq = atomic_load_explicit(&wxr->ctl_seq,
+	    memory_order_relaxed);
+
+	ASSERT((seq & 1) == 0);
+	atomic_store_explicit(&wxr->ctl_seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static void
+ctl_write_end(wxr_t *wxr)
+{
+	unsigned seq = atomic_load_explicit(&wxr->ctl_seq,
+	    memory_order_relaxed);
+
+	ASSERT(seq & 1);
+	atomic_store_explicit(&wxr->ctl_seq, seq + 1, memory_order_release);
+}
+
+/*
+ * Takes a consistent snapshot of wxr->ctl into wxr->ctl_wk. Rather
+ * than wait for a writer that might have been preempted in the middle
+ * of an update, we give up after CTL_READ_TRIES attempts and keep using
+ * the previous snapshot. The setters are called every frame, so we will
+ * pick up the new values on the next tick. Returns B_TRUE if a new
+ * snapshot was taken.
+ */
+static bool_t
+ctl_read(wxr_t *wxr)
+{
+	wxr_ctl_t ctl;
+
+	for (int i = 0; i < CTL_READ_TRIES; i++) {
+		unsigned seq = atomic_load_explicit(&wxr->ctl_seq,
+		    memory_order_acquire);
+
+		if (seq & 1)
+			continue;
+		ctl = wxr->ctl;
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&wxr->ctl_seq,
+		    memory_order_relaxed) != seq)
+			continue;
+
+		wxr->ctl_wk = ctl;
+		return (B_TRUE);
+	}
+
+	return (B_FALSE);
+}
+
+/*
+ * A dirty range of antenna columns is packed into a single 64-bit word,
+ * with the first column in the upper 32 bits and the last column (both
+ * inclusive) in the lower 32 bits. First > last means an empty range.
+ * The antenna sweeps steadily, so between two texture uploads, the
+ * modified columns are nearly always a single contiguous run and the
+ * range doesn't overestimate them.
+ */
+static inline uint64_t
+dirty_pack(unsigned lo, unsigned hi)
+{
+	return (((uint64_t)lo << 32) | hi);
+}
+
+static inline uint64_t
+dirty_union(uint64_t a, uint64_t b)
+{
+	return (dirty_pack(MIN(a >> 32, b >> 32),
+	    MAX(a & UINT32_MAX, b & UINT32_MAX)));
+}
+
+static inline bool_t
+dirty_empty(uint64_t d)
+{
+	return ((d >> 32) > (d & UINT32_MAX));
+}
+
+static void
+dirty_add(wxr_t *wxr, unsigned lo, unsigned hi)
+{
+	uint64_t old = atomic_load_explicit(&wxr->dirty, memory_order_relaxed);
+
+	ASSERT3U(lo, <=, hi);
+	ASSERT3U(hi, <, wxr->conf->res_x);
+	/* release, so the sample writes are visible with the dirty mark */
+	while (!atomic_compare_exchange_weak_explicit(&wxr->dirty, &old,
+	    dirty_union(old, dirty_pack(lo, hi)), memory_order_release,
+	    memory_order_relaxed))
+		;
+}
+
+static void
+atmo_enter(wxr_t *wxr)
+{
+	if (wxr->atmo_prov != NULL)
+		atmo_prov_enter(wxr->atmo_prov);
+}
+
+static void
+atmo_exit(wxr_t *wxr)
+{
+	if (wxr->atmo_prov != NULL)
+		atmo_prov_exit(wxr->atmo_prov);
+}
+
+/*
+ * Computes the jobs collected by wxr_worker and marks their columns
+ * as needing a texture upload. The time spent computing them is added
+ * to sched.compute_ns.
+ */
+static void
+run_jobs(wxr_t *wxr, const scan_tick_t *tick, unsigned num_jobs)
+{
+	unsigned lo = UINT32_MAX, hi = 0;
+	uint64_t start;
+
+	if (num_jobs == 0)
+		return;
+
+	if (wxr->atmo_caps & OPENWXR_ATMO_CAP_BATCH) {
+		/* probe all scan lines in one go, the pool just uses them */
+		for (unsigned i = 0; i < num_jobs; i++) {
+			scan_line_setup(wxr->scan, tick, wxr->jobs[i].ant_pos,
+			    wxr->jobs[i].ant_pos_vert, &wxr->job_sls[i]);
+			wxr->jobs[i].sl = &wxr->job_sls[i];
+		}
+		atmo_enter(wxr);
+		start = perf_clock();
+		wxr->atmo->probe_batch(wxr->job_sls, num_jobs);
+		wxr->sched.compute_ns += perf_hist_end(
+		    &wxr->perf[WXR_PERF_ATMO], start) - start;
+		atmo_exit(wxr);
+		wxr->sched.compute_ns += scan_pool_run(wxr->pool, tick,
+		    wxr->jobs, num_jobs);
+	} else {
+		atmo_enter(wxr);
+		wxr->sched.compute_ns += scan_pool_run(wxr->pool, tick,
+		    wxr->jobs, num_jobs);
+		atmo_exit(wxr);
+	}
+
+	for (unsigned i = 0; i < num_jobs; i++) {
+		unsigned col = (wxr->jobs[i].samples - wxr->samples) /
+		    wxr->conf->res_y;
+		lo = MIN(lo, col);
+		hi = MAX(hi, col);
+	}
+	dirty_add(wxr, lo, hi);
+}
+
 static void
 wxr_ant_return2neutral(wxr_t *wxr)
 {
@@ -144,15 +363,6 @@ wxr_ant_return2neutral(wxr_t *wxr)
 	    (conf->parked_azi + conf->scan_angle / 2), 1, conf->res_x - 2);
 }
 
-static vect3_t
-randomize_normal(vect3_t norm)
-{
-	double rx = 0.9 + ((double)crc64_rand() / UINT64_MAX) / 5;
-	double ry = 0.9 + ((double)crc64_rand() / UINT64_MAX) / 5;
-	double rz = 0.9 + ((double)crc64_rand() / UINT64_MAX) / 5;
-	return (VECT3(norm.x * rx, norm.y * ry, norm.z * rz));
-}
-
 static void
 advance_ant_pos(wxr_t *wxr)
 {
@@ -169,9 +379,12 @@ advance_ant_pos(wxr_t *wxr)
 				wxr->ant_pos_vert++;
 		}
 		if ((!wxr->vert_mode && (wxr->ant_pos == wxr->conf->res_x - 1 ||
-		    wxr->ant_pos >= wxr->azi_lim_right)) || (wxr->vert_mode &&
-		    wxr->ant_pos_vert == wxr->conf->res_x - 1))
+		    wxr->ant_pos >= wxr->ctl_wk.azi_lim_right)) ||
+		    (wxr->vert_mode &&
+		    wxr->ant_pos_vert == wxr->conf->res_x - 1)) {
 			wxr->scan_right = B_FALSE;
+			wxr->sweep++;
+		}
 	} else {
 		if (!wxr->vert_mode) {
 			if (wxr->ant_pos != 0)
@@ -181,118 +394,154 @@ advance_ant_pos(wxr_t *wxr)
 				wxr->ant_pos_vert--;
 		}
 		if ((!wxr->vert_mode &&
-		    (wxr->ant_pos == 0 || wxr->ant_pos <= wxr->azi_lim_left)) ||
-		    (wxr->vert_mode && wxr->ant_pos_vert == 0))
+		    (wxr->ant_pos == 0 ||
+		    wxr->ant_pos <= wxr->ctl_wk.azi_lim_left)) ||
+		    (wxr->vert_mode && wxr->ant_pos_vert == 0)) {
 			wxr->scan_right = B_TRUE;
+			wxr->sweep++;
+		}
 	}
 	ASSERT3U(wxr->ant_pos, <, wxr->conf->res_x);
 	ASSERT3U(wxr->ant_pos_vert, <, wxr->conf->res_x);
 }
 
+/*
+ * Must be called before (re)starting the worker.
+ */
 static void
-prep_terr_probe_coords(wxr_t *wxr, vect2_t ant_dir, vect2_t degree_sz)
+sched_reset(wxr_t *wxr)
 {
-	for (unsigned i = 0; i < wxr->conf->res_y; i++) {
-		double d = ((double)i / wxr->conf->res_y) * wxr->sl.range;
-		vect2_t disp_m = vect2_scmul(ant_dir, d);
-		vect2_t disp_deg = VECT2(disp_m.x / degree_sz.x,
-		    disp_m.y / degree_sz.y);
-		geo_pos2_t p = GEO_POS2(wxr->sl.origin.lat + disp_deg.y,
-		    wxr->sl.origin.lon + disp_deg.x);
-		/*
-		 * Handle geo coordinate wrapping.
-		 */
-		p.lat = clamp(p.lat, -MAX_TERR_LAT, MAX_TERR_LAT);
-		if (p.lon <= -180.0)
-			p.lon += 360;
-		else if (p.lon >= 180.0)
-			p.lon -= 360.0;
-		ASSERT(is_valid_lat(p.lat));
-		ASSERT(is_valid_lon(p.lon));
-		wxr->tp_in_pts[i] = p;
+	wxr->sched.last = microclock();
+	wxr->sched.deadline = wxr->sched.last + wxr->worker_intval;
+	wxr->sched.owed = 0;
+	wxr->sched_stop = B_FALSE;
+}
+
+/*
+ * Stops the worker, waking it up if it is waiting for its deadline.
+ */
+static void
+worker_stop(wxr_t *wxr)
+{
+	mutex_enter(&wxr->wk.lock);
+	wxr->sched_stop = B_TRUE;
+	cv_broadcast(&wxr->sched_cv);
+	mutex_exit(&wxr->wk.lock);
+	worker_fini(&wxr->wk);
+}
+
+/*
+ * The antenna is advanced by the wall-clock time elapsed since the
+ * previous tick, so a late or slow tick doesn't slow the sweep down,
+ * the next tick simply does more steps. After a stall, we don't try to
+ * catch up on more than a full sweep. Returns the number of antenna
+ * steps to take in `num_steps' and the number of scan lines we can
+ * afford to compute within the CPU budget in `num_lines'.
+ */
+static void
+sched_tick(wxr_t *wxr, uint64_t now, double scan_time, unsigned *num_steps,
+    unsigned *num_lines)
+{
+	const wxr_conf_t *conf = wxr->conf;
+	uint64_t elapsed = now - wxr->sched.last;
+
+	wxr->sched.elapsed = elapsed;
+
+	if (now > wxr->sched.deadline + wxr->worker_intval / 2) {
+		atomic_fetch_add(&wxr->stats.missed, 1);
+		wxr->sched.deadline = now;
+	}
+	wxr->sched.deadline += wxr->worker_intval;
+	wxr->sched.last = now;
+
+	wxr->sched.owed = MIN(wxr->sched.owed +
+	    USEC2SEC(elapsed) * (conf->res_x / scan_time), conf->res_x);
+	*num_steps = floor(wxr->sched.owed);
+	wxr->sched.owed -= *num_steps;
+
+	*num_lines = *num_steps;
+	if (wxr->ext.cpu_budget > 0 && wxr->sched.us_per_line > 0) {
+		double lines = (wxr->ext.cpu_budget * elapsed) /
+		    wxr->sched.us_per_line;
+
+		/* always compute something, to keep us_per_line current */
+		*num_lines = MIN(*num_lines, MAX(lines, 1));
 	}
 }
 
+/*
+ * Updates the statistics after the tick's scan lines have been computed.
+ * Both the cost of a scan line and the load are based on the compute
+ * time of the tick's scan lines, summed over all the threads which
+ * worked on them, so time spent queued behind other WXR instances in
+ * the shared scan pool isn't charged against the CPU budget.
+ */
+static void
+sched_tick_done(wxr_t *wxr, unsigned lines, unsigned lines_shed)
+{
+	uint64_t busy = wxr->sched.compute_ns / 1000;
+	double load = atomic_load(&wxr->stats.load);
+
+	if (lines != 0) {
+		double us_per_line = (double)busy / lines;
+
+		if (wxr->sched.us_per_line == 0)
+			wxr->sched.us_per_line = us_per_line;
+		FILTER_IN(wxr->sched.us_per_line, us_per_line,
+		    SCHED_EWMA_RATE, 1);
+	}
+	/* may exceed 1 when several threads compute our scan lines */
+	FILTER_IN(load, (double)busy / MAX(wxr->sched.elapsed, 1),
+	    SCHED_EWMA_RATE, 1);
+	atomic_store(&wxr->stats.load, load);
+	atomic_fetch_add(&wxr->stats.ticks, 1);
+	atomic_fetch_add(&wxr->stats.lines, lines);
+	atomic_fetch_add(&wxr->stats.lines_shed, lines_shed);
+}
+
 static bool_t
 wxr_worker(void *userinfo)
 {
 	wxr_t *wxr = userinfo;
-	double ant_pitch_base, acf_hdg, acf_pitch;
-	vect2_t degree_sz;
+	scan_tick_t tick;
 	double scan_time;
-	double sample_sz = wxr->sl.range / wxr->sl.num_samples;
-	double sample_sz_rat = sample_sz / 1000.0;
-	double extra_pitch = 0, extra_roll = 0;
-	size_t num_colors;
-	wxr_color_t *colors;
-	unsigned work_step;
-	uint64_t now = microclock();
+	unsigned num_steps, num_lines, num_jobs = 0;
+	unsigned num_done = 0, num_shed = 0;
+	uint64_t now, pose_start;
 	bool_t suppress_drawing;
 
-#ifdef	WXR_PROFILE
-	static uint64_t last_report_time = 0;
-	static uint64_t total_time = 0;
-	uint64_t start, end;
-
-	start = now;
-#endif	/* WXR_PROFILE */
+	/*
+	 * The worker itself only waits SCHED_MIN_WAIT between calls, we
+	 * sleep out the rest of the time until the tick's deadline here,
+	 * so that a tick which ran long doesn't push the next one back by
+	 * a whole interval. Waiting drops wk.lock, so the functions
+	 * taking it to exclude the worker don't have to wait for us.
+	 */
+	while (!wxr->sched_stop && microclock() < wxr->sched.deadline) {
+		(void)cv_timedwait(&wxr->sched_cv, &wxr->wk.lock,
+		    wxr->sched.deadline);
+	}
+	if (wxr->sched_stop)
+		return (B_FALSE);
+	now = microclock();
+	pose_start = perf_clock();
 
-	mutex_enter(&wxr->lock);
+	(void)ctl_read(wxr);
 
 	suppress_drawing = (now - wxr->scr_clear_time < SCR_CLEAR_DELAY);
 
-	wxr->sl.origin = wxr->acf_pos;
-	wxr->sl.shape = wxr->conf->beam_shape;
-	wxr->sl.range = wxr->conf->ranges[wxr->cur_range];
-	wxr->sl.energy = MAX_BEAM_ENERGY;
-	wxr->sl.max_range = wxr->conf->ranges[wxr->conf->num_ranges - 1];
-	wxr->sl.num_samples = wxr->conf->res_y;
-	ant_pitch_base = wxr->ant_pitch_req;
-	acf_hdg = wxr->acf_orient.y;
-	acf_pitch = wxr->acf_orient.x;
-	if (acf_pitch > wxr->pitch_stab)
-		extra_pitch = acf_pitch - wxr->pitch_stab;
-	else if (acf_pitch < -wxr->pitch_stab)
-		extra_pitch = wxr->pitch_stab + acf_pitch;
-	if (wxr->acf_orient.z > wxr->roll_stab)
-		extra_roll = wxr->acf_orient.z - wxr->roll_stab;
-	else if (wxr->acf_orient.z < -wxr->roll_stab)
-		extra_roll = wxr->acf_orient.z + wxr->roll_stab;
-
-	num_colors = wxr->num_colors;
-	colors = safe_calloc(sizeof (*colors), num_colors);
-	memcpy(colors, wxr->colors, sizeof (*colors) * num_colors);
-
-	mutex_exit(&wxr->lock);
-
-	degree_sz = VECT2(
-	    (EARTH_CIRC / 360.0) * cos(DEG2RAD(wxr->sl.origin.lat)),
-	    (EARTH_CIRC / 360.0));
+	tick.acf_pos = wxr->ctl_wk.acf_pos;
+	tick.acf_orient = wxr->ctl_wk.acf_orient;
+	tick.ant_pitch_req = wxr->ctl_wk.ant_pitch_req;
+	tick.pitch_stab = wxr->ctl_wk.pitch_stab;
+	tick.roll_stab = wxr->ctl_wk.roll_stab;
+	tick.range_idx = wxr->ctl_wk.cur_range;
+	tick.vert_mode = wxr->vert_mode;
+	tick.beam_shadow = wxr->beam_shadow;
+	tick.min_visible = atomic_load(&wxr->min_visible);
 
-	/*
-	 * A word on terrain drawing.
-	 *
-	 * We need to pass LATxLON points to OpenGPWS to give us terrain
-	 * elevations, but since doing proper FPP-to-GEO transformations
-	 * for each point would be pretty expensive (tons of trig), we
-	 * fudge it by instead projecting lines at a fixed LATxLON
-	 * increment using our heading. Essentially, we are projecting
-	 * rhumb lines instead of true radials, but for the short terrain
-	 * distances that we care about (at most around 100km), that is
-	 * "close enough" that we don't need to care.
-	 */
-	if (wxr->tp.in_pts == NULL) {
-		wxr->tp.num_pts = wxr->conf->res_y;
-		wxr->tp_in_pts = safe_calloc(wxr->tp.num_pts,
-		    sizeof (*wxr->tp_in_pts));
-		wxr->tp.in_pts = wxr->tp_in_pts;
-		wxr->tp.out_elev = safe_calloc(wxr->tp.num_pts,
-		    sizeof (*wxr->tp.out_elev));
-		wxr->tp.out_norm = safe_calloc(wxr->tp.num_pts,
-		    sizeof (*wxr->tp.out_norm));
-		wxr->tp.out_water = safe_calloc(wxr->tp.num_pts,
-		    sizeof (*wxr->tp.out_water));
-	}
+	scan_tick_prep(wxr->scan, &tick);
+	perf_hist_end(&wxr->perf[WXR_PERF_POSE], pose_start);
 
 	/*
 	 * We want to maintain a constant scan rate, but in vertical mode
@@ -306,182 +555,67 @@ wxr_worker(void *userinfo)
 		    wxr->conf->scan_angle) * wxr->conf->scan_time;
 	}
 
-	work_step = MAX(1, round(wxr->conf->res_x *
-	    (USEC2SEC(wxr->worker_intval) / scan_time)));
-	for (unsigned i = 0; i < work_step; i++) {
-		enum { NUM_VERT_SECTORS = 10 };
-		double ant_hdg, ant_pitch_up_down;
+	sched_tick(wxr, now, scan_time, &num_steps, &num_lines);
+	wxr->sched.compute_ns = 0;
+	for (unsigned i = 0; i < num_steps; i++) {
+		scan_job_t *job;
 		int off;
-		double energy_spent[NUM_VERT_SECTORS];
-		vect2_t ant_dir, ant_dir_neg;
-		double sin_ant_pitch[NUM_VERT_SECTORS + 1];
-		double ant_pitch = ant_pitch_base;
-		double cos_ant_pitch;
-
-		CTASSERT(NUM_VERT_SECTORS > 1);
-		memset(energy_spent, 0, sizeof (energy_spent));
 
 		advance_ant_pos(wxr);
 		if (suppress_drawing)
 			continue;
+		/* spread the lines we can afford evenly over the steps */
+		if ((uint64_t)(i + 1) * num_lines / num_steps ==
+		    (uint64_t)i * num_lines / num_steps) {
+			num_shed++;
+			continue;
+		}
 
 		if (!wxr->vert_mode)
 			off = wxr->ant_pos * wxr->conf->res_y;
 		else
 			off = wxr->ant_pos_vert * wxr->conf->res_y;
 
-		wxr->sl.ant_rhdg = (wxr->conf->scan_angle *
-		    ((wxr->ant_pos / (double)wxr->conf->res_x) - 0.5)) *
-		    cos(DEG2RAD(extra_roll));
-		ant_hdg = acf_hdg + wxr->sl.ant_rhdg;
-		if (wxr->vert_mode) {
-			UNUSED(acf_pitch);
-			ant_pitch =
-			    -(wxr->conf->scan_angle_vert *
-			    ((wxr->ant_pos_vert / (double)wxr->conf->res_x) -
-			    0.5));
-			ant_pitch = clamp(ant_pitch, -90, 90);
-		}
-		ant_pitch += extra_pitch;
-		wxr->sl.dir = VECT2(ant_hdg, ant_pitch);
-		ant_pitch_up_down = ant_pitch;
-		cos_ant_pitch = cos(DEG2RAD(ant_pitch));
-		wxr->sl.vert_scan = wxr->vert_mode;
-
-		wxr->atmo->probe(&wxr->sl);
-
-		ant_dir = hdg2dir(ant_hdg);
-		ant_dir_neg = vect2_neg(ant_dir);
-		for (int j = 0; j < NUM_VERT_SECTORS + 1; j++) {
-			double angle = ant_pitch_up_down -
-			    wxr->conf->beam_shape.y / 2 +
-			    (wxr->conf->beam_shape.y / NUM_VERT_SECTORS) * j;
-			sin_ant_pitch[j] = sin(DEG2RAD(angle));
-		}
-		prep_terr_probe_coords(wxr, ant_dir, degree_sz);
-		wxr->terr->terr_probe(&wxr->tp);
-
+		job = &wxr->jobs[num_jobs++];
+		job->ant_pos = wxr->ant_pos;
+		job->ant_pos_vert = wxr->ant_pos_vert;
+		job->sweep = wxr->sweep;
+		job->samples = &wxr->samples[off];
 		/*
-		 * No need to lock the samples, worst case is we will
-		 * draw a partially updated scan line - no big deal.
+		 * The job list holds one full sweep. Should we ever need
+		 * to do more than that in a tick, flush it early.
 		 */
-		for (unsigned j = 0; j < wxr->conf->res_y; j++) {
-			double energy[NUM_VERT_SECTORS];
-			double abs_energy = 0;
-			double energy_spent_total = 0;
-			/* Distance of point along scan line from antenna. */
-			double d = ((double)j / wxr->conf->res_y) *
-			    wxr->sl.range * cos_ant_pitch;
-			int64_t elev_rand_lim = iter_fract(d, 0, 100000,
-			    B_TRUE) * 3000 + 10;
-			int64_t elev_rand = (crc64_rand() % elev_rand_lim) -
-			    (elev_rand_lim / 2);
-			double terr_elev = wxr->tp.out_elev[j] + elev_rand;
-			vect2_t ant_dir_neg_m = vect2_scmul(ant_dir_neg, d);
-			/* Reverse vector from ground point to the antenna. */
-			vect3_t back_v = vect3_unit(VECT3(ant_dir_neg_m.x,
-			    ant_dir_neg_m.y, wxr->sl.origin.elev - terr_elev),
-			    NULL);
-			double ground_absorb[NUM_VERT_SECTORS];
-			double ground_return[NUM_VERT_SECTORS];
-			double ground_return_total = 0;
-			vect3_t norm;
-			double fract_dir;
-
-			for (int k = 0; k < NUM_VERT_SECTORS; k++) {
-				energy[k] = wxr->sl.energy_out[j] /
-				    NUM_VERT_SECTORS;
-			}
-
-			norm = randomize_normal(wxr->tp.out_norm[j]);
-			fract_dir = vect3_dotprod(back_v, norm);
-			fract_dir = clamp(fract_dir, 0, 1);
-
-			for (int k = 0; k < NUM_VERT_SECTORS; k++) {
-				/* How perpendicular is the ground to us */
-				double elev_min;
-				double elev_max;
-				/*
-				 * Fraction of how much of the beam is below
-				 * ground.
-				 */
-				double fract_hit;
-
-				elev_min = wxr->sl.origin.elev +
-				    sin_ant_pitch[k] * d;
-				elev_max = wxr->sl.origin.elev +
-				    sin_ant_pitch[k + 1] * d;
-				/*
-				 * At extreme antenna angles, the top/bottom
-				 * distinction can break, so to avoid that, we
-				 * manually flip the coordinates in this case
-				 * and add 0.1m to elev_max to guarantee that
-				 * it cannot be <= elev_min.
-				 */
-				if (elev_min > elev_max) {
-					double tmp = elev_max;
-					elev_max = elev_min;
-					elev_min = tmp;
-				}
-				elev_max += 0.1;
-				fract_hit = iter_fract(terr_elev, elev_min,
-				    elev_max, B_FALSE) / 5;
-				fract_hit = clamp(fract_hit, 0, 1);
-				ground_absorb[k] = ((1 - energy_spent[k]) *
-				    fract_hit) * sample_sz_rat * 0.1;
-				ground_return[k] = ((1 - energy_spent[k]) *
-				    fract_hit * (fract_dir + 0.8) /
-				    NUM_VERT_SECTORS) * GROUND_RETURN_MULT *
-				    (1 - wxr->tp.out_water[j] * 0.95);
-			}
-
-			for (int k = 0; k < NUM_VERT_SECTORS; k++) {
-				abs_energy += energy[k];
-				ground_return_total += ground_return[k];
-				energy_spent[k] += energy[k] + ground_absorb[k];
-				energy_spent_total += energy_spent[k];
-			}
-			abs_energy = ((abs_energy / sample_sz_rat) +
-			    ground_return_total) * wxr->gain;
-
-			if (energy_spent_total / NUM_VERT_SECTORS >
-			    SHADOW_ENERGY_THRESH && wxr->beam_shadow) {
-				wxr->shadow_samples[off + j] =
-				    BE32(0x70707070u);
-			} else {
-				wxr->shadow_samples[off + j] = 0x00u;
-			}
-			wxr->samples[off + j] = 0x00u;
-			for (size_t k = 0; k < num_colors; k++) {
-				if (abs_energy / ENERGY_SCALE_FACT >=
-				    colors[k].min_val) {
-					wxr->samples[off + j] = colors[k].rgba;
-					break;
-				}
-			}
+		if (num_jobs == wxr->conf->res_x) {
+			run_jobs(wxr, &tick, num_jobs);
+			num_done += num_jobs;
+			num_jobs = 0;
 		}
 	}
-
-	free(colors);
-
-#ifdef	WXR_PROFILE
-	end = microclock();
-	total_time += (end - start);
-	if (now - last_report_time > 1000000) {
-		printf("load: %.3f%%\n", (100.0 * total_time) /
-		    (now - last_report_time));
-		last_report_time = now;
-		total_time = 0;
-	}
-#endif	/* WXR_PROFILE */
+	run_jobs(wxr, &tick, num_jobs);
+	num_done += num_jobs;
+	sched_tick_done(wxr, num_done, num_shed);
 
 	return (B_TRUE);
 }
 
 wxr_t *
 wxr_init(const wxr_conf_t *conf, const atmo_t *atmo)
+{
+	return (wxr_init_ext(conf, NULL, atmo));
+}
+
+/*
+ * `ext' may come from a plugin built against an older API, in which
+ * case it is shorter than ours. We only copy as much as the caller
+ * says it has, the rest of our copy stays zeroed, which means defaults.
+ */
+wxr_t *
+wxr_init_ext(const wxr_conf_t *conf, const wxr_conf_ext_t *ext,
+    const atmo_t *atmo)
 {
 	wxr_t *wxr = safe_calloc(1, sizeof (*wxr));
+	perf_hist_snap_t snaps[WXR_NUM_PERF_PHASES];
+	bool_t mt_ok;
 
 	ASSERT(conf->num_ranges != 0);
 	ASSERT3U(conf->num_ranges, <, WXR_MAX_RANGES);
@@ -493,26 +627,59 @@ wxr_init(const wxr_conf_t *conf, const atmo_t *atmo)
 	ASSERT3F(conf->scan_angle, >, 0);
 	ASSERT3F(conf->scan_angle_vert, >=, 0);
 	ASSERT3F(ABS(conf->parked_azi), <=, conf->scan_angle / 2);
-	ASSERT(atmo->probe != NULL);
-
-	mutex_init(&wxr->lock);
 
 	wxr->conf = conf;
-	wxr->atmo = atmo;
+	if (ext != NULL) {
+		ASSERT3U(ext->struct_sz, >=, sizeof (ext->struct_sz));
+		memcpy(&wxr->ext, ext, MIN(ext->struct_sz, sizeof (*ext)));
+		wxr->ext.atmo_provider[sizeof (wxr->ext.atmo_provider) - 1] =
+		    '\0';
+	}
+	wxr->ext.struct_sz = sizeof (wxr->ext);
+	wxr->atmo_prov = atmo_prov_hold(atmo, wxr->ext.atmo_provider);
+	if (atmo == NULL && wxr->atmo_prov == NULL) {
+		logMsg("Atmosphere provider \"%s\" not found, falling back "
+		    "to the built-in atmosphere", wxr->ext.atmo_provider);
+		wxr->atmo_prov = atmo_prov_hold(NULL, NULL);
+	}
+	if (wxr->atmo_prov != NULL) {
+		const openwxr_atmo_provider_t *info =
+		    atmo_prov_get_info(wxr->atmo_prov);
+		wxr->atmo = info->atmo;
+		wxr->atmo_caps = info->caps;
+	} else {
+		/*
+		 * Unregistered atmospheres handed to us directly have
+		 * always been called from multiple threads.
+		 */
+		wxr->atmo = atmo;
+		wxr->atmo_caps = OPENWXR_ATMO_CAP_MT_SAFE;
+	}
+	VERIFY(wxr->atmo != NULL);
+	ASSERT(wxr->atmo->probe != NULL);
+	atomic_init(&wxr->ctl_seq, 0);
+	atomic_init(&wxr->dirty, DIRTY_NONE);
+	for (int i = 0; i < WXR_NUM_PERF_PHASES; i++)
+		perf_hist_init(&wxr->perf[i]);
+	mutex_init(&wxr->perf_lock);
+	cv_init(&wxr->sched_cv);
+	wxr->tex_dirty[0] = DIRTY_NONE;
+	wxr->tex_dirty[1] = DIRTY_NONE;
 	wxr->gain = 1.0;
+	/* nothing is visible until we get some colors */
+	atomic_init(&wxr->min_visible, INFINITY);
 	wxr->brt = 1.0;
 	/*
 	 * 4 vertices per quad, 2 coords per vertex
 	 */
 	wxr->samples = safe_calloc(conf->res_x * conf->res_y,
 	    sizeof (*wxr->samples));
-	wxr->shadow_samples = safe_calloc(conf->res_x * conf->res_y,
-	    sizeof (*wxr->samples));
 	wxr_ant_return2neutral(wxr);
-	wxr->azi_lim_right = conf->res_x - 1;
-	wxr->sl.energy_out = safe_calloc(wxr->conf->res_y, sizeof (double));
-	wxr->sl.doppler_out = safe_calloc(wxr->conf->res_y, sizeof (double));
+	wxr->ctl.azi_lim_right = conf->res_x - 1;
+	wxr->ctl_wk = wxr->ctl;
+	atmo_enter(wxr);
 	wxr->atmo->set_range(wxr->conf->ranges[0]);
+	atmo_exit(wxr);
 
 	(void)wxr_reload_gl_progs(wxr);
 
@@ -521,11 +688,45 @@ wxr_init(const wxr_conf_t *conf, const atmo_t *atmo)
 		XPLMSendMessageToPlugin(wxr->opengpws, EGPWS_GET_INTF,
 		    &wxr->terr);
 	}
+	ASSERT(wxr->terr != NULL);
+	wxr->scan = scan_init(conf, wxr->atmo, wxr->terr->terr_probe);
+	scan_set_perf(wxr->scan, wxr->perf);
+	/*
+	 * Scan lines call into the atmosphere from the pool threads, so
+	 * providers which can't take that get a pool without threads.
+	 */
+	mt_ok = ((wxr->atmo_caps & (OPENWXR_ATMO_CAP_MT_SAFE |
+	    OPENWXR_ATMO_CAP_BATCH)) != 0);
+	if (mt_ok && wxr->ext.num_threads == 0 && get_scan_pool() != NULL) {
+		wxr->pool = scan_pool_client_init(get_scan_pool(), wxr->scan,
+		    MAX(wxr->ext.priority, 1));
+	} else {
+		wxr->own_pool = scan_pool_init(mt_ok &&
+		    wxr->ext.num_threads > 1 ? wxr->ext.num_threads : 0, 0);
+		wxr->pool = scan_pool_client_init(wxr->own_pool, wxr->scan, 1);
+	}
+	wxr->jobs = safe_calloc(conf->res_x, sizeof (*wxr->jobs));
+	if (wxr->atmo_caps & OPENWXR_ATMO_CAP_BATCH) {
+		wxr->job_sls = safe_calloc(conf->res_x,
+		    sizeof (*wxr->job_sls));
+		for (unsigned i = 0; i < conf->res_x; i++) {
+			wxr->job_sls[i].energy_out = safe_calloc(conf->res_y,
+			    sizeof (double));
+			wxr->job_sls[i].doppler_out = safe_calloc(conf->res_y,
+			    sizeof (double));
+		}
+	}
 
 	wxr->worker_intval = MAX(
 	    SEC2USEC(wxr->conf->scan_time / wxr->conf->res_x), WORKER_INTVAL);
 
-	worker_init(&wxr->wk, wxr_worker, wxr->worker_intval, wxr,
+	wxr_perf_snap(wxr, snaps);
+	perf_win_init(&wxr->perf_win, WXR_NUM_PERF_PHASES, snaps,
+	    perf_clock());
+	perf_stats_add(wxr);
+
+	sched_reset(wxr);
+	worker_init(&wxr->wk, wxr_worker, SCHED_MIN_WAIT, wxr,
 	    "OpenWXR-worker");
 
 	return (wxr);
@@ -535,33 +736,38 @@ void
 wxr_fini(wxr_t *wxr)
 {
 	if (!wxr->standby)
-		worker_fini(&wxr->wk);
+		worker_stop(wxr);
+	perf_stats_remove(wxr);
 
-	free(wxr->colors);
 	if (wxr->tex[0] != 0)
 		glDeleteTextures(2, wxr->tex);
 	if (wxr->pbo != 0)
 		glDeleteBuffers(1, &wxr->pbo);
-	if (wxr->shadow_tex[0] != 0)
-		glDeleteTextures(2, wxr->shadow_tex);
-	if (wxr->shadow_pbo != 0)
-		glDeleteBuffers(1, &wxr->shadow_pbo);
+	if (wxr->palette_tex != 0)
+		glDeleteTextures(1, &wxr->palette_tex);
 
-	glutils_destroy_quads(&wxr->wxr_scr_quads);
+	glutils_destroy_quads(&wxr->wxr_scr_quads[0]);
+	glutils_destroy_quads(&wxr->wxr_scr_quads[1]);
 
 	free(wxr->samples);
-	free(wxr->shadow_samples);
-	free(wxr->sl.energy_out);
-	free(wxr->sl.doppler_out);
-	free(wxr->tp_in_pts);
-	free(wxr->tp.out_elev);
-	free(wxr->tp.out_norm);
-	free(wxr->tp.out_water);
+	free(wxr->jobs);
+	if (wxr->job_sls != NULL) {
+		for (unsigned i = 0; i < wxr->conf->res_x; i++) {
+			free(wxr->job_sls[i].energy_out);
+			free(wxr->job_sls[i].doppler_out);
+		}
+		free(wxr->job_sls);
+	}
+	scan_pool_client_fini(wxr->pool);
+	scan_pool_fini(wxr->own_pool);
+	scan_fini(wxr->scan);
+	atmo_prov_rele(wxr->atmo_prov);
 
 	if (wxr->wxr_prog != 0)
 		glDeleteProgram(wxr->wxr_prog);
-
-	mutex_destroy(&wxr->lock);
+	perf_win_fini(&wxr->perf_win);
+	mutex_destroy(&wxr->perf_lock);
+	cv_destroy(&wxr->sched_cv);
 
 	free(wxr);
 }
@@ -572,10 +778,10 @@ wxr_set_acf_pos(wxr_t *wxr, geo_pos3_t pos, vect3_t orient)
 	ASSERT(!IS_NULL_GEO_POS(pos));
 	ASSERT(!IS_NULL_VECT(orient));
 
-	mutex_enter(&wxr->lock);
-	wxr->acf_pos = pos;
-	wxr->acf_orient = orient;
-	mutex_exit(&wxr->lock);
+	ctl_write_begin(wxr);
+	wxr->ctl.acf_pos = pos;
+	wxr->ctl.acf_orient = orient;
+	ctl_write_end(wxr);
 }
 
 void
@@ -585,18 +791,20 @@ wxr_set_scale(wxr_t *wxr, unsigned range_idx)
 
 	ASSERT3U(range_idx, <, wxr->conf->num_ranges);
 
-	mutex_enter(&wxr->lock);
-	wxr->cur_range = range_idx;
-	range = wxr->conf->ranges[wxr->cur_range];
-	mutex_exit(&wxr->lock);
+	ctl_write_begin(wxr);
+	wxr->ctl.cur_range = range_idx;
+	range = wxr->conf->ranges[range_idx];
+	ctl_write_end(wxr);
 
+	atmo_enter(wxr);
 	wxr->atmo->set_range(range);
+	atmo_exit(wxr);
 }
 
 unsigned
 wxr_get_scale(const wxr_t *wxr)
 {
-	return (wxr->cur_range);
+	return (wxr->ctl.cur_range);
 }
 
 /*
@@ -608,12 +816,12 @@ wxr_set_azimuth_limits(wxr_t *wxr, double left, double right)
 	ASSERT3F(left, >=, -wxr->conf->scan_angle / 2);
 	ASSERT3F(right, <=, wxr->conf->scan_angle / 2);
 
-	mutex_enter(&wxr->lock);
-	wxr->azi_lim_left = MAX(((left + wxr->conf->scan_angle / 2) /
+	ctl_write_begin(wxr);
+	wxr->ctl.azi_lim_left = MAX(((left + wxr->conf->scan_angle / 2) /
 	    wxr->conf->scan_angle) * wxr->conf->res_x, 0);
-	wxr->azi_lim_right = MIN(((right + wxr->conf->scan_angle / 2) /
+	wxr->ctl.azi_lim_right = MIN(((right + wxr->conf->scan_angle / 2) /
 	    wxr->conf->scan_angle) * wxr->conf->res_x, wxr->conf->res_x - 1);
-	mutex_exit(&wxr->lock);
+	ctl_write_end(wxr);
 }
 
 double
@@ -629,9 +837,9 @@ wxr_set_ant_pitch(wxr_t *wxr, double angle)
 	ASSERT3F(angle, <=, 90);
 	ASSERT3F(angle, >=, -90);
 
-	mutex_enter(&wxr->lock);
-	wxr->ant_pitch_req = angle;
-	mutex_exit(&wxr->lock);
+	ctl_write_begin(wxr);
+	wxr->ctl.ant_pitch_req = angle;
+	ctl_write_end(wxr);
 }
 
 double
@@ -639,21 +847,38 @@ wxr_get_ant_pitch(const wxr_t *wxr)
 {
 	/* TODO: this is broken */
 	if (!wxr->vert_mode) {
-		return (wxr->ant_pitch_req);
+		return (wxr->ctl.ant_pitch_req);
 	} else {
 		return (-((wxr->ant_pos_vert / (double)wxr->conf->res_x) -
 		    0.5) * wxr->conf->scan_angle_vert);
 	}
 }
 
+/*
+ * Lets the atmosphere skip returns which can't show up on the display,
+ * see scan_min_visible.
+ */
+static void
+min_visible_update(wxr_t *wxr)
+{
+	atomic_store(&wxr->min_visible, scan_min_visible(wxr->colors,
+	    wxr->num_colors, wxr->gain));
+}
+
+/*
+ * Gain is only applied when drawing (see scan_palette_build), so changes
+ * show up on the next frame, without waiting for the antenna to sweep.
+ */
 void
 wxr_set_gain(wxr_t *wxr, double gain)
 {
 	ASSERT3F(gain, >=, 0.0);
 
-	mutex_enter(&wxr->lock);
-	wxr->gain = gain;
-	mutex_exit(&wxr->lock);
+	if (wxr->gain != gain) {
+		wxr->gain = gain;
+		wxr->palette_dirty = B_TRUE;
+		min_visible_update(wxr);
+	}
 }
 
 double
@@ -676,28 +901,37 @@ wxr_set_stab(wxr_t *wxr, double pitch, double roll)
 	ASSERT3F(roll, >=, 0);
 	ASSERT3F(roll, <=, 90);
 
-	mutex_enter(&wxr->lock);
-	wxr->pitch_stab = pitch;
-	wxr->roll_stab = roll;
-	mutex_exit(&wxr->lock);
+	ctl_write_begin(wxr);
+	wxr->ctl.pitch_stab = pitch;
+	wxr->ctl.roll_stab = roll;
+	ctl_write_end(wxr);
 }
 
 void
 wxr_get_stab(const wxr_t *wxr, bool_t *pitch, bool_t *roll)
 {
-	*pitch = wxr->pitch_stab;
-	*roll = wxr->roll_stab;
+	*pitch = wxr->ctl.pitch_stab;
+	*roll = wxr->ctl.roll_stab;
 }
 
+/*
+ * Updates texture rows [row_lo, row_hi) of `tex' from the PBO. The
+ * texture must have already been allocated at full size.
+ */
 static void
-apply_pbo_tex(GLuint pbo, GLuint tex, GLuint res_x, GLuint res_y)
+apply_pbo_tex(GLuint pbo, GLuint tex, GLuint res_x, GLuint row_lo,
+    GLuint row_hi)
 {
 	ASSERT(pbo != 0);
 	ASSERT(tex != 0);
+	ASSERT3U(row_lo, <, row_hi);
 	glBindTexture(GL_TEXTURE_2D, tex);
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, res_x, res_y, 0, GL_RGBA,
-	    GL_UNSIGNED_BYTE, NULL);
+	/* rows of 1-byte samples needn't be 4-byte aligned */
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, row_lo, res_x, row_hi - row_lo,
+	    GL_RED, GL_UNSIGNED_BYTE, NULL);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 }
 
 static void
@@ -718,14 +952,16 @@ async_xfer_setup(GLuint pbo, void *buf, size_t sz)
 }
 
 GLuint
-wxr_get_cur_tex(wxr_t *wxr, bool_t shadow_tex)
+wxr_get_cur_tex(wxr_t *wxr)
 {
 	uint64_t now = microclock();
+	uint64_t start;
 
 	if (wxr->last_upload + TEX_UPD_INTVAL > now && wxr->upload_sync == 0)
 		/* Previous upload still valid & nothing in flight */
 		goto out;
 
+	start = perf_clock();
 	if (wxr->upload_sync != 0) {
 		if (glClientWaitSync(wxr->upload_sync, 0, 0) !=
 		    GL_TIMEOUT_EXPIRED) {
@@ -735,12 +971,11 @@ wxr_get_cur_tex(wxr_t *wxr, bool_t shadow_tex)
 			wxr->cur_tex = !wxr->cur_tex;
 
 			apply_pbo_tex(wxr->pbo, wxr->tex[wxr->cur_tex],
-			    wxr->conf->res_x, wxr->conf->res_y);
-			apply_pbo_tex(wxr->shadow_pbo,
-			    wxr->shadow_tex[wxr->cur_tex],
-			    wxr->conf->res_x, wxr->conf->res_y);
+			    wxr->conf->res_x, wxr->upload_row_lo,
+			    wxr->upload_row_hi);
 
 			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			perf_hist_end(&wxr->perf[WXR_PERF_TEX_UPLOAD], start);
 		}
 	} else {
 		/*
@@ -749,81 +984,157 @@ wxr_get_cur_tex(wxr_t *wxr, bool_t shadow_tex)
 		 * current time as the time of the upload, so that we are
 		 * not slipping frame timing.
 		 */
-		size_t sz = wxr->conf->res_x * wxr->conf->res_y *
+		const wxr_conf_t *conf = wxr->conf;
+		unsigned back = !wxr->cur_tex;
+		uint64_t dirty = atomic_exchange_explicit(&wxr->dirty,
+		    DIRTY_NONE, memory_order_acquire);
+		uint64_t upload;
+		size_t off_lo, off_hi, off, sz;
+
+		wxr->last_upload = now;
+		/*
+		 * Nothing changed, so the front texture is still current
+		 * and we don't need to touch the back texture either.
+		 */
+		if (dirty_empty(dirty))
+			goto out;
+		/*
+		 * The back texture is missing both the newly modified
+		 * columns and whatever went into the front texture since
+		 * the back texture was last updated.
+		 */
+		upload = dirty_union(dirty, wxr->tex_dirty[back]);
+		wxr->tex_dirty[back] = DIRTY_NONE;
+		wxr->tex_dirty[wxr->cur_tex] = dirty_union(
+		    wxr->tex_dirty[wxr->cur_tex], dirty);
+		/*
+		 * Each antenna column is a contiguous run of res_y samples,
+		 * but the texture is laid out in rows of res_x samples, so
+		 * round the span out to whole texture rows.
+		 */
+		off_lo = (upload >> 32) * conf->res_y;
+		off_hi = ((upload & UINT32_MAX) + 1) * conf->res_y;
+		wxr->upload_row_lo = off_lo / conf->res_x;
+		wxr->upload_row_hi = (off_hi + conf->res_x - 1) / conf->res_x;
+		ASSERT3U(wxr->upload_row_hi, <=, conf->res_y);
+		off = wxr->upload_row_lo * conf->res_x;
+		sz = (wxr->upload_row_hi - wxr->upload_row_lo) * conf->res_x *
 		    sizeof (*wxr->samples);
 
-		async_xfer_setup(wxr->pbo, wxr->samples, sz);
-		async_xfer_setup(wxr->shadow_pbo, wxr->shadow_samples, sz);
+		async_xfer_setup(wxr->pbo, &wxr->samples[off], sz);
 		wxr->upload_sync =
 		    glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
-		wxr->last_upload = now;
+		perf_hist_end(&wxr->perf[WXR_PERF_TEX_UPLOAD], start);
 	}
 
 out:
-	if (!shadow_tex)
-		return (wxr->tex[wxr->cur_tex]);
-	else
-		return (wxr->shadow_tex[wxr->cur_tex]);
+	return (wxr->tex[wxr->cur_tex]);
 }
 
+/*
+ * Sample codes mustn't be interpolated, so all filtering is done by
+ * the shader on the resolved colors.
+ */
 static void
 setup_tex_common(GLenum target)
 {
-	glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 }
 
+/*
+ * Re-uploads the palette texture after the gain or colors have changed.
+ * This only uploads, binding it for drawing is up to wxr_bind_tex.
+ */
 static void
-wxr_bind_tex(wxr_t *wxr, bool_t shadow_tex)
+wxr_update_palette(wxr_t *wxr)
 {
-	if (wxr->pbo == 0) {
-		glGenBuffers(1, &wxr->pbo);
-		glGenBuffers(1, &wxr->shadow_pbo);
+	uint32_t palette[SCAN_PALETTE_SZ];
+	uint64_t start;
+
+	if (wxr->palette_tex != 0 && !wxr->palette_dirty)
+		return;
+
+	start = perf_clock();
+	scan_palette_build(palette, wxr->colors, wxr->num_colors, wxr->gain);
+
+	if (wxr->palette_tex == 0) {
+		glGenTextures(1, &wxr->palette_tex);
+		glBindTexture(GL_TEXTURE_2D, wxr->palette_tex);
+		setup_tex_common(GL_TEXTURE_2D);
+	} else {
+		glBindTexture(GL_TEXTURE_2D, wxr->palette_tex);
 	}
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, SCAN_PALETTE_SZ, 1, 0,
+	    GL_RGBA, GL_UNSIGNED_BYTE, palette);
+	wxr->palette_dirty = B_FALSE;
+	perf_hist_end(&wxr->perf[WXR_PERF_COLORIZE], start);
+}
+
+static void
+wxr_bind_tex(wxr_t *wxr)
+{
+	if (wxr->pbo == 0)
+		glGenBuffers(1, &wxr->pbo);
+
+	/* all uploads go through unit 0, so they can't clobber unit 1 */
+	glActiveTexture(GL_TEXTURE0);
+	wxr_update_palette(wxr);
 
 	if (wxr->tex[0] != 0) {
-		GLuint tex = wxr_get_cur_tex(wxr, shadow_tex);
+		GLuint tex = wxr_get_cur_tex(wxr);
 		ASSERT(tex != 0);
-		glActiveTexture(GL_TEXTURE0);
 		glBindTexture(GL_TEXTURE_2D, tex);
 	} else {
 		/* initial texture upload, do a sync upload */
+		uint64_t start = perf_clock();
+
 		ASSERT(wxr->cur_tex == 0);
 
 		glGenTextures(2, wxr->tex);
-		glGenTextures(2, wxr->shadow_tex);
-
 		for (int i = 0; i < 2; i++) {
 			glBindTexture(GL_TEXTURE_2D, wxr->tex[i]);
 			setup_tex_common(GL_TEXTURE_2D);
-			glBindTexture(GL_TEXTURE_2D, wxr->shadow_tex[i]);
-			setup_tex_common(GL_TEXTURE_2D);
 		}
 
-		glActiveTexture(GL_TEXTURE0);
+		/*
+		 * Both textures need to be allocated in full, since later
+		 * uploads only replace the modified rows.
+		 */
+		(void)atomic_exchange(&wxr->dirty, DIRTY_NONE);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		for (int i = 0; i < 2; i++) {
+			glBindTexture(GL_TEXTURE_2D, wxr->tex[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_R8,
+			    wxr->conf->res_x, wxr->conf->res_y, 0,
+			    GL_RED, GL_UNSIGNED_BYTE, wxr->samples);
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
 		glBindTexture(GL_TEXTURE_2D, wxr->tex[0]);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
-		    wxr->conf->res_x, wxr->conf->res_y, 0,
-		    GL_RGBA, GL_UNSIGNED_BYTE, wxr->samples);
-
-		glBindTexture(GL_TEXTURE_2D, wxr->shadow_tex[0]);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
-		    wxr->conf->res_x, wxr->conf->res_y, 0,
-		    GL_RGBA, GL_UNSIGNED_BYTE, wxr->shadow_samples);
-
-		if (!shadow_tex)
-			glBindTexture(GL_TEXTURE_2D, wxr->tex[0]);
-		else
-			glBindTexture(GL_TEXTURE_2D, wxr->shadow_tex[0]);
+		perf_hist_end(&wxr->perf[WXR_PERF_TEX_UPLOAD], start);
 	}
+
+	/*
+	 * Unit 1 is shared with other WXR instances & X-Plane, so the
+	 * palette must be bound on every draw, not just when rebuilt.
+	 */
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, wxr->palette_tex);
+	glActiveTexture(GL_TEXTURE0);
 }
 
+/*
+ * The display geometry is built in a unit square, [0, 1] x [0, 1], and
+ * placed on the screen by the pvm matrix (see wxr_draw_pvm). It only
+ * depends on the scan mode, so it is built once per mode and drawing at
+ * any number of positions & sizes costs no CPU geometry work.
+ */
 static void
-wxr_draw_arc_recache(wxr_t *wxr, vect2_t pos, vect2_t size, bool_t vert)
+wxr_draw_arc_build(wxr_t *wxr, glutils_quads_t *quads, bool_t vert)
 {
 	double scan_angle = !vert ? wxr->conf->scan_angle :
 	    wxr->conf->scan_angle_vert;
@@ -845,73 +1156,100 @@ wxr_draw_arc_recache(wxr_t *wxr, vect2_t pos, vect2_t size, bool_t vert)
 
 		/* lower-left */
 		if (!vert)
-			vtx[i] = VECT2(pos.x + size.x / 2, pos.y);
+			vtx[i] = VECT2(0.5, 0);
 		else
-			vtx[i] = VECT2(pos.x, pos.y + size.y / 2);
+			vtx[i] = VECT2(0, 0.5);
 		tex[i] = VECT2(0, fract1);
 
 		/* upper-left */
 		if (!vert) {
-			vtx[i + 1].x = (pos.x + size.x / 2) +
-			    (sin(angle1) * (size.x / 2));
-			vtx[i + 1].y = pos.y + (cos(angle1) * size.y);
+			vtx[i + 1].x = 0.5 + sin(angle1) * 0.5;
+			vtx[i + 1].y = cos(angle1);
 		} else {
-			vtx[i + 1].x = pos.x + (cos(angle1) * size.x);
-			vtx[i + 1].y = (pos.y + size.y / 2) -
-			    (sin(angle1) * (size.y / 2));
+			vtx[i + 1].x = cos(angle1);
+			vtx[i + 1].y = 0.5 - sin(angle1) * 0.5;
 		}
 		tex[i + 1] = VECT2(1, fract1);
 
 		/* upper-right */
 		if (!vert) {
-			vtx[i + 2].x = (pos.x + size.x / 2) +
-			    (sin(angle2) * (size.x / 2));
-			vtx[i + 2].y = pos.y + (cos(angle2) * size.y);
+			vtx[i + 2].x = 0.5 + sin(angle2) * 0.5;
+			vtx[i + 2].y = cos(angle2);
 		} else {
-			vtx[i + 2].x = pos.x + (cos(angle2) * size.x);
-			vtx[i + 2].y = (pos.y + size.y / 2) -
-			    (sin(angle2) * (size.y / 2));
+			vtx[i + 2].x = cos(angle2);
+			vtx[i + 2].y = 0.5 - sin(angle2) * 0.5;
 		}
 		tex[i + 2] = VECT2(1, fract2);
 
 		/* lower-right */
 		if (!vert)
-			vtx[i + 3] = VECT2(pos.x + size.x / 2, pos.y);
+			vtx[i + 3] = VECT2(0.5, 0);
 		else
-			vtx[i + 3] = VECT2(pos.x, pos.y + size.y / 2);
+			vtx[i + 3] = VECT2(0, 0.5);
 		tex[i + 3] = VECT2(0, fract2);
 	}
 
-	glutils_destroy_quads(&wxr->wxr_scr_quads);
-	glutils_init_2D_quads(&wxr->wxr_scr_quads, vtx, tex, num_coords);
+	glutils_init_2D_quads(quads, vtx, tex, num_coords);
 }
 
 static void
-wxr_draw_arc(wxr_t *wxr, vect2_t pos, vect2_t size)
+wxr_draw_square_build(glutils_quads_t *quads, bool_t vert)
 {
-	GLfloat pvm[16];
-
-	if (!VECT2_EQ(pos, wxr->draw_pos) || !VECT2_EQ(size, wxr->draw_size) ||
-	    wxr->draw_vert != wxr->vert_mode) {
-		wxr_draw_arc_recache(wxr, pos, size, wxr->vert_mode);
-		wxr->draw_pos = pos;
-		wxr->draw_size = size;
-		wxr->draw_vert = wxr->vert_mode;
+	vect2_t vtx[4];
+	vect2_t tex[4] = {
+	    VECT2(0, 0), VECT2(1, 0), VECT2(1, 1), VECT2(0, 1)
+	};
+
+	if (!vert) {
+		vtx[0] = VECT2(0, 0);
+		vtx[1] = VECT2(0, 1);
+		vtx[2] = VECT2(1, 1);
+		vtx[3] = VECT2(1, 0);
+	} else {
+		vtx[0] = VECT2(0, 1);
+		vtx[1] = VECT2(1, 1);
+		vtx[2] = VECT2(1, 0);
+		vtx[3] = VECT2(0, 0);
 	}
+	glutils_init_2D_quads(quads, vtx, tex, 4);
+}
+
+/*
+ * Maps the unit square of the display geometry to `pos' & `size' in the
+ * current viewport.
+ */
+static void
+wxr_draw_pvm(vect2_t pos, vect2_t size, mat4 pvm)
+{
+	glutils_vp2pvm((GLfloat *)pvm);
+	glm_translate(pvm, (vec3){ pos.x, pos.y, 0 });
+	glm_scale(pvm, (vec3){ size.x, size.y, 1 });
+}
+
+static void
+wxr_draw_arc(wxr_t *wxr, vect2_t pos, vect2_t size)
+{
+	glutils_quads_t *quads = &wxr->wxr_scr_quads[wxr->vert_mode];
+	mat4 pvm;
+
+	if (quads->vbo == 0)
+		wxr_draw_arc_build(wxr, quads, wxr->vert_mode);
 
 	glUseProgram(wxr->wxr_prog);
 
-	glutils_vp2pvm(pvm);
+	wxr_draw_pvm(pos, size, pvm);
 
-	glUniformMatrix4fv(wxr->wxr_prog_loc.pvm, 1, GL_FALSE, pvm);
+	glUniformMatrix4fv(wxr->wxr_prog_loc.pvm, 1, GL_FALSE,
+	    (GLfloat *)pvm);
 	glUniform1i(wxr->wxr_prog_loc.tex, 0);
+	glUniform1i(wxr->wxr_prog_loc.palette, 1);
 	glUniform2f(wxr->wxr_prog_loc.tex_size,
 	    wxr->conf->res_x, wxr->conf->res_y);
 	glUniform1f(wxr->wxr_prog_loc.smear_mult,
 	    wxr->vert_mode ? wxr->conf->smear.y : wxr->conf->smear.x);
 	glUniform1f(wxr->wxr_prog_loc.brt, wxr->brt);
 
-	glutils_draw_quads(&wxr->wxr_scr_quads, wxr->wxr_prog);
+	glutils_draw_quads(quads, wxr->wxr_prog);
 
 	glUseProgram(0);
 }
@@ -919,44 +1257,24 @@ wxr_draw_arc(wxr_t *wxr, vect2_t pos, vect2_t size)
 static void
 wxr_draw_square(wxr_t *wxr, vect2_t pos, vect2_t size)
 {
-	GLfloat pvm[16];
+	glutils_quads_t *quads = &wxr->wxr_scr_quads[wxr->vert_mode];
+	mat4 pvm;
+
+	if (quads->vbo == 0)
+		wxr_draw_square_build(quads, wxr->vert_mode);
 
 	glUseProgram(wxr->wxr_prog);
 
-	glutils_vp2pvm(pvm);
+	wxr_draw_pvm(pos, size, pvm);
 
-	glUniformMatrix4fv(wxr->wxr_prog_loc.pvm, 1, GL_FALSE, pvm);
+	glUniformMatrix4fv(wxr->wxr_prog_loc.pvm, 1, GL_FALSE,
+	    (GLfloat *)pvm);
 	glUniform1i(wxr->wxr_prog_loc.tex, 0);
+	glUniform1i(wxr->wxr_prog_loc.palette, 1);
 	glUniform2f(wxr->wxr_prog_loc.tex_size,
 	    wxr->conf->res_x, wxr->conf->res_y);
 
-	if (!VECT2_EQ(pos, wxr->draw_pos) || !VECT2_EQ(size, wxr->draw_size) ||
-	    wxr->draw_vert != wxr->vert_mode) {
-		vect2_t vtx[4];
-		vect2_t tex[4] = {
-		    VECT2(0, 0), VECT2(1, 0), VECT2(1, 1), VECT2(0, 1)
-		};
-
-		if (!wxr->vert_mode) {
-			vtx[0] = VECT2(pos.x, pos.y);
-			vtx[1] = VECT2(pos.x, pos.y + size.y);
-			vtx[2] = VECT2(pos.x + size.x, pos.y + size.y);
-			vtx[3] = VECT2(pos.x + size.x, pos.y);
-		} else {
-			vtx[0] = VECT2(pos.x, pos.y + size.y);
-			vtx[1] = VECT2(pos.x + size.x, pos.y + size.y);
-			vtx[2] = VECT2(pos.x + size.x, pos.y);
-			vtx[3] = VECT2(pos.x, pos.y);
-		}
-		glutils_destroy_quads(&wxr->wxr_scr_quads);
-		glutils_init_2D_quads(&wxr->wxr_scr_quads, vtx, tex, 4);
-
-		wxr->draw_pos = pos;
-		wxr->draw_size = size;
-		wxr->draw_vert = wxr->vert_mode;
-	}
-
-	glutils_draw_quads(&wxr->wxr_scr_quads, wxr->wxr_prog);
+	glutils_draw_quads(quads, wxr->wxr_prog);
 
 	glUseProgram(0);
 }
@@ -966,18 +1284,14 @@ wxr_draw(wxr_t *wxr, vect2_t pos, vect2_t size)
 {
 	XPLMSetGraphicsState(0, 1, 0, 1, 1, 1, 1);
 	glutils_reset_errors();
-	wxr_bind_tex(wxr, B_FALSE);
+	wxr_bind_tex(wxr);
+	/* the shader composites the beam shadow in the same pass */
 	if (wxr->conf->disp_type == WXR_DISP_ARC) {
 		wxr_draw_arc(wxr, pos, size);
 	} else {
 		ASSERT3U(wxr->conf->disp_type, ==, WXR_DISP_SQUARE);
 		wxr_draw_square(wxr, pos, size);
 	}
-	wxr_bind_tex(wxr, B_TRUE);
-	if (wxr->conf->disp_type == WXR_DISP_ARC)
-		wxr_draw_arc(wxr, pos, size);
-	else
-		wxr_draw_square(wxr, pos, size);
 }
 
 void
@@ -1001,18 +1315,68 @@ wxr_set_standby(wxr_t *wxr, bool_t flag)
 	wxr->standby = flag;
 	wxr->vert_mode = B_FALSE;
 	if (flag) {
-		worker_fini(&wxr->wk);
+		worker_stop(wxr);
 		wxr_ant_return2neutral(wxr);
 		memset(wxr->samples, 0, sizeof (*wxr->samples) *
 		    wxr->conf->res_x * wxr->conf->res_y);
-		memset(wxr->shadow_samples, 0, sizeof (*wxr->samples) *
-		    wxr->conf->res_x * wxr->conf->res_y);
+		dirty_add(wxr, 0, wxr->conf->res_x - 1);
 	} else {
-		worker_init(&wxr->wk, wxr_worker, wxr->worker_intval, wxr,
+		sched_reset(wxr);
+		worker_init(&wxr->wk, wxr_worker, SCHED_MIN_WAIT, wxr,
 		    "OpenWXR-worker");
 	}
 }
 
+/*
+ * Can be called from any thread. The counters are sampled one by one, so
+ * they may be off by one tick relative to each other.
+ */
+void
+wxr_get_sched_stats(const wxr_t *wxr, wxr_sched_stats_t *stats)
+{
+	stats->ticks = atomic_load(&wxr->stats.ticks);
+	stats->missed = atomic_load(&wxr->stats.missed);
+	stats->lines = atomic_load(&wxr->stats.lines);
+	stats->lines_shed = atomic_load(&wxr->stats.lines_shed);
+	stats->load = atomic_load(&wxr->stats.load);
+}
+
+/*
+ * Copies out the instance's phase timing. The EFIS phase is left out,
+ * as the EFIS map is shared by all instances using the XP11 atmosphere.
+ */
+void
+wxr_perf_snap(const wxr_t *wxr, perf_hist_snap_t snaps[WXR_NUM_PERF_PHASES])
+{
+	for (int i = 0; i < WXR_NUM_PERF_PHASES; i++)
+		perf_hist_snap(&wxr->perf[i], &snaps[i]);
+}
+
+/*
+ * Can be called from any thread. The recent part of the statistics
+ * covers the last PERF_STATS_WIN to twice that, counting from the
+ * first call, so it is best called at least that often.
+ */
+void
+wxr_get_perf_stats(wxr_t *wxr, wxr_perf_stats_t *stats)
+{
+	const perf_hist_t *efis = atmo_xp11_get_efis_perf(wxr->atmo);
+	perf_hist_snap_t cur[WXR_NUM_PERF_PHASES];
+	perf_hist_snap_t recent[WXR_NUM_PERF_PHASES];
+	uint64_t win;
+
+	wxr_perf_snap(wxr, cur);
+	if (efis != NULL)
+		perf_hist_snap(efis, &cur[WXR_PERF_EFIS]);
+
+	mutex_enter(&wxr->perf_lock);
+	win = perf_win_update(&wxr->perf_win, cur, perf_clock(),
+	    PERF_STATS_WIN, recent);
+	mutex_exit(&wxr->perf_lock);
+
+	perf_stats_fill(cur, recent, win, stats);
+}
+
 bool_t
 wxr_get_standby(const wxr_t *wxr)
 {
@@ -1037,13 +1401,10 @@ wxr_clear_screen(wxr_t *wxr)
 	if (!wxr->standby)
 		mutex_enter(&wxr->wk.lock);
 
-	mutex_enter(&wxr->lock);
 	memset(wxr->samples, 0,
 	    sizeof (*wxr->samples) * wxr->conf->res_x * wxr->conf->res_y);
-	memset(wxr->shadow_samples, 0,
-	    sizeof (*wxr->samples) * wxr->conf->res_x * wxr->conf->res_y);
+	dirty_add(wxr, 0, wxr->conf->res_x - 1);
 	wxr->scr_clear_time = microclock();
-	mutex_exit(&wxr->lock);
 
 	if (!wxr->standby)
 		mutex_exit(&wxr->wk.lock);
@@ -1057,8 +1418,6 @@ wxr_set_vert_mode(wxr_t *wxr, bool_t flag, double azimuth)
 	if (!wxr->standby)
 		mutex_enter(&wxr->wk.lock);
 
-	mutex_enter(&wxr->lock);
-
 	ASSERT3F(ABS(azimuth), <=, wxr->conf->scan_angle / 2);
 
 	if (flag) {
@@ -1068,22 +1427,20 @@ wxr_set_vert_mode(wxr_t *wxr, bool_t flag, double azimuth)
 	}
 	if (flag && !wxr->vert_mode) {
 		wxr->vert_mode = B_TRUE;
-		wxr->ant_pos_vert = clampi(((wxr->ant_pitch_req +
+		wxr->ant_pos_vert = clampi(((wxr->ctl.ant_pitch_req +
 		    wxr->conf->scan_angle_vert / 2) /
 		    wxr->conf->scan_angle_vert) * wxr->conf->res_x, 0,
 		    wxr->conf->res_x - 1);
 		memset(wxr->samples, 0, sizeof (*wxr->samples) *
 		    wxr->conf->res_x * wxr->conf->res_y);
+		dirty_add(wxr, 0, wxr->conf->res_x - 1);
 	} else if (!flag && wxr->vert_mode) {
 		wxr->vert_mode = B_FALSE;
 		memset(wxr->samples, 0, sizeof (*wxr->samples) *
 		    wxr->conf->res_x * wxr->conf->res_y);
-		memset(wxr->shadow_samples, 0, sizeof (*wxr->samples) *
-		    wxr->conf->res_x * wxr->conf->res_y);
+		dirty_add(wxr, 0, wxr->conf->res_x - 1);
 	}
 
-	mutex_exit(&wxr->lock);
-
 	if (!wxr->standby)
 		mutex_exit(&wxr->wk.lock);
 }
@@ -1096,19 +1453,21 @@ wxr_get_vert_mode(const wxr_t *wxr)
 
 /*
  * Colors should be in big-endian RGBA ('R' in top bits, 'A' in bottom bits).
+ * Like the gain, colors are only applied when drawing, so a new color set
+ * shows up on the next frame. This is cheap to call with an unchanged
+ * color set, the palette is only rebuilt when the colors actually change.
  */
 void
 wxr_set_colors(wxr_t *wxr, const wxr_color_t *colors, size_t num)
 {
-	if (wxr->num_colors == 0 ||
-	    memcmp(colors, wxr->colors,
-	    wxr->num_colors * sizeof (*colors)) != 0) {
-		mutex_enter(&wxr->lock);
-		free(wxr->colors);
-		wxr->colors = calloc(num, sizeof (*colors));
+	ASSERT3U(num, <=, SCAN_MAX_COLORS);
+
+	if (num != wxr->num_colors || memcmp(colors, wxr->colors,
+	    num * sizeof (*colors)) != 0) {
 		memcpy(wxr->colors, colors, num * sizeof (*colors));
 		wxr->num_colors = num;
-		mutex_exit(&wxr->lock);
+		wxr->palette_dirty = B_TRUE;
+		min_visible_update(wxr);
 	}
 }
 
@@ -1125,6 +1484,8 @@ wxr_reload_gl_progs(wxr_t *wxr)
 	wxr->wxr_prog_loc.smear_mult =
 	    glGetUniformLocation(wxr->wxr_prog, "smear_mult");
 	wxr->wxr_prog_loc.brt = glGetUniformLocation(wxr->wxr_prog, "brt");
+	wxr->wxr_prog_loc.palette =
+	    glGetUniformLocation(wxr->wxr_prog, "palette");
 
 	return (B_TRUE);
 }
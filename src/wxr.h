@@ -22,6 +22,7 @@
 #include <acfutils/geom.h>
 
 #include "atmo.h"
+#include "perf_hist.h"
 #include <openwxr/wxr_intf.h>
 #include <openwxr/xplane_api.h>
 
@@ -30,6 +31,8 @@ extern "C" {
 #endif
 
 wxr_t *wxr_init(const wxr_conf_t *conf, const atmo_t *atmo);
+wxr_t *wxr_init_ext(const wxr_conf_t *conf, const wxr_conf_ext_t *ext,
+    const atmo_t *atmo);
 void wxr_fini(wxr_t *wxr);
 
 void wxr_set_acf_pos(wxr_t *wxr, geo_pos3_t pos, vect3_t orient);
@@ -71,6 +74,11 @@ void wxr_set_colors(wxr_t *wxr, const wxr_color_t *colors, size_t num);
 
 bool_t wxr_reload_gl_progs(wxr_t *wxr);
 
+void wxr_get_sched_stats(const wxr_t *wxr, wxr_sched_stats_t *stats);
+void wxr_get_perf_stats(wxr_t *wxr, wxr_perf_stats_t *stats);
+void wxr_perf_snap(const wxr_t *wxr,
+    perf_hist_snap_t snaps[WXR_NUM_PERF_PHASES]);
+
 #ifdef __cplusplus
 }
 #endif
@@ -36,10 +36,14 @@
 #include <acfutils/time.h>
 #include <acfutils/thread.h>
 
+#include "atmo_reg.h"
+#include "atmo_vox.h"
 #include "atmo_xp11.h"
 #include "dbg_log.h"
 #include "fontmgr.h"
 #include <openwxr/xplane_api.h>
+#include "perf_stats.h"
+#include "scan_pool.h"
 #include "standalone.h"
 #include "wxr.h"
 #include "xplane.h"
@@ -54,6 +58,9 @@ char			plugindir[512];
 static int		xp_ver, xplm_ver;
 XPLMHostApplicationID	host_id;
 static atmo_t		*atmo = NULL;
+static openwxr_atmo_provider_t xp11_prov;
+static const openwxr_atmo_provider_t *vox_prov = NULL;
+static scan_pool_t	*scan_pool = NULL;
 
 static openwxr_intf_t openwxr_intf = {
 	.init = wxr_init,
@@ -80,7 +87,10 @@ static openwxr_intf_t openwxr_intf = {
 	.set_colors = wxr_set_colors,
 	.get_brightness = wxr_get_brightness,
 	.set_brightness = wxr_set_brightness,
-	.reload_gl_progs = wxr_reload_gl_progs
+	.reload_gl_progs = wxr_reload_gl_progs,
+	.get_sched_stats = wxr_get_sched_stats,
+	.get_perf_stats = wxr_get_perf_stats,
+	.init_ext = wxr_init_ext
 };
 
 static conf_t *
@@ -108,6 +118,67 @@ load_config_file(void)
 	return (conf);
 }
 
+/*
+ * Parses a list of CPU numbers & ranges, such as "0,2,4-7", into a CPU
+ * mask for scan_pool_init. Only the first 64 CPUs can be selected.
+ */
+static bool_t
+parse_cpu_list(const char *str, uint64_t *mask)
+{
+	*mask = 0;
+	while (*str != '\0') {
+		char *end;
+		unsigned long lo, hi;
+
+		lo = strtoul(str, &end, 10);
+		if (end == str)
+			return (B_FALSE);
+		hi = lo;
+		if (*end == '-') {
+			str = end + 1;
+			hi = strtoul(str, &end, 10);
+			if (end == str)
+				return (B_FALSE);
+		}
+		if (lo > hi || hi >= 64)
+			return (B_FALSE);
+		for (unsigned long i = lo; i <= hi; i++)
+			*mask |= (1ull << i);
+		str = end;
+		if (*str == ',')
+			str++;
+		else if (*str != '\0')
+			return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+/*
+ * Sets up the scan pool shared by all WXR instances (see wxr_init). By
+ * default, we take a quarter of the CPUs, since X-Plane itself keeps
+ * most of them busy.
+ */
+static void
+scan_pool_setup(const conf_t *conf)
+{
+	int num_threads = 0;
+	uint64_t cpu_mask = 0;
+	const char *str;
+
+	conf_get_i(conf, "scan_pool/threads", &num_threads);
+	if (num_threads <= 0)
+		num_threads = MAX(scan_pool_num_cpus() / 4, 1);
+	num_threads = MIN(num_threads, SCAN_POOL_MAX_THREADS);
+	if (conf_get_str(conf, "scan_pool/cpus", &str) &&
+	    !parse_cpu_list(str, &cpu_mask)) {
+		logMsg("Invalid scan_pool/cpus value \"%s\", not setting "
+		    "scan thread CPU affinity", str);
+		cpu_mask = 0;
+	}
+	scan_pool = scan_pool_init(num_threads, cpu_mask);
+	logMsg("Scan pool: %d threads", num_threads);
+}
+
 PLUGIN_API int
 XPluginStart(char *name, char *sig, char *desc)
 {
@@ -181,15 +252,30 @@ XPluginStart(char *name, char *sig, char *desc)
 	if (conf == NULL)
 		conf = conf_create_empty();
 	dbg_log_init(conf);
-	conf_free(conf);
 
 	/*
 	 * Must go ahead of XPluginEnable to always have an atmosphere
 	 * ready for when external avionics start creating wxr_t instances.
 	 */
-	atmo = atmo_xp11_init();
-	if (atmo == NULL)
+	atmo_reg_init();
+	atmo = atmo_xp11_init(conf);
+	if (atmo == NULL) {
+		conf_free(conf);
+		atmo_reg_fini();
 		return (0);
+	}
+	/* probes of the XP11 atmosphere don't take any locks */
+	strlcpy(xp11_prov.name, ATMO_REG_DEFAULT, sizeof (xp11_prov.name));
+	xp11_prov.caps = OPENWXR_ATMO_CAP_MT_SAFE;
+	xp11_prov.atmo = atmo;
+	VERIFY(atmo_reg_add(&xp11_prov));
+
+	vox_prov = atmo_vox_init(conf);
+	if (vox_prov != NULL)
+		VERIFY(atmo_reg_add(vox_prov));
+	scan_pool_setup(conf);
+	perf_stats_init();
+	conf_free(conf);
 
 	return (1);
 }
@@ -202,7 +288,18 @@ XPluginStop(void)
 	 * been shut down by external avionics, so we can't do this
 	 * in XPluginDisable.
 	 */
+	perf_stats_fini();
+	if (vox_prov != NULL)
+		(void)atmo_reg_remove(vox_prov);
+	if (atmo != NULL)
+		(void)atmo_reg_remove(&xp11_prov);
+	atmo_reg_fini();
+	atmo_vox_fini();
 	atmo_xp11_fini();
+	scan_pool_fini(scan_pool);
+	atmo = NULL;
+	vox_prov = NULL;
+	scan_pool = NULL;
 }
 
 PLUGIN_API int
@@ -253,6 +350,18 @@ XPluginReceiveMessage(XPLMPluginID from, int msg, void *param)
 		ASSERT(atmo != NULL);
 		*(atmo_t **)param = atmo;
 		break;
+	case OPENWXR_ATMO_REGISTER:
+		ASSERT(param != NULL);
+		(void)atmo_reg_add(param);
+		break;
+	case OPENWXR_ATMO_UNREGISTER:
+		ASSERT(param != NULL);
+		(void)atmo_reg_remove(param);
+		break;
+	case OPENWXR_ATMO_VOX_GET:
+		ASSERT(param != NULL);
+		*(const openwxr_atmo_vox_intf_t **)param = atmo_vox_get_intf();
+		break;
 	case OPENWXR_ATMO_XP11_SET_EFIS: {
 		unsigned *coords = param;
 		atmo_xp11_set_efis_pos(coords[0], coords[1],
@@ -274,6 +383,15 @@ get_plugindir(void)
 	return (plugindir);
 }
 
+/*
+ * Returns the scan pool shared by all WXR instances.
+ */
+scan_pool_t *
+get_scan_pool(void)
+{
+	return (scan_pool);
+}
+
 int
 get_xpver(void)
 {
@@ -22,6 +22,8 @@
 #include <XPLMDefs.h>
 #include <XPLMUtilities.h>
 
+#include "scan_pool.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -37,6 +39,7 @@ PLUGIN_API void XPluginReceiveMessage(XPLMPluginID from, int msg, void *param);
 
 const char *get_xpdir(void);
 const char *get_plugindir(void);
+scan_pool_t *get_scan_pool(void);
 
 int get_xpver(void);
 